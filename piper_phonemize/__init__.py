@@ -1,7 +1,7 @@
 from collections import Counter
 from enum import Enum
 from pathlib import Path
-from typing import Dict, List, Optional, Union
+from typing import Any, Dict, List, Optional, Union
 
 from piper_phonemize_cpp import (
     phonemize_espeak as _phonemize_espeak,
@@ -12,6 +12,9 @@ from piper_phonemize_cpp import (
     get_codepoints_map,
     get_max_phonemes,
     tashkeel_run as _tashkeel_run,
+    tashkeel_cache_stats as _tashkeel_cache_stats,
+    get_stats as _get_stats,
+    reset_stats,
 )
 
 _DIR = Path(__file__).parent
@@ -31,19 +34,24 @@ def phonemize_espeak(
     text: str,
     voice: str,
     data_path: Optional[Union[str, Path]] = None,
+    max_phonemes: int = 0,
 ) -> List[List[str]]:
+    """Split sentences longer than max_phonemes at clauses/spaces (0 = no limit)"""
     if data_path is None:
         data_path = _DIR / "espeak-ng-data"
 
-    return _phonemize_espeak(text, voice, str(data_path))
+    return _phonemize_espeak(text, voice, str(data_path), max_phonemes)
 
 
 def phonemize_codepoints(
     text: str,
     casing: Union[str, TextCasing] = TextCasing.FOLD,
+    split_sentences: bool = False,
+    num_threads: int = 1,
 ) -> List[List[str]]:
+    """Split sentences after . ? ! etc. on num_threads (0 = one per CPU)"""
     casing = TextCasing(casing)
-    return _phonemize_codepoints(text, casing.value)
+    return _phonemize_codepoints(text, casing.value, split_sentences, num_threads)
 
 
 def phoneme_ids_espeak(
@@ -69,6 +77,26 @@ def phoneme_ids_codepoints(
     return phoneme_ids
 
 
-def tashkeel_run(text: str, tashkeel_model: Union[str, Path] = _TASHKEEL_MODEL) -> str:
+def tashkeel_run(
+    text: str,
+    tashkeel_model: Union[str, Path] = _TASHKEEL_MODEL,
+    skip_diacritized: bool = False,
+    cache_bytes: int = 0,
+) -> str:
+    tashkeel_model = str(tashkeel_model)
+    return _tashkeel_run(tashkeel_model, text, skip_diacritized, cache_bytes)
+
+
+def tashkeel_cache_stats(
+    tashkeel_model: Union[str, Path] = _TASHKEEL_MODEL
+) -> Dict[str, int]:
     tashkeel_model = str(tashkeel_model)
-    return _tashkeel_run(tashkeel_model, text)
+    return _tashkeel_cache_stats(tashkeel_model)
+
+
+def get_stats() -> Dict[str, Any]:
+    """Per-stage latency and throughput stats from all threads.
+
+    Only collected when built with PIPER_PHONEMIZE_STATS=1 (see "enabled").
+    """
+    return _get_stats()
@@ -0,0 +1,292 @@
+"""Replays a request log through the Python binding at a target rate.
+
+Same log format and output as replay_piper_phonemize:
+
+    python3 -m piper_phonemize.replay --log requests.jsonl --qps 100 --threads 4
+
+Each log line is {"text": ..., "language": ..., "timestamp": ...} or plain text.
+"""
+import argparse
+import json
+import os
+import sys
+import threading
+import time
+from pathlib import Path
+from typing import Any, Dict, List, Optional, Tuple
+
+from . import (
+    _TASHKEEL_MODEL,
+    phoneme_ids_espeak,
+    phonemize_espeak,
+    tashkeel_cache_stats,
+    tashkeel_run,
+)
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(prog="piper_phonemize.replay")
+    parser.add_argument("--log", required=True, help="Request log")
+    parser.add_argument("--espeak-data", help="Path to espeak-ng-data directory")
+    parser.add_argument(
+        "--tashkeel-model",
+        default=str(_TASHKEEL_MODEL),
+        help="Path to libtashkeel model (for Arabic)",
+    )
+    parser.add_argument(
+        "--language",
+        default="en-us",
+        help="Language of requests without one (default: en-us)",
+    )
+    parser.add_argument(
+        "--target", choices=("pipeline", "espeak", "tashkeel"), default="pipeline"
+    )
+    parser.add_argument(
+        "--qps", type=float, default=0, help="Requests per second (default: log)"
+    )
+    parser.add_argument(
+        "--speed", type=float, default=1, help="Divide log timestamps by this"
+    )
+    parser.add_argument("--threads", type=int, default=4)
+    parser.add_argument(
+        "--duration", type=float, default=0, help="Repeat log for this many seconds"
+    )
+    parser.add_argument("--report-seconds", type=float, default=10)
+    args = parser.parse_args()
+
+    requests = _load_log(args.log, args.language)
+    if args.qps > 0:
+        log_seconds = len(requests) / args.qps
+    else:
+        log_seconds = requests[-1]["timestamp"] / args.speed
+
+    def scheduled_seconds(n: int) -> Optional[float]:
+        """Time from start that request n is due, or None when done."""
+        pass_idx, request_idx = divmod(n, len(requests))
+        if args.qps > 0:
+            seconds = request_idx / args.qps
+        else:
+            seconds = requests[request_idx]["timestamp"] / args.speed
+
+        # Leave one request interval between passes
+        seconds += pass_idx * (log_seconds + (log_seconds / len(requests)))
+        if (pass_idx > 0) and (seconds >= args.duration):
+            return None
+
+        return seconds
+
+    def process_request(request: Dict[str, Any]) -> None:
+        text = request["text"]
+        if (request["language"] == "ar") and (args.target != "espeak"):
+            text = tashkeel_run(text, args.tashkeel_model)
+
+        if args.target == "tashkeel":
+            return
+
+        sentences = phonemize_espeak(text, request["language"], args.espeak_data)
+        if args.target == "pipeline":
+            for phonemes in sentences:
+                phoneme_ids_espeak(phonemes)
+
+    lock = threading.Lock()
+    window_latency_ms: List[float] = []
+    window_errors = [0]
+    next_request = [0]
+    start_time = time.monotonic()
+
+    def worker() -> None:
+        while True:
+            with lock:
+                n = next_request[0]
+                next_request[0] += 1
+
+            seconds = scheduled_seconds(n)
+            if seconds is None:
+                break
+
+            due_time = start_time + seconds
+            delay = due_time - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+
+            failed = False
+            try:
+                process_request(requests[n % len(requests)])
+            except Exception:
+                failed = True
+
+            # Measured from when the request was due, not when it started
+            latency_ms = (time.monotonic() - due_time) * 1000
+            with lock:
+                window_latency_ms.append(latency_ms)
+                if failed:
+                    window_errors[0] += 1
+
+    threads = [threading.Thread(target=worker, daemon=True) for _ in range(args.threads)]
+    start_rss_kb = _resident_kilobytes()
+    for thread in threads:
+        thread.start()
+
+    all_latency_ms: List[float] = []
+    rss_samples: List[Tuple[float, int]] = []
+    total_errors = 0
+    window_idx = 0
+    next_report_time = start_time + args.report_seconds
+
+    while True:
+        finished = False
+        while time.monotonic() < next_report_time:
+            if not any(thread.is_alive() for thread in threads):
+                finished = True
+                break
+
+            time.sleep(0.05)
+
+        with lock:
+            latency_ms = window_latency_ms[:]
+            window_latency_ms.clear()
+            errors = window_errors[0]
+            window_errors[0] = 0
+
+        if finished and (not latency_ms) and (window_idx > 0):
+            # Nothing finished since the last report
+            break
+
+        elapsed_seconds = time.monotonic() - start_time
+        rss_kb = _resident_kilobytes()
+        rss_samples.append((elapsed_seconds, rss_kb))
+        total_errors += errors
+        all_latency_ms.extend(latency_ms)
+
+        report = {
+            "window": window_idx,
+            "elapsed_seconds": elapsed_seconds,
+            "requests": len(latency_ms),
+            "errors": errors,
+            "latency_ms": _summarize(latency_ms),
+            "rss_kb": rss_kb,
+        }
+        print(json.dumps(report), flush=True)
+
+        window_idx += 1
+        next_report_time += args.report_seconds
+
+        if finished:
+            break
+
+    elapsed_seconds = time.monotonic() - start_time
+
+    # First window includes eSpeak voice loading, caches filling up, etc.
+    steady_rss_samples = rss_samples[1:] if len(rss_samples) > 2 else rss_samples
+
+    summary = {
+        "requests": len(all_latency_ms),
+        "errors": total_errors,
+        "elapsed_seconds": elapsed_seconds,
+        "qps": len(all_latency_ms) / elapsed_seconds,
+        "threads": args.threads,
+        "latency_ms": _summarize(all_latency_ms),
+        "rss_start_kb": start_rss_kb,
+        "rss_end_kb": rss_samples[-1][1],
+        "rss_growth_kb": rss_samples[-1][1] - start_rss_kb,
+        "rss_growth_kb_per_hour": _rss_slope(steady_rss_samples),
+    }
+
+    if any(request["language"] == "ar" for request in requests) and (
+        args.target != "espeak"
+    ):
+        summary["tashkeel_cache"] = tashkeel_cache_stats(args.tashkeel_model)
+
+    print(json.dumps({"summary": summary}), flush=True)
+
+    if total_errors > 0:
+        sys.exit(1)
+
+
+# -----------------------------------------------------------------------------
+
+
+def _load_log(log_path: str, default_language: str) -> List[Dict[str, Any]]:
+    requests: List[Dict[str, Any]] = []
+    with open(log_path, "r", encoding="utf-8") as log_file:
+        for line in log_file:
+            line = line.rstrip("\n")
+            if not line:
+                continue
+
+            if line.startswith("{"):
+                line_obj = json.loads(line)
+            else:
+                line_obj = {"text": line}
+
+            requests.append(
+                {
+                    "text": line_obj["text"],
+                    "language": line_obj.get("language", default_language),
+                    "timestamp": float(line_obj.get("timestamp", 0)),
+                }
+            )
+
+    if not requests:
+        raise ValueError("Log is empty")
+
+    # Timestamps are relative to the first request
+    first_timestamp = requests[0]["timestamp"]
+    for request in requests:
+        request["timestamp"] = max(0.0, request["timestamp"] - first_timestamp)
+
+    return requests
+
+
+def _resident_kilobytes() -> int:
+    """Current resident set size."""
+    statm_path = Path("/proc/self/statm")
+    if statm_path.exists():
+        resident_pages = int(statm_path.read_text().split()[1])
+        return resident_pages * (os.sysconf("SC_PAGESIZE") // 1024)
+
+    # Peak instead of current (kilobytes on Linux, bytes on macOS)
+    import resource
+
+    max_rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    if sys.platform == "darwin":
+        return max_rss // 1024
+
+    return max_rss
+
+
+def _summarize(latency_ms: List[float]) -> Optional[Dict[str, float]]:
+    if not latency_ms:
+        return None
+
+    latency_ms = sorted(latency_ms)
+
+    def percentile(p: float) -> float:
+        return latency_ms[int(p * (len(latency_ms) - 1) + 0.5)]
+
+    return {
+        "p50": percentile(0.5),
+        "p95": percentile(0.95),
+        "p99": percentile(0.99),
+        "p999": percentile(0.999),
+        "max": latency_ms[-1],
+    }
+
+
+def _rss_slope(rss_samples: List[Tuple[float, int]]) -> float:
+    """Least squares slope of RSS over time (kilobytes per hour)."""
+    if len(rss_samples) < 2:
+        return 0
+
+    mean_x = sum(x for x, _ in rss_samples) / len(rss_samples)
+    mean_y = sum(y for _, y in rss_samples) / len(rss_samples)
+    covariance = sum((x - mean_x) * (y - mean_y) for x, y in rss_samples)
+    variance = sum((x - mean_x) ** 2 for x, _ in rss_samples)
+    if variance <= 0:
+        return 0
+
+    return (covariance / variance) * 3600
+
+
+if __name__ == "__main__":
+    main()
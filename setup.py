@@ -1,3 +1,4 @@
+import os
 import platform
 from pathlib import Path
 
@@ -12,16 +13,28 @@ _ONNXRUNTIME_DIR = _LIB_DIR / "onnxruntime"
 
 __version__ = "1.2.0"
 
+_DEFINE_MACROS = [("VERSION_INFO", __version__)]
+if os.environ.get("PIPER_PHONEMIZE_STATS"):
+    # Collect per-stage latency stats (see get_stats)
+    _DEFINE_MACROS.append(("PIPERPHONEMIZE_STATS", None))
+
 ext_modules = [
     Pybind11Extension(
         "piper_phonemize_cpp",
         [
             "src/python.cpp",
             "src/phonemize.cpp",
+            "src/normalize.cpp",
             "src/phoneme_ids.cpp",
+            "src/phoneme_id_table.cpp",
+            "src/phoneme_inventory.cpp",
+            "src/phoneme_rewriter.cpp",
             "src/tashkeel.cpp",
+            "src/stats.cpp",
+            "src/trace.cpp",
+            "src/thread_pool.cpp",
         ],
-        define_macros=[("VERSION_INFO", __version__)],
+        define_macros=_DEFINE_MACROS,
         include_dirs=[str(_ESPEAK_DIR / "include"), str(_ONNXRUNTIME_DIR / "include")],
         library_dirs=[str(_ESPEAK_DIR / "lib"), str(_ONNXRUNTIME_DIR / "lib")],
         libraries=["espeak-ng", "onnxruntime"],
@@ -0,0 +1,147 @@
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+#include "batch.hpp"
+#include "phoneme_rewriter.hpp"
+#include "thread_pool.hpp"
+
+namespace piper {
+
+// Each thread is given at least this many tasks, if there are enough texts
+const std::size_t MIN_TASKS_PER_THREAD = 4;
+
+// Output of one task (a range of texts)
+struct TaskResult {
+  std::vector<PhonemeId> phonemeIds;
+
+  // Number of ids in each sentence
+  std::vector<std::size_t> sentenceLengths;
+
+  // Number of sentences in each text
+  std::vector<std::size_t> textSentences;
+
+  std::map<Phoneme, std::size_t> missingPhonemes;
+
+  // Where the task's ids go in CodepointsBatchResult::phonemeIds
+  std::size_t idsOffset = 0;
+};
+
+PIPERPHONEMIZE_EXPORT void
+phonemize_codepoints_batch(const std::vector<std::string> &texts,
+                           const CodepointsBatchConfig &config,
+                           CodepointsBatchResult &result) {
+  std::size_t numThreads = config.numThreads;
+  if (numThreads == 0) {
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // Tasks already run in parallel, and a map is compiled only once
+  CodepointsPhonemeConfig phonemeConfig = config.phonemeConfig;
+  PhonemeIdConfig idConfig = config.idConfig;
+  phonemeConfig.numThreads = 1;
+  if (!phonemeConfig.phonemeRewriter && phonemeConfig.phonemeMap) {
+    phonemeConfig.phonemeRewriter =
+        std::make_shared<PhonemeRewriter>(*phonemeConfig.phonemeMap);
+  }
+
+  std::size_t totalBytes = 0;
+  for (auto &text : texts) {
+    totalBytes += text.size();
+  }
+
+  std::size_t taskBytes = std::min(
+      config.taskBytes, totalBytes / (numThreads * MIN_TASKS_PER_THREAD));
+  taskBytes = std::max<std::size_t>(1, taskBytes);
+
+  // Task t has texts taskTexts[t] up to taskTexts[t + 1]
+  std::vector<std::size_t> taskTexts{0};
+  std::vector<std::size_t> taskCosts;
+  std::size_t currentBytes = 0;
+  for (std::size_t i = 0; i < texts.size(); i++) {
+    currentBytes += texts[i].size();
+    if ((currentBytes >= taskBytes) || ((i + 1) == texts.size())) {
+      taskTexts.push_back(i + 1);
+      taskCosts.push_back(currentBytes);
+      currentBytes = 0;
+    }
+  }
+
+  std::vector<TaskResult> taskResults(taskCosts.size());
+  std::vector<std::vector<std::vector<Phoneme>>> threadPhonemes(numThreads);
+
+  run_tasks(taskCosts, numThreads,
+            [&](std::size_t task, std::size_t thread) {
+              auto &taskResult = taskResults[task];
+              auto &phonemes = threadPhonemes[thread];
+
+              for (auto i = taskTexts[task]; i < taskTexts[task + 1]; i++) {
+                phonemes.clear();
+                phonemize_codepoints(texts[i], phonemeConfig, phonemes);
+
+                for (auto &sentencePhonemes : phonemes) {
+                  auto idsStart = taskResult.phonemeIds.size();
+                  phonemes_to_ids(sentencePhonemes, idConfig,
+                                  taskResult.phonemeIds,
+                                  taskResult.missingPhonemes);
+                  taskResult.sentenceLengths.push_back(
+                      taskResult.phonemeIds.size() - idsStart);
+                }
+
+                taskResult.textSentences.push_back(phonemes.size());
+              }
+            });
+
+  // Place task outputs one after another
+  std::size_t numIds = 0;
+  std::size_t numSentences = 0;
+  for (auto &taskResult : taskResults) {
+    taskResult.idsOffset = numIds;
+    numIds += taskResult.phonemeIds.size();
+    numSentences += taskResult.sentenceLengths.size();
+  }
+
+  result.phonemeIds.resize(numIds);
+  result.sentenceOffsets.resize(numSentences + 1);
+  result.textOffsets.resize(texts.size() + 1);
+  result.missingPhonemes.clear();
+  result.textOffsets[0] = 0;
+  result.sentenceOffsets[numSentences] = numIds;
+
+  std::size_t textIdx = 0;
+  std::size_t sentenceIdx = 0;
+  std::vector<std::size_t> copyCosts(taskResults.size());
+  for (std::size_t task = 0; task < taskResults.size(); task++) {
+    auto &taskResult = taskResults[task];
+    auto idsOffset = taskResult.idsOffset;
+
+    for (auto sentenceLength : taskResult.sentenceLengths) {
+      result.sentenceOffsets[sentenceIdx++] = idsOffset;
+      idsOffset += sentenceLength;
+    }
+
+    for (auto textSentences : taskResult.textSentences) {
+      result.textOffsets[textIdx + 1] =
+          result.textOffsets[textIdx] + textSentences;
+      textIdx++;
+    }
+
+    for (auto &phonemeCount : taskResult.missingPhonemes) {
+      result.missingPhonemes[phonemeCount.first] += phonemeCount.second;
+    }
+
+    copyCosts[task] = taskResult.phonemeIds.size();
+  }
+
+  // Ids are copied in parallel too
+  run_tasks(copyCosts, numThreads, [&](std::size_t task, std::size_t) {
+    auto &taskIds = taskResults[task].phonemeIds;
+    if (!taskIds.empty()) {
+      std::memcpy(result.phonemeIds.data() + taskResults[task].idsOffset,
+                  taskIds.data(), taskIds.size() * sizeof(PhonemeId));
+    }
+  });
+}
+
+} // namespace piper
@@ -0,0 +1,65 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "phoneme_ids.hpp"
+#include "phonemize.hpp"
+#include "shared.hpp"
+
+namespace piper {
+
+// Settings for phonemize_codepoints_batch
+struct CodepointsBatchConfig {
+  // numThreads is ignored (see below)
+  CodepointsPhonemeConfig phonemeConfig;
+
+  PhonemeIdConfig idConfig;
+
+  // Threads to run on (0 = one per CPU), including the calling thread.
+  // The others come from the library's shared thread pool.
+  std::size_t numThreads = 0;
+
+  // Consecutive texts are grouped into tasks of about this many bytes.
+  // Smaller when needed to give every thread several tasks.
+  std::size_t taskBytes = 16 * 1024;
+};
+
+// Phoneme ids of a batch in flat arrays
+struct CodepointsBatchResult {
+  // Ids of every sentence of every text, back to back
+  std::vector<PhonemeId> phonemeIds;
+
+  // Ids of sentence s are phonemeIds[sentenceOffsets[s]] up to
+  // phonemeIds[sentenceOffsets[s + 1]]
+  std::vector<std::size_t> sentenceOffsets;
+
+  // Sentences of text t are sentenceOffsets[textOffsets[t]] up to
+  // sentenceOffsets[textOffsets[t + 1]]
+  std::vector<std::size_t> textOffsets;
+
+  // Counts from all texts
+  std::map<Phoneme, std::size_t> missingPhonemes;
+};
+
+// Runs phonemize_codepoints and phonemes_to_ids on every text, using all
+// threads.
+//
+// Texts are split into tasks whose cost is estimated by byte length, and the
+// tasks are spread over the threads. A thread that runs out of tasks steals
+// from the back of another thread's queue, so a few long texts don't leave
+// the other threads idle.
+//
+// Ids are the same as calling the functions on each text in order. The
+// vectors of result are overwritten, and keep their capacity when reused.
+PIPERPHONEMIZE_EXPORT void
+phonemize_codepoints_batch(const std::vector<std::string> &texts,
+                           const CodepointsBatchConfig &config,
+                           CodepointsBatchResult &result);
+
+} // namespace piper
+
+#endif // BATCH_H_
@@ -0,0 +1,383 @@
+// Throughput and latency of the phonemization stages on bundled corpora.
+//
+// Each corpus in etc/bench is one utterance per line. Every benchmark runs
+// once over its corpus without timing, then --iterations more times with
+// each call timed separately. Results are written as JSON so that runs can be
+// compared (e.g., before and after upgrading espeak-ng or onnxruntime).
+//
+// Example:
+//   bench_piper_phonemize --espeak_data espeak-ng-data
+//     --tashkeel_model etc/libtashkeel_model.ort --corpus_dir etc/bench
+//     --output bench_results.json
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <espeak-ng/speak_lib.h>
+
+#include "json.hpp"
+#include "phoneme_ids.hpp"
+#include "phonemize.hpp"
+#include "tashkeel.hpp"
+#include "uni_algo.h"
+
+using json = nlohmann::json;
+
+struct BenchConfig {
+  std::filesystem::path eSpeakDataPath;
+  std::optional<std::filesystem::path> tashkeelModelPath;
+  std::filesystem::path corpusDir = "etc/bench";
+  std::size_t iterations = 5;
+  std::optional<std::filesystem::path> outputPath;
+
+  // Only run benchmarks whose name contains this
+  std::string filter;
+};
+
+struct Corpus {
+  std::string name;
+  std::vector<std::string> lines;
+
+  // Codepoints in all lines
+  std::size_t chars = 0;
+};
+
+Corpus loadCorpus(BenchConfig &benchConfig, const std::string &name) {
+  auto corpusPath = benchConfig.corpusDir / (name + ".txt");
+  std::ifstream corpusFile(corpusPath);
+  if (!corpusFile.good()) {
+    throw std::runtime_error("Failed to open corpus: " + corpusPath.string());
+  }
+
+  Corpus corpus;
+  corpus.name = name;
+
+  std::string line;
+  while (std::getline(corpusFile, line)) {
+    if (line.empty()) {
+      continue;
+    }
+
+    corpus.chars += una::utf8to32u(line).size();
+    corpus.lines.push_back(line);
+  }
+
+  if (corpus.lines.empty()) {
+    throw std::runtime_error("Corpus is empty: " + corpusPath.string());
+  }
+
+  return corpus;
+}
+
+// Runs func on every line of the corpus, timing each call
+json runBenchmark(BenchConfig &benchConfig, const std::string &name,
+                  Corpus &corpus,
+                  std::function<void(const std::string &, std::size_t)> func) {
+  // Not timed: loads voices, fills caches, etc.
+  for (std::size_t i = 0; i < corpus.lines.size(); i++) {
+    func(corpus.lines[i], i);
+  }
+
+  std::vector<double> latencyMicros;
+  latencyMicros.reserve(benchConfig.iterations * corpus.lines.size());
+  double totalSeconds = 0;
+
+  for (std::size_t iteration = 0; iteration < benchConfig.iterations;
+       iteration++) {
+    for (std::size_t i = 0; i < corpus.lines.size(); i++) {
+      auto startTime = std::chrono::steady_clock::now();
+      func(corpus.lines[i], i);
+      auto micros = std::chrono::duration<double, std::micro>(
+                        std::chrono::steady_clock::now() - startTime)
+                        .count();
+
+      latencyMicros.push_back(micros);
+      totalSeconds += micros / 1e6;
+    }
+  }
+
+  std::sort(latencyMicros.begin(), latencyMicros.end());
+
+  auto percentile = [&latencyMicros](double p) {
+    auto index = (std::size_t)(p * (latencyMicros.size() - 1) + 0.5);
+    return latencyMicros[index];
+  };
+
+  auto utterances = benchConfig.iterations * corpus.lines.size();
+  auto chars = benchConfig.iterations * corpus.chars;
+
+  json result;
+  result["name"] = name;
+  result["corpus"] = corpus.name;
+  result["utterances"] = utterances;
+  result["chars"] = chars;
+  result["total_seconds"] = totalSeconds;
+  result["chars_per_second"] = chars / totalSeconds;
+  result["utterances_per_second"] = utterances / totalSeconds;
+  result["latency_us"] = {{"p50", percentile(0.5)},
+                          {"p90", percentile(0.9)},
+                          {"p99", percentile(0.99)},
+                          {"max", latencyMicros.back()},
+                          {"mean", (totalSeconds * 1e6) / utterances}};
+
+  std::cerr << name << " (" << corpus.name << "): " << (chars / totalSeconds)
+            << " chars/s, p50=" << percentile(0.5) << "us" << std::endl;
+
+  return result;
+}
+
+void printUsage(char *argv[]) {
+  std::cerr << std::endl;
+  std::cerr << "usage: " << argv[0] << " [options]" << std::endl;
+  std::cerr << std::endl;
+  std::cerr << "options:" << std::endl;
+  std::cerr << "   -h        --help              show this message and exit"
+            << std::endl;
+  std::cerr << "   --espeak_data           DIR   path to espeak-ng data "
+               "directory (required)"
+            << std::endl;
+  std::cerr << "   --tashkeel_model        FILE  path to libtashkeel model "
+               "(Arabic is skipped if not set)"
+            << std::endl;
+  std::cerr << "   --corpus_dir            DIR   directory with corpora "
+               "(default: etc/bench)"
+            << std::endl;
+  std::cerr << "   -n  NUM   --iterations   NUM   timed passes over each "
+               "corpus (default: 5)"
+            << std::endl;
+  std::cerr << "   -o  FILE  --output       FILE  write JSON results to a "
+               "file instead of stdout"
+            << std::endl;
+  std::cerr << "   --filter                STR   only run benchmarks whose "
+               "name contains STR"
+            << std::endl;
+  std::cerr << std::endl;
+}
+
+void ensureArg(int argc, char *argv[], int argi) {
+  if ((argi + 1) >= argc) {
+    printUsage(argv);
+    exit(0);
+  }
+}
+
+// Parse command-line arguments
+void parseArgs(int argc, char *argv[], BenchConfig &benchConfig) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "--espeak_data" || arg == "--espeak-data") {
+      ensureArg(argc, argv, i);
+      benchConfig.eSpeakDataPath = std::filesystem::path(argv[++i]);
+    } else if (arg == "--tashkeel_model" || arg == "--tashkeel-model") {
+      ensureArg(argc, argv, i);
+      benchConfig.tashkeelModelPath = std::filesystem::path(argv[++i]);
+    } else if (arg == "--corpus_dir" || arg == "--corpus-dir") {
+      ensureArg(argc, argv, i);
+      benchConfig.corpusDir = std::filesystem::path(argv[++i]);
+    } else if (arg == "-n" || arg == "--iterations") {
+      ensureArg(argc, argv, i);
+      benchConfig.iterations = std::stoul(argv[++i]);
+    } else if (arg == "-o" || arg == "--output") {
+      ensureArg(argc, argv, i);
+      benchConfig.outputPath = std::filesystem::path(argv[++i]);
+    } else if (arg == "--filter") {
+      ensureArg(argc, argv, i);
+      benchConfig.filter = argv[++i];
+    } else if (arg == "-h" || arg == "--help") {
+      printUsage(argv);
+      exit(0);
+    }
+  }
+
+  if (benchConfig.eSpeakDataPath.empty() || (benchConfig.iterations < 1)) {
+    printUsage(argv);
+    exit(1);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+  BenchConfig benchConfig;
+  parseArgs(argc, argv, benchConfig);
+
+  int result = espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS, 0,
+                                 benchConfig.eSpeakDataPath.string().c_str(), 0);
+  if (result < 0) {
+    throw std::runtime_error("Failed to initialize eSpeak");
+  }
+
+  std::map<std::string, Corpus> corpora;
+  for (auto name : {"en-us", "pt-br", "ar", "uk"}) {
+    corpora[name] = loadCorpus(benchConfig, name);
+  }
+
+  tashkeel::State tashkeelState;
+  if (benchConfig.tashkeelModelPath) {
+    tashkeel::tashkeel_load(benchConfig.tashkeelModelPath->string(),
+                            tashkeelState);
+  } else {
+    std::cerr << "WARNING: --tashkeel_model is not set, so tashkeel "
+                 "benchmarks are skipped"
+              << std::endl;
+  }
+
+  std::vector<json> benchmarks;
+  auto addBenchmark =
+      [&benchConfig, &benchmarks](
+          const std::string &name, Corpus &corpus,
+          std::function<void(const std::string &, std::size_t)> func) {
+        auto fullName = name + "/" + corpus.name;
+        if (fullName.find(benchConfig.filter) == std::string::npos) {
+          return;
+        }
+
+        benchmarks.push_back(runBenchmark(benchConfig, name, corpus, func));
+      };
+
+  // Inputs for phonemes_to_ids, computed once per corpus
+  std::map<std::string, std::vector<std::vector<std::vector<piper::Phoneme>>>>
+      corpusPhonemes;
+  std::map<piper::Phoneme, std::size_t> missingPhonemes;
+
+  // phonemize_eSpeak (pt-br uses its default phoneme map)
+  for (auto name : {"en-us", "pt-br", "ar"}) {
+    auto &corpus = corpora[name];
+    piper::eSpeakPhonemeConfig eSpeakConfig;
+    eSpeakConfig.voice = name;
+
+    auto &allPhonemes = corpusPhonemes[name];
+    allPhonemes.resize(corpus.lines.size());
+
+    addBenchmark("phonemize_eSpeak", corpus,
+                 [&eSpeakConfig, &allPhonemes](const std::string &line,
+                                               std::size_t lineIdx) {
+                   allPhonemes[lineIdx].clear();
+                   piper::phonemize_eSpeak(line, eSpeakConfig,
+                                           allPhonemes[lineIdx]);
+                 });
+  }
+
+  // phonemize_codepoints
+  {
+    auto &corpus = corpora["uk"];
+    piper::CodepointsPhonemeConfig codepointsConfig;
+
+    auto &allPhonemes = corpusPhonemes["uk"];
+    allPhonemes.resize(corpus.lines.size());
+
+    addBenchmark("phonemize_codepoints", corpus,
+                 [&codepointsConfig, &allPhonemes](const std::string &line,
+                                                   std::size_t lineIdx) {
+                   allPhonemes[lineIdx].clear();
+                   piper::phonemize_codepoints(line, codepointsConfig,
+                                               allPhonemes[lineIdx]);
+                 });
+  }
+
+  // phonemes_to_ids on the output of the phonemizers above
+  for (auto name : {"en-us", "uk"}) {
+    auto &corpus = corpora[name];
+    auto &allPhonemes = corpusPhonemes[name];
+    if (allPhonemes[0].empty()) {
+      // Phonemizer was filtered out
+      continue;
+    }
+
+    piper::PhonemeIdConfig idConfig;
+    idConfig.phonemeIdMap = piper::get_codepoints_phoneme_id_map(name);
+
+    std::vector<piper::PhonemeId> phonemeIds;
+    addBenchmark("phonemes_to_ids", corpus,
+                 [&idConfig, &allPhonemes, &phonemeIds, &missingPhonemes](
+                     const std::string &, std::size_t lineIdx) {
+                   for (auto &sentencePhonemes : allPhonemes[lineIdx]) {
+                     phonemeIds.clear();
+                     piper::phonemes_to_ids(sentencePhonemes, idConfig,
+                                            phonemeIds, missingPhonemes);
+                   }
+                 });
+  }
+
+  // tashkeel_run
+  if (benchConfig.tashkeelModelPath) {
+    addBenchmark("tashkeel_run", corpora["ar"],
+                 [&tashkeelState](const std::string &line, std::size_t) {
+                   tashkeel::tashkeel_run(line, tashkeelState);
+                 });
+  }
+
+  // Same steps as piper_phonemize for each line: diacritize (Arabic),
+  // phonemize, phoneme ids, and JSON output.
+  for (auto name : {"en-us", "pt-br", "ar"}) {
+    auto &corpus = corpora[name];
+    piper::eSpeakPhonemeConfig eSpeakConfig;
+    eSpeakConfig.voice = name;
+    piper::PhonemeIdConfig idConfig;
+    bool useTashkeel =
+        (corpus.name == "ar") && benchConfig.tashkeelModelPath.has_value();
+
+    addBenchmark(
+        "pipeline", corpus,
+        [&eSpeakConfig, &idConfig, &tashkeelState, &missingPhonemes,
+         useTashkeel](const std::string &line, std::size_t) {
+          json lineObj;
+          lineObj["text"] = line;
+
+          std::string processedText = line;
+          if (useTashkeel) {
+            processedText = tashkeel::tashkeel_run(line, tashkeelState);
+          }
+
+          lineObj["processed_text"] = processedText;
+
+          std::vector<std::vector<piper::Phoneme>> phonemes;
+          piper::phonemize_eSpeak(processedText, eSpeakConfig, phonemes);
+
+          std::vector<std::string> linePhonemes;
+          std::vector<piper::PhonemeId> phonemeIds;
+          for (auto &sentencePhonemes : phonemes) {
+            for (auto phoneme : sentencePhonemes) {
+              std::u32string phonemeU32Str;
+              phonemeU32Str += phoneme;
+              linePhonemes.push_back(una::utf32to8(phonemeU32Str));
+            }
+
+            piper::phonemes_to_ids(sentencePhonemes, idConfig, phonemeIds,
+                                   missingPhonemes);
+          }
+
+          lineObj["phonemes"] = linePhonemes;
+          lineObj["phoneme_ids"] = phonemeIds;
+
+          // Discarded
+          lineObj.dump();
+        });
+  }
+
+  json results;
+  results["iterations"] = benchConfig.iterations;
+  results["espeak_ng"] = espeak_Info(nullptr);
+  results["tashkeel"] = benchConfig.tashkeelModelPath.has_value();
+  results["benchmarks"] = benchmarks;
+
+  if (benchConfig.outputPath) {
+    std::ofstream outputFile(benchConfig.outputPath->string());
+    outputFile << results.dump(2) << std::endl;
+  } else {
+    std::cout << results.dump(2) << std::endl;
+  }
+
+  espeak_Terminate();
+
+  return 0;
+}
@@ -0,0 +1,241 @@
+// Measures the time from process start to first phoneme output.
+//
+// Runs a command (usually piper_phonemize) several times, writes one line of
+// text to its stdin, and times how long it takes until the first line of
+// output appears. Results are printed as JSON.
+//
+// Example:
+//   bench_startup --text 'مرحبا' -- piper_phonemize -l ar --espeak_data ...
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+struct BenchConfig {
+  std::size_t iterations = 20;
+  std::string text = "This is a test.";
+  std::vector<char *> command;
+};
+
+struct RunResult {
+  // Process start to first line of output
+  double firstLineMillis = 0;
+
+  // Process start to exit
+  double exitMillis = 0;
+
+  // Peak resident set size of the command
+  long maxRssKilobytes = 0;
+};
+
+double millisSince(std::chrono::steady_clock::time_point startTime) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - startTime)
+      .count();
+}
+
+RunResult runCommand(BenchConfig &benchConfig) {
+  int toChild[2];
+  int fromChild[2];
+  if ((pipe(toChild) != 0) || (pipe(fromChild) != 0)) {
+    throw std::runtime_error("Failed to create pipes");
+  }
+
+  RunResult result;
+  auto startTime = std::chrono::steady_clock::now();
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw std::runtime_error("Failed to fork");
+  }
+
+  if (pid == 0) {
+    // Child
+    dup2(toChild[0], STDIN_FILENO);
+    dup2(fromChild[1], STDOUT_FILENO);
+    close(toChild[0]);
+    close(toChild[1]);
+    close(fromChild[0]);
+    close(fromChild[1]);
+
+    execvp(benchConfig.command[0], benchConfig.command.data());
+    _exit(127);
+  }
+
+  close(toChild[0]);
+  close(fromChild[1]);
+
+  // Command exits once its input is closed
+  std::string input = benchConfig.text + "\n";
+  if (write(toChild[1], input.data(), input.size()) < 0) {
+    std::cerr << "Failed to write to command" << std::endl;
+  }
+  close(toChild[1]);
+
+  bool gotFirstLine = false;
+  char buffer[4096];
+  ssize_t numRead = 0;
+  while ((numRead = read(fromChild[0], buffer, sizeof(buffer))) > 0) {
+    if (!gotFirstLine &&
+        (std::find(buffer, buffer + numRead, '\n') != (buffer + numRead))) {
+      result.firstLineMillis = millisSince(startTime);
+      gotFirstLine = true;
+    }
+  }
+  close(fromChild[0]);
+
+  int status = 0;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    throw std::runtime_error("Failed to wait for command");
+  }
+
+  result.exitMillis = millisSince(startTime);
+
+  // Kilobytes on Linux, bytes on macOS
+#ifdef __APPLE__
+  result.maxRssKilobytes = usage.ru_maxrss / 1024;
+#else
+  result.maxRssKilobytes = usage.ru_maxrss;
+#endif
+
+  if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+    throw std::runtime_error("Command failed");
+  }
+
+  if (!gotFirstLine) {
+    throw std::runtime_error("Command produced no output");
+  }
+
+  return result;
+}
+
+// Summary statistics in milliseconds
+json summarize(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+
+  double total = 0;
+  for (auto value : values) {
+    total += value;
+  }
+
+  auto percentile = [&values](double p) {
+    auto index = (std::size_t)(p * (values.size() - 1) + 0.5);
+    return values[index];
+  };
+
+  json summary;
+  summary["min"] = values.front();
+  summary["p50"] = percentile(0.5);
+  summary["p90"] = percentile(0.9);
+  summary["max"] = values.back();
+  summary["mean"] = total / values.size();
+
+  return summary;
+}
+
+void printUsage(char *argv[]) {
+  std::cerr << std::endl;
+  std::cerr << "usage: " << argv[0] << " [options] -- COMMAND [ARGS...]"
+            << std::endl;
+  std::cerr << std::endl;
+  std::cerr << "options:" << std::endl;
+  std::cerr << "   -h        --help              show this message and exit"
+            << std::endl;
+  std::cerr << "   -n  NUM   --iterations   NUM   number of runs (default: 20)"
+            << std::endl;
+  std::cerr << "   --text                  TEXT  line of text written to "
+               "command"
+            << std::endl;
+  std::cerr << std::endl;
+}
+
+void ensureArg(int argc, char *argv[], int argi) {
+  if ((argi + 1) >= argc) {
+    printUsage(argv);
+    exit(0);
+  }
+}
+
+// Parse command-line arguments
+void parseArgs(int argc, char *argv[], BenchConfig &benchConfig) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "-n" || arg == "--iterations") {
+      ensureArg(argc, argv, i);
+      benchConfig.iterations = std::stoul(argv[++i]);
+    } else if (arg == "--text") {
+      ensureArg(argc, argv, i);
+      benchConfig.text = argv[++i];
+    } else if (arg == "--") {
+      benchConfig.command.assign(argv + i + 1, argv + argc);
+      break;
+    } else if (arg == "-h" || arg == "--help") {
+      printUsage(argv);
+      exit(0);
+    }
+  }
+
+  if (benchConfig.command.empty() || (benchConfig.iterations < 1)) {
+    printUsage(argv);
+    exit(1);
+  }
+
+  // execvp needs a null-terminated argument list
+  benchConfig.command.push_back(nullptr);
+}
+
+int main(int argc, char *argv[]) {
+  BenchConfig benchConfig;
+  parseArgs(argc, argv, benchConfig);
+
+  // Command may exit before reading its input
+  std::signal(SIGPIPE, SIG_IGN);
+
+  // Not timed: warms up the page cache
+  runCommand(benchConfig);
+
+  std::vector<double> firstLineMillis;
+  std::vector<double> exitMillis;
+  long maxRssKilobytes = 0;
+
+  for (std::size_t i = 0; i < benchConfig.iterations; i++) {
+    auto result = runCommand(benchConfig);
+    firstLineMillis.push_back(result.firstLineMillis);
+    exitMillis.push_back(result.exitMillis);
+    maxRssKilobytes = std::max(maxRssKilobytes, result.maxRssKilobytes);
+  }
+
+  std::string commandStr;
+  for (std::size_t i = 0; (i + 1) < benchConfig.command.size(); i++) {
+    if (i > 0) {
+      commandStr += " ";
+    }
+
+    commandStr += benchConfig.command[i];
+  }
+
+  json results;
+  results["command"] = commandStr;
+  results["iterations"] = benchConfig.iterations;
+  results["first_line_ms"] = summarize(firstLineMillis);
+  results["exit_ms"] = summarize(exitMillis);
+  results["max_rss_kb"] = maxRssKilobytes;
+
+  std::cout << results.dump(2) << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,318 @@
+// Client for piper_phonemize --serve.
+//
+// Reads lines from stdin like piper_phonemize and sends them all to the server
+// without waiting for responses. Responses are written to stdout in input
+// order, so the output is the same as running piper_phonemize directly.
+//
+// With --benchmark, the first line is sent repeatedly (one request at a time)
+// and latency statistics are printed as JSON.
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+struct ClientConfig {
+  std::string socketPath;
+  bool jsonInput = false;
+  std::size_t benchmarkIterations = 0;
+};
+
+// Reads newline-separated responses from a socket
+class LineReader {
+public:
+  explicit LineReader(int fd) : fd(fd) {}
+
+  bool getline(std::string &line) {
+    while (true) {
+      auto lineEnd = buffer.find('\n', bufferStart);
+      if (lineEnd != std::string::npos) {
+        line = buffer.substr(bufferStart, lineEnd - bufferStart);
+        bufferStart = lineEnd + 1;
+        return true;
+      }
+
+      buffer.erase(0, bufferStart);
+      bufferStart = 0;
+
+      char chunk[4096];
+      auto numRead = read(fd, chunk, sizeof(chunk));
+      if (numRead < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        return false;
+      }
+
+      if (numRead == 0) {
+        return false;
+      }
+
+      buffer.append(chunk, numRead);
+    }
+  }
+
+private:
+  int fd;
+  std::string buffer;
+  std::size_t bufferStart = 0;
+};
+
+int connectToServer(const std::string &socketPath) {
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("Socket path is too long: " + socketPath);
+  }
+
+  std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ((fd < 0) || (connect(fd, (sockaddr *)&address, sizeof(address)) != 0)) {
+    throw std::runtime_error("Failed to connect to " + socketPath);
+  }
+
+  return fd;
+}
+
+void sendAll(int fd, const std::string &data) {
+  std::size_t offset = 0;
+  while (offset < data.size()) {
+    auto numWritten = write(fd, data.data() + offset, data.size() - offset);
+    if (numWritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      throw std::runtime_error("Failed to send request");
+    }
+
+    offset += numWritten;
+  }
+}
+
+// Key for the "id" of an input line while the request id is in its place
+const std::string ORIGINAL_ID_KEY = "_original_id";
+
+// Puts back the input line's "id" (if it had one) in place of the request id
+void restoreId(json &lineObj) {
+  auto originalId = lineObj.find(ORIGINAL_ID_KEY);
+  if (originalId == lineObj.end()) {
+    lineObj.erase("id");
+    return;
+  }
+
+  lineObj["id"] = std::move(*originalId);
+  lineObj.erase(ORIGINAL_ID_KEY);
+}
+
+// Request with an id that is used to put responses back in order.
+// An "id" from the input goes to the server under ORIGINAL_ID_KEY and is
+// restored by restoreId.
+std::string makeRequest(const std::string &line, std::size_t id,
+                        ClientConfig &clientConfig) {
+  json lineObj;
+  if (clientConfig.jsonInput) {
+    lineObj = json::parse(line);
+  } else {
+    lineObj["text"] = line;
+  }
+
+  if (lineObj.contains("id")) {
+    lineObj[ORIGINAL_ID_KEY] = std::move(lineObj["id"]);
+  }
+
+  lineObj["id"] = id;
+
+  return lineObj.dump() + "\n";
+}
+
+int runBenchmark(int fd, ClientConfig &clientConfig) {
+  std::string line;
+  if (!std::getline(std::cin, line)) {
+    throw std::runtime_error("Need a line of text on stdin");
+  }
+
+  LineReader reader(fd);
+  std::string response;
+  std::vector<double> latencyMillis;
+
+  // First request is not timed
+  for (std::size_t i = 0; i <= clientConfig.benchmarkIterations; i++) {
+    auto startTime = std::chrono::steady_clock::now();
+    sendAll(fd, makeRequest(line, i, clientConfig));
+    if (!reader.getline(response)) {
+      throw std::runtime_error("Server closed connection");
+    }
+
+    if (i > 0) {
+      latencyMillis.push_back(std::chrono::duration<double, std::milli>(
+                                  std::chrono::steady_clock::now() - startTime)
+                                  .count());
+    }
+  }
+
+  std::sort(latencyMillis.begin(), latencyMillis.end());
+
+  double total = 0;
+  for (auto value : latencyMillis) {
+    total += value;
+  }
+
+  auto percentile = [&latencyMillis](double p) {
+    auto index = (std::size_t)(p * (latencyMillis.size() - 1) + 0.5);
+    return latencyMillis[index];
+  };
+
+  json results;
+  results["socket"] = clientConfig.socketPath;
+  results["iterations"] = clientConfig.benchmarkIterations;
+  results["latency_ms"] = {{"min", latencyMillis.front()},
+                           {"p50", percentile(0.5)},
+                           {"p90", percentile(0.9)},
+                           {"p99", percentile(0.99)},
+                           {"max", latencyMillis.back()},
+                           {"mean", total / latencyMillis.size()}};
+
+  std::cout << results.dump(2) << std::endl;
+
+  return 0;
+}
+
+void printUsage(char *argv[]) {
+  std::cerr << std::endl;
+  std::cerr << "usage: " << argv[0] << " [options]" << std::endl;
+  std::cerr << std::endl;
+  std::cerr << "options:" << std::endl;
+  std::cerr << "   -h        --help              show this message and exit"
+            << std::endl;
+  std::cerr << "   -s  FILE  --socket       FILE  socket of piper_phonemize "
+               "--serve (required)"
+            << std::endl;
+  std::cerr
+      << "   -j        --json_input        input is JSONL instead of plain text"
+      << std::endl;
+  std::cerr << "   --benchmark             NUM   time NUM requests for the "
+               "first line"
+            << std::endl;
+  std::cerr << std::endl;
+}
+
+void ensureArg(int argc, char *argv[], int argi) {
+  if ((argi + 1) >= argc) {
+    printUsage(argv);
+    exit(0);
+  }
+}
+
+// Parse command-line arguments
+void parseArgs(int argc, char *argv[], ClientConfig &clientConfig) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "-s" || arg == "--socket") {
+      ensureArg(argc, argv, i);
+      clientConfig.socketPath = argv[++i];
+    } else if (arg == "-j" || arg == "--json_input" || arg == "--json-input") {
+      clientConfig.jsonInput = true;
+    } else if (arg == "--benchmark") {
+      ensureArg(argc, argv, i);
+      clientConfig.benchmarkIterations = std::stoul(argv[++i]);
+    } else if (arg == "-h" || arg == "--help") {
+      printUsage(argv);
+      exit(0);
+    }
+  }
+
+  if (clientConfig.socketPath.empty()) {
+    std::cerr << "--socket is required" << std::endl;
+    printUsage(argv);
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  ClientConfig clientConfig;
+  parseArgs(argc, argv, clientConfig);
+
+  std::signal(SIGPIPE, SIG_IGN);
+
+  int fd = connectToServer(clientConfig.socketPath);
+
+  if (clientConfig.benchmarkIterations > 0) {
+    int result = runBenchmark(fd, clientConfig);
+    close(fd);
+    return result;
+  }
+
+  // Send requests while responses are coming back
+  std::thread sender([fd, &clientConfig]() {
+    std::string line;
+    std::size_t id = 0;
+    while (std::getline(std::cin, line)) {
+      sendAll(fd, makeRequest(line, id, clientConfig));
+      id++;
+    }
+
+    // Server closes the connection after the last response
+    shutdown(fd, SHUT_WR);
+  });
+
+  LineReader reader(fd);
+  std::string response;
+  std::map<std::size_t, json> pendingResponses;
+  std::size_t nextId = 0;
+  int exitCode = 0;
+
+  while (reader.getline(response)) {
+    json responseObj = json::parse(response);
+    if (!responseObj.contains("id")) {
+      std::cerr << "Error: " << responseObj.value("error", response)
+                << std::endl;
+      exitCode = 1;
+      continue;
+    }
+
+    auto id = responseObj["id"].get<std::size_t>();
+    pendingResponses[id] = std::move(responseObj);
+
+    // Write responses in input order
+    auto nextResponse = pendingResponses.find(nextId);
+    while (nextResponse != pendingResponses.end()) {
+      auto &lineObj = nextResponse->second;
+      if (lineObj.contains("error")) {
+        std::cerr << "Error: " << lineObj["error"].get<std::string>()
+                  << std::endl;
+        exitCode = 1;
+      } else {
+        restoreId(lineObj);
+        std::cout << lineObj.dump() << std::endl;
+      }
+
+      pendingResponses.erase(nextResponse);
+      nextId++;
+      nextResponse = pendingResponses.find(nextId);
+    }
+  }
+
+  sender.join();
+  close(fd);
+
+  return exitCode;
+}
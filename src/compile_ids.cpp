@@ -0,0 +1,210 @@
+// Compiles a phoneme id map into a binary table for load_phoneme_id_table.
+//
+// The map comes from the "phoneme_id_map" of a Piper voice config
+// (.onnx.json), or from a built-in map when no config is given.
+//
+// Example:
+//   piper_phonemize_compile_ids --config en_US-lessac-medium.onnx.json
+//     --output en_US-lessac-medium.ppid
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "phoneme_id_table.hpp"
+#include "phoneme_ids.hpp"
+#include "uni_algo.h"
+
+using json = nlohmann::json;
+
+struct CompileConfig {
+  // Voice config with "phoneme_id_map"
+  std::optional<std::filesystem::path> voiceConfigPath;
+
+  // Built-in text phonemes map instead of eSpeak (no voice config)
+  std::optional<std::string> language;
+
+  std::optional<std::filesystem::path> outputPath;
+
+  // Print a compiled table as JSON instead
+  std::optional<std::filesystem::path> dumpPath;
+
+  piper::PhonemeIdConfig idConfig;
+};
+
+void parseArgs(int argc, char *argv[], CompileConfig &compileConfig);
+
+piper::Phoneme toPhoneme(const std::string &phonemeStr) {
+  auto phonemeU32Str = una::utf8to32u(phonemeStr);
+  if (phonemeU32Str.size() != 1) {
+    throw std::runtime_error("Expected a single codepoint: " + phonemeStr);
+  }
+
+  return phonemeU32Str[0];
+}
+
+std::string toUtf8(piper::Phoneme phoneme) {
+  return una::utf32to8(std::u32string(1, phoneme));
+}
+
+int main(int argc, char *argv[]) {
+  CompileConfig compileConfig;
+  parseArgs(argc, argv, compileConfig);
+
+  if (compileConfig.dumpPath) {
+    auto table = piper::load_phoneme_id_table(compileConfig.dumpPath->string());
+    auto &config = table->config();
+
+    json dump;
+    dump["pad"] = toUtf8(config.pad);
+    dump["bos"] = toUtf8(config.bos);
+    dump["eos"] = toUtf8(config.eos);
+    dump["intersperse_pad"] = config.interspersePad;
+    dump["add_bos"] = config.addBos;
+    dump["add_eos"] = config.addEos;
+
+    json phonemeIdMap = json::object();
+    for (auto &phonemeAndIds : table->toMap()) {
+      phonemeIdMap[toUtf8(phonemeAndIds.first)] = phonemeAndIds.second;
+    }
+
+    dump["phoneme_id_map"] = phonemeIdMap;
+    std::cout << dump.dump(2) << std::endl;
+
+    return 0;
+  }
+
+  piper::PhonemeIdMap phonemeIdMap;
+  if (compileConfig.voiceConfigPath) {
+    std::ifstream voiceConfigFile(compileConfig.voiceConfigPath->string());
+    if (!voiceConfigFile.good()) {
+      throw std::runtime_error("Failed to open voice config: " +
+                               compileConfig.voiceConfigPath->string());
+    }
+
+    auto voiceConfig = json::parse(voiceConfigFile);
+    if (!voiceConfig.contains("phoneme_id_map")) {
+      throw std::runtime_error("Voice config has no phoneme_id_map");
+    }
+
+    for (auto &phonemeAndIds : voiceConfig["phoneme_id_map"].items()) {
+      phonemeIdMap[toPhoneme(phonemeAndIds.key())] =
+          phonemeAndIds.value().get<std::vector<piper::PhonemeId>>();
+    }
+  } else if (compileConfig.language) {
+    auto codepointsMap =
+        piper::get_codepoints_phoneme_id_map(*compileConfig.language);
+    if (!codepointsMap) {
+      throw std::runtime_error("No phoneme/id map for language");
+    }
+
+    phonemeIdMap = *codepointsMap;
+  } else {
+    phonemeIdMap = *piper::get_espeak_phoneme_id_map();
+  }
+
+  auto tableBytes =
+      piper::compile_phoneme_id_table(phonemeIdMap, compileConfig.idConfig);
+
+  std::ofstream outputFile(compileConfig.outputPath->string(),
+                           std::ios::binary);
+  outputFile.write(tableBytes.data(), tableBytes.size());
+  if (!outputFile.good()) {
+    throw std::runtime_error("Failed to write " +
+                             compileConfig.outputPath->string());
+  }
+
+  std::cerr << "Wrote " << phonemeIdMap.size() << " phoneme(s) to "
+            << compileConfig.outputPath->string() << std::endl;
+
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+void printUsage(char *argv[]) {
+  std::cerr << std::endl;
+  std::cerr << "usage: " << argv[0] << " [options]" << std::endl;
+  std::cerr << std::endl;
+  std::cerr << "options:" << std::endl;
+  std::cerr << "   -h        --help              show this message and exit"
+            << std::endl;
+  std::cerr << "   -c  FILE  --config      FILE  voice config with "
+               "phoneme_id_map (.onnx.json)"
+            << std::endl;
+  std::cerr << "   -l  LANG  --language    LANG  built-in text phonemes map "
+               "(default: eSpeak map)"
+            << std::endl;
+  std::cerr << "   -o  FILE  --output      FILE  path to write table "
+               "(required)"
+            << std::endl;
+  std::cerr << "   --pad                   CHAR  pad phoneme (default: _)"
+            << std::endl;
+  std::cerr << "   --bos                   CHAR  beginning of sentence phoneme "
+               "(default: ^)"
+            << std::endl;
+  std::cerr << "   --eos                   CHAR  end of sentence phoneme "
+               "(default: $)"
+            << std::endl;
+  std::cerr << "   --no_intersperse_pad          don't add pad between "
+               "phonemes"
+            << std::endl;
+  std::cerr << "   --dump                  FILE  print a compiled table as "
+               "JSON and exit"
+            << std::endl;
+  std::cerr << std::endl;
+}
+
+void ensureArg(int argc, char *argv[], int argi) {
+  if ((argi + 1) >= argc) {
+    printUsage(argv);
+    exit(0);
+  }
+}
+
+// Parse command-line arguments
+void parseArgs(int argc, char *argv[], CompileConfig &compileConfig) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "-c" || arg == "--config") {
+      ensureArg(argc, argv, i);
+      compileConfig.voiceConfigPath = std::filesystem::path(argv[++i]);
+    } else if (arg == "-l" || arg == "--language") {
+      ensureArg(argc, argv, i);
+      compileConfig.language = std::string(argv[++i]);
+    } else if (arg == "-o" || arg == "--output") {
+      ensureArg(argc, argv, i);
+      compileConfig.outputPath = std::filesystem::path(argv[++i]);
+    } else if (arg == "--pad") {
+      ensureArg(argc, argv, i);
+      compileConfig.idConfig.pad = toPhoneme(argv[++i]);
+    } else if (arg == "--bos") {
+      ensureArg(argc, argv, i);
+      compileConfig.idConfig.bos = toPhoneme(argv[++i]);
+    } else if (arg == "--eos") {
+      ensureArg(argc, argv, i);
+      compileConfig.idConfig.eos = toPhoneme(argv[++i]);
+    } else if (arg == "--no_intersperse_pad" ||
+               arg == "--no-intersperse-pad") {
+      compileConfig.idConfig.interspersePad = false;
+    } else if (arg == "--dump") {
+      ensureArg(argc, argv, i);
+      compileConfig.dumpPath = std::filesystem::path(argv[++i]);
+    } else if (arg == "-h" || arg == "--help") {
+      printUsage(argv);
+      exit(0);
+    }
+  }
+
+  if (!compileConfig.dumpPath && !compileConfig.outputPath) {
+    std::cerr << "--output is required" << std::endl;
+    printUsage(argv);
+    exit(1);
+  }
+}
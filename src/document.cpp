@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <unordered_map>
+
+#include "document.hpp"
+#include "uni_algo.h"
+
+namespace piper {
+
+// Longest UTF-8 character in bytes
+const std::size_t MAX_UTF8_LENGTH = 4;
+
+// Changed regions up to this many (new x previous) sentence pairs are
+// aligned exactly. Larger ones are aligned greedily.
+const std::size_t MAX_ALIGN_CELLS = 1 << 20;
+
+// Splits text into sentences (byte offset and length).
+// eSpeak doesn't end a sentence before a lowercase letter, so those are
+// joined to the sentence before them.
+static void splitDocument(const std::string &text,
+                          const std::u32string &terminators,
+                          std::vector<DocumentSentence> &sentences) {
+  std::vector<std::string_view> sentenceTexts;
+  split_sentences(text, terminators, sentenceTexts);
+
+  for (auto sentenceText : sentenceTexts) {
+    std::size_t textOffset = sentenceText.data() - text.data();
+    auto firstChars =
+        una::utf8to32u(sentenceText.substr(0, MAX_UTF8_LENGTH));
+
+    if (!sentences.empty() && !firstChars.empty() &&
+        una::codepoint::is_lowercase(firstChars[0])) {
+      auto &lastSentence = sentences.back();
+      lastSentence.textLength =
+          (textOffset + sentenceText.size()) - lastSentence.textOffset;
+      continue;
+    }
+
+    sentences.emplace_back();
+    sentences.back().textOffset = textOffset;
+    sentences.back().textLength = sentenceText.size();
+  }
+}
+
+PIPERPHONEMIZE_EXPORT
+PhonemizedDocument::PhonemizedDocument(DocumentConfig config)
+    : config(std::move(config)) {}
+
+PIPERPHONEMIZE_EXPORT std::vector<DocumentChange>
+PhonemizedDocument::update(const std::string &newText) {
+  std::vector<DocumentSentence> sentences;
+  splitDocument(newText, config.sentenceTerminators, sentences);
+
+  auto &previous = documentSentences;
+  auto sentenceText = [&newText, &sentences](std::size_t i) {
+    return std::string_view(newText).substr(sentences[i].textOffset,
+                                            sentences[i].textLength);
+  };
+  auto previousText = [this, &previous](std::size_t i) {
+    return std::string_view(documentText)
+        .substr(previous[i].textOffset, previous[i].textLength);
+  };
+
+  std::hash<std::string_view> textHash;
+  for (std::size_t i = 0; i < sentences.size(); i++) {
+    sentences[i].hash = textHash(sentenceText(i));
+  }
+
+  auto sameText = [&](std::size_t i, std::size_t previousIdx) {
+    return (sentences[i].hash == previous[previousIdx].hash) &&
+           (sentenceText(i) == previousText(previousIdx));
+  };
+
+  // Unchanged sentences at the start and end
+  auto maxMatching = std::min(sentences.size(), previous.size());
+  std::size_t numPrefix = 0;
+  while ((numPrefix < maxMatching) && sameText(numPrefix, numPrefix)) {
+    sentences[numPrefix].previousIndex = numPrefix;
+    numPrefix++;
+  }
+
+  std::size_t numSuffix = 0;
+  while ((numSuffix < (maxMatching - numPrefix)) &&
+         sameText(sentences.size() - numSuffix - 1,
+                  previous.size() - numSuffix - 1)) {
+    sentences[sentences.size() - numSuffix - 1].previousIndex =
+        previous.size() - numSuffix - 1;
+    numSuffix++;
+  }
+
+  // Align the sentences in between (longest common subsequence)
+  std::size_t middleBegin = numPrefix;
+  std::size_t numMiddle = sentences.size() - numSuffix - middleBegin;
+  std::size_t numPreviousMiddle = previous.size() - numSuffix - middleBegin;
+
+  if ((numMiddle * numPreviousMiddle) <= MAX_ALIGN_CELLS) {
+    // common[i][j] = longest common subsequence of middle sentences from i
+    // and previous middle sentences from j
+    std::size_t stride = numPreviousMiddle + 1;
+    std::vector<uint32_t> common((numMiddle + 1) * stride, 0);
+    for (auto i = numMiddle; i-- > 0;) {
+      for (auto j = numPreviousMiddle; j-- > 0;) {
+        if (sameText(middleBegin + i, middleBegin + j)) {
+          common[(i * stride) + j] = common[((i + 1) * stride) + j + 1] + 1;
+        } else {
+          common[(i * stride) + j] = std::max(common[((i + 1) * stride) + j],
+                                              common[(i * stride) + j + 1]);
+        }
+      }
+    }
+
+    std::size_t i = 0;
+    std::size_t j = 0;
+    while ((i < numMiddle) && (j < numPreviousMiddle)) {
+      if (sameText(middleBegin + i, middleBegin + j)) {
+        sentences[middleBegin + i].previousIndex = middleBegin + j;
+        i++;
+        j++;
+      } else if (common[((i + 1) * stride) + j] >=
+                 common[(i * stride) + j + 1]) {
+        i++;
+      } else {
+        j++;
+      }
+    }
+  } else {
+    // Match each sentence to the next identical previous sentence
+    std::size_t j = middleBegin;
+    std::size_t previousEnd = middleBegin + numPreviousMiddle;
+    for (auto i = middleBegin; i < (middleBegin + numMiddle); i++) {
+      for (auto k = j; k < previousEnd; k++) {
+        if (sameText(i, k)) {
+          sentences[i].previousIndex = k;
+          j = k + 1;
+          break;
+        }
+      }
+    }
+  }
+
+  // Previous sentences by hash, for sentences that moved or repeat
+  std::unordered_map<std::size_t, std::vector<std::size_t>> previousByHash;
+  for (std::size_t i = 0; i < previous.size(); i++) {
+    previousByHash[previous[i].hash].push_back(i);
+  }
+
+  lastPhonemizedCount = 0;
+
+  for (auto i = middleBegin; i < (middleBegin + numMiddle); i++) {
+    auto &sentence = sentences[i];
+    if (sentence.previousIndex != NEW_DOCUMENT_SENTENCE) {
+      // Moved from previous below
+      continue;
+    }
+
+    const DocumentSentence *cached = nullptr;
+    auto sameHash = previousByHash.find(sentence.hash);
+    if (sameHash != previousByHash.end()) {
+      for (auto previousIdx : sameHash->second) {
+        if (sameText(i, previousIdx)) {
+          cached = &previous[previousIdx];
+          break;
+        }
+      }
+    }
+
+    if (cached) {
+      sentence.phonemes = cached->phonemes;
+      sentence.phonemeIds = cached->phonemeIds;
+      sentence.missingPhonemes = cached->missingPhonemes;
+      continue;
+    }
+
+    phonemize_eSpeak(std::string(sentenceText(i)), config.phonemeConfig,
+                     sentence.phonemes);
+
+    for (auto &sentencePhonemes : sentence.phonemes) {
+      sentence.phonemeIds.emplace_back();
+      phonemes_to_ids(sentencePhonemes, config.idConfig,
+                      sentence.phonemeIds.back(), sentence.missingPhonemes);
+    }
+
+    lastPhonemizedCount++;
+  }
+
+  // Runs of sentences between unchanged ones
+  std::vector<DocumentChange> changes;
+  std::size_t changeBegin = 0;
+  std::size_t previousBegin = 0;
+  for (std::size_t i = 0; i <= sentences.size(); i++) {
+    auto previousIdx = previous.size();
+    if (i < sentences.size()) {
+      previousIdx = sentences[i].previousIndex;
+      if (previousIdx == NEW_DOCUMENT_SENTENCE) {
+        continue;
+      }
+    }
+
+    if ((i > changeBegin) || (previousIdx > previousBegin)) {
+      changes.push_back({changeBegin, i, previousBegin, previousIdx});
+    }
+
+    changeBegin = i + 1;
+    previousBegin = previousIdx + 1;
+  }
+
+  // Unchanged sentences are moved last, after every copy from previous
+  for (auto &sentence : sentences) {
+    if (sentence.previousIndex != NEW_DOCUMENT_SENTENCE) {
+      auto &previousSentence = previous[sentence.previousIndex];
+      sentence.phonemes = std::move(previousSentence.phonemes);
+      sentence.phonemeIds = std::move(previousSentence.phonemeIds);
+      sentence.missingPhonemes = std::move(previousSentence.missingPhonemes);
+    }
+  }
+
+  documentText = newText;
+  documentSentences = std::move(sentences);
+
+  return changes;
+}
+
+PIPERPHONEMIZE_EXPORT void PhonemizedDocument::getPhonemes(
+    std::vector<std::vector<Phoneme>> &phonemes) const {
+  for (auto &sentence : documentSentences) {
+    phonemes.insert(phonemes.end(), sentence.phonemes.begin(),
+                    sentence.phonemes.end());
+  }
+}
+
+} // namespace piper
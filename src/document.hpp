@@ -0,0 +1,100 @@
+#ifndef DOCUMENT_H_
+#define DOCUMENT_H_
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "phoneme_ids.hpp"
+#include "phonemize.hpp"
+#include "shared.hpp"
+
+namespace piper {
+
+// Settings for PhonemizedDocument
+struct DocumentConfig {
+  eSpeakPhonemeConfig phonemeConfig;
+  PhonemeIdConfig idConfig;
+
+  // Text is split after these (see split_sentences), unless the next
+  // sentence starts with a lowercase letter.
+  std::u32string sentenceTerminators = U".?!…";
+};
+
+// Previous index of a sentence that was not in the previous revision
+const std::size_t NEW_DOCUMENT_SENTENCE = (std::size_t)-1;
+
+struct DocumentSentence {
+  // Byte range of the sentence in the document text
+  std::size_t textOffset = 0;
+  std::size_t textLength = 0;
+
+  // Hash of the sentence text
+  std::size_t hash = 0;
+
+  // Output of phonemize_eSpeak for the sentence text. Usually one sentence,
+  // but eSpeak may split it further.
+  std::vector<std::vector<Phoneme>> phonemes;
+
+  // Output of phonemes_to_ids for each vector of phonemes
+  std::vector<std::vector<PhonemeId>> phonemeIds;
+  std::map<Phoneme, std::size_t> missingPhonemes;
+
+  // Index of the same sentence in the previous revision, or
+  // NEW_DOCUMENT_SENTENCE if it's part of a change.
+  std::size_t previousIndex = NEW_DOCUMENT_SENTENCE;
+};
+
+// Sentences [begin, end) of the new revision replace sentences
+// [previousBegin, previousEnd) of the previous one. Either range may be
+// empty (insertion or deletion).
+struct DocumentChange {
+  std::size_t begin = 0;
+  std::size_t end = 0;
+  std::size_t previousBegin = 0;
+  std::size_t previousEnd = 0;
+};
+
+// Phonemes and ids of a document that is edited and phonemized again.
+//
+// Each revision is split into sentences, which are phonemized separately and
+// cached by content hash. Only sentences whose text changed are phonemized
+// again. Sentences next to an edit are included when the edit changes where
+// they start or end (e.g., a lowercase letter after a period joins two
+// sentences).
+//
+// Uses phonemize_eSpeak, so calls must not overlap with other eSpeak calls.
+class PhonemizedDocument {
+public:
+  PIPERPHONEMIZE_EXPORT explicit PhonemizedDocument(DocumentConfig config);
+
+  // Phonemizes a new revision of the text.
+  // Returns the sentence ranges that changed since the previous revision (the
+  // whole text on the first call), in order.
+  PIPERPHONEMIZE_EXPORT std::vector<DocumentChange>
+  update(const std::string &newText);
+
+  const std::string &text() const { return documentText; }
+
+  const std::vector<DocumentSentence> &sentences() const {
+    return documentSentences;
+  }
+
+  // Phonemes of every sentence in order, like phonemize_eSpeak output
+  PIPERPHONEMIZE_EXPORT void
+  getPhonemes(std::vector<std::vector<Phoneme>> &phonemes) const;
+
+  // Number of sentences phonemized by the last update (not reused)
+  std::size_t phonemizedCount() const { return lastPhonemizedCount; }
+
+private:
+  DocumentConfig config;
+  std::string documentText;
+  std::vector<DocumentSentence> documentSentences;
+  std::size_t lastPhonemizedCount = 0;
+};
+
+} // namespace piper
+
+#endif // DOCUMENT_H_
@@ -1,8 +1,19 @@
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <espeak-ng/speak_lib.h>
@@ -13,10 +24,23 @@
 #include <windows.h>
 #endif
 
+#ifndef _WIN32
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
 #include "json.hpp"
 #include "phoneme_ids.hpp"
+#include "phoneme_rewriter.hpp"
 #include "phonemize.hpp"
 #include "tashkeel.hpp"
+#include "trace.hpp"
 #include "uni_algo.h"
 
 using json = nlohmann::json;
@@ -28,6 +52,10 @@ struct RunConfig {
   PhonemeType phonemeType = eSpeakPhonemes;
   std::optional<std::filesystem::path> eSpeakDataPath;
   std::optional<std::filesystem::path> tashkeelModelPath;
+
+  // Voice config with "phoneme_id_map" (.onnx.json)
+  std::optional<std::filesystem::path> voiceConfigPath;
+
   std::function<std::string(std::string)> processText = [](std::string text) {
     return text;
   };
@@ -36,9 +64,95 @@ struct RunConfig {
       textToPhonemes;
   bool jsonInput = false;
   bool allowMissingPhonemes = false;
+  bool tashkeelSkipDiacritized = false;
+  std::size_t tashkeelCacheBytes = 0;
+  std::size_t maxSentencePhonemes = 0;
+  std::optional<std::filesystem::path> servePath;
+  std::size_t serveWorkers = 0;
+  std::optional<std::filesystem::path> traceFilePath;
+
+  // Read from/write to files instead of stdin/stdout
+  std::optional<std::filesystem::path> inputPath;
+  std::optional<std::filesystem::path> outputPath;
+
+  // Flush after every output line (interactive pipes)
+  bool lineBuffered = false;
+};
+
+// Output is written in blocks of about this many bytes
+const std::size_t OUTPUT_BUFFER_BYTES = 1 << 20;
+
+// Pipes and other input that can't be mapped are read in blocks of this size
+const std::size_t INPUT_READ_BYTES = 64 * 1024;
+
+// Readers wait when this many --serve requests are waiting for a worker
+const std::size_t SERVE_QUEUE_REQUESTS = 1024;
+
+// Longest --serve request line; the connection is closed after a longer one
+const std::size_t SERVE_MAX_LINE_BYTES = 1 << 20;
+
+// Further --serve clients are turned away until a connection closes
+const std::size_t SERVE_MAX_CONNECTIONS = 256;
+
+// Reads lines (without newlines) from a memory-mapped file or stdin.
+// Input files that aren't regular files (pipes, /dev/stdin) are streamed.
+class LineReader {
+public:
+  explicit LineReader(const std::optional<std::filesystem::path> &inputPath);
+  ~LineReader();
+
+  // Next line, or false at the end of input.
+  // The line is valid until the next call.
+  bool next(std::string_view &line);
+
+private:
+  bool fromFile = false;
+
+  // Input file (mapped or read whole)
+  const char *data = nullptr;
+  std::size_t size = 0;
+  std::size_t offset = 0;
+  bool mapped = false;
+  std::string fileText;
+
+  // Input file that is streamed instead of mapped
+  int streamFd = -1;
+  bool streamEnded = false;
+  std::string streamBuffer;
+  std::size_t streamOffset = 0;
+
+  std::string stdinLine;
+
+  bool nextStreamed(std::string_view &line);
+};
+
+// Writes lines to a file or stdout, buffered into large writes
+class LineWriter {
+public:
+  LineWriter(const std::optional<std::filesystem::path> &outputPath,
+             bool lineBuffered);
+  ~LineWriter();
+
+  void write(const std::string &line);
+  void flush();
+
+private:
+  FILE *file = stdout;
+  bool lineBuffered = false;
+  std::string buffer;
 };
 
 void parseArgs(int argc, char *argv[], RunConfig &runConfig);
+piper::PhonemeIdMap loadPhonemeIdMap(RunConfig &runConfig);
+void processLine(json &lineObj, RunConfig &runConfig,
+                 piper::PhonemeIdConfig &idConfig,
+                 std::map<piper::Phoneme, std::size_t> &missingPhonemes);
+void writeTrace(RunConfig &runConfig);
+
+#ifndef _WIN32
+int serve(RunConfig &runConfig, piper::PhonemeIdConfig &idConfig,
+          tashkeel::State &tashkeelState);
+#endif
 
 // ----------------------------------------------------------------------------
 
@@ -46,6 +160,9 @@ int main(int argc, char *argv[]) {
   RunConfig runConfig;
   parseArgs(argc, argv, runConfig);
 
+  // stdin is only read with std::getline
+  std::ios_base::sync_with_stdio(false);
+
 #ifdef _WIN32
   // Required on Windows to show IPA symbols
   SetConsoleOutputCP(CP_UTF8);
@@ -56,7 +173,18 @@ int main(int argc, char *argv[]) {
   piper::PhonemeIdConfig idConfig;
   tashkeel::State tashkeelState;
 
-  if (runConfig.phonemeType == eSpeakPhonemes) {
+  if (runConfig.traceFilePath) {
+    // Include eSpeak and tashkeel loading in timeline
+    piper::set_trace_thread_name("main");
+    piper::start_trace();
+  }
+
+  piper::TraceSpan loadSpan("load");
+
+  if ((runConfig.phonemeType == eSpeakPhonemes) && !runConfig.eSpeakDataPath &&
+      runConfig.jsonInput) {
+    // Only lines that already have "phonemes" can be processed
+  } else if (runConfig.phonemeType == eSpeakPhonemes) {
     // Need to initialize eSpeak
     if (!runConfig.eSpeakDataPath) {
       throw std::runtime_error(
@@ -64,6 +192,9 @@ int main(int argc, char *argv[]) {
     }
 
     eSpeakConfig.voice = runConfig.language;
+    eSpeakConfig.phonemeRewriter =
+        piper::get_phoneme_rewriter(runConfig.language);
+    eSpeakConfig.maxSentencePhonemes = runConfig.maxSentencePhonemes;
 
     int result =
         espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS, 0,
@@ -79,12 +210,17 @@ int main(int argc, char *argv[]) {
         };
   } else {
     // Text "phonemes"
-    if (piper::DEFAULT_ALPHABET.count(runConfig.language) < 1) {
+    idConfig.phonemeIdMap =
+        piper::get_codepoints_phoneme_id_map(runConfig.language);
+    if (!idConfig.phonemeIdMap) {
       throw std::runtime_error("Language is not supported for text phonemes");
     }
+  }
 
-    idConfig.phonemeIdMap = std::make_shared<piper::PhonemeIdMap>(
-        piper::DEFAULT_ALPHABET[runConfig.language]);
+  if (runConfig.voiceConfigPath) {
+    // Ids from the voice instead of the default map
+    idConfig.phonemeIdMap =
+        std::make_shared<piper::PhonemeIdMap>(loadPhonemeIdMap(runConfig));
   }
 
   // Special handling for Arabic
@@ -93,6 +229,8 @@ int main(int argc, char *argv[]) {
       // Load tashkeel
       tashkeel::tashkeel_load(runConfig.tashkeelModelPath->string(),
                               tashkeelState);
+      tashkeelState.skipDiacritized = runConfig.tashkeelSkipDiacritized;
+      tashkeelState.cache.maxBytes = runConfig.tashkeelCacheBytes;
 
       // Text will be diacritized with libtashkeel.
       // https://github.com/mush42/libtashkeel
@@ -106,106 +244,792 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  loadSpan.end();
+
+  if (runConfig.servePath) {
+#ifdef _WIN32
+    throw std::runtime_error("--serve is not supported on Windows");
+#else
+    return serve(runConfig, idConfig, tashkeelState);
+#endif
+  }
+
   // Count of missing phonemes from phoneme/id map
   std::map<piper::Phoneme, std::size_t> missingPhonemes;
 
+  LineReader reader(runConfig.inputPath);
+  LineWriter writer(runConfig.outputPath, runConfig.lineBuffered);
+
   // Process each line as a JSON object, adding phonemes and phoneme ids.
-  std::string line;
-  while (std::getline(std::cin, line)) {
-    json lineObj;
-    if (runConfig.jsonInput) {
-      // Each line is JSON object with:
-      // {
-      //   "text": "Text to phonemize"
-      // }
-      lineObj = json::parse(line);
-    } else {
-      // Each line is plain text
-      lineObj["text"] = line;
+  try {
+    std::string_view line;
+    while (reader.next(line)) {
+      json lineObj;
+      if (runConfig.jsonInput) {
+        // Each line is JSON object with:
+        // {
+        //   "text": "Text to phonemize"
+        // }
+        lineObj = json::parse(line.begin(), line.end());
+      } else {
+        // Each line is plain text
+        lineObj["text"] = line;
+      }
+
+      piper::TraceSpan lineSpan("line");
+      lineSpan.addArg("text_bytes", line.size());
+
+      processLine(lineObj, runConfig, idConfig, missingPhonemes);
+
+      if ((missingPhonemes.size() > 0) && !runConfig.allowMissingPhonemes) {
+        // Fail early if there are any missing phonemes from the phoneme/id
+        // map.
+        for (auto phonemeAndCount : missingPhonemes) {
+          std::cerr << "Missing phoneme: \\u" << std::setw(4)
+                    << std::setfill('0') << std::hex
+                    << static_cast<uint32_t>(phonemeAndCount.first)
+                    << " for: " << lineObj.dump() << std::endl;
+        }
+
+        lineSpan.end();
+        writer.flush();
+        writeTrace(runConfig);
+        return 1;
+      }
+
+      piper::TraceSpan serializeSpan("serialize");
+      writer.write(lineObj.dump());
+    }
+  } catch (...) {
+    // Keep output of the lines before the error
+    writer.flush();
+    throw;
+  }
+
+  writer.flush();
+  writeTrace(runConfig);
+
+  if (missingPhonemes.size() > 0) {
+    // Print missing phonemes.
+    // We'll only get here if --allow_missing_phonemes is set
+    std::cerr << "WARNING: There were " << missingPhonemes.size()
+              << " missing phonemes:" << std::endl;
+
+    for (auto phonemeAndCount : missingPhonemes) {
+      std::cerr << "\\u" << std::setw(4) << std::setfill('0') << std::hex
+                << static_cast<uint32_t>(phonemeAndCount.first)
+                << " (count=" << phonemeAndCount.second << ")" << std::endl;
+    }
+  }
+
+  if (tashkeelState.cache.maxBytes > 0) {
+    std::cerr << std::dec << "Tashkeel cache: hits=" << tashkeelState.cache.hits
+              << " misses=" << tashkeelState.cache.misses
+              << " entries=" << tashkeelState.cache.size()
+              << " bytes=" << tashkeelState.cache.bytes() << std::endl;
+  }
+
+  if (runConfig.textToPhonemes && (runConfig.phonemeType == eSpeakPhonemes)) {
+    // Terminate eSpeak
+    espeak_Terminate();
+  }
+
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+// Appends the codepoints of phoneme strings (usually one codepoint each)
+void parsePhonemes(const json &phonemesObj,
+                   std::vector<piper::Phoneme> &sentencePhonemes) {
+  for (auto &phonemeObj : phonemesObj) {
+    auto &phonemeStr = phonemeObj.get_ref<const std::string &>();
+    auto phonemeRange = una::ranges::utf8_view{phonemeStr};
+    sentencePhonemes.insert(sentencePhonemes.end(), phonemeRange.begin(),
+                            phonemeRange.end());
+  }
+}
+
+// Adds processed text, phonemes, and phoneme ids to a line object.
+//
+// Lines that already have "phonemes" skip text processing and phonemization,
+// so cached or corrected phonemes only go through phoneme/id mapping. They
+// can be a list of phonemes (one sentence), or a list of lists (one per
+// sentence).
+void processLine(json &lineObj, RunConfig &runConfig,
+                 piper::PhonemeIdConfig &idConfig,
+                 std::map<piper::Phoneme, std::size_t> &missingPhonemes) {
+  std::vector<std::vector<piper::Phoneme>> phonemes;
+
+  if (lineObj.contains("phonemes")) {
+    auto &phonemesObj = lineObj["phonemes"];
+    if (!phonemesObj.is_array()) {
+      throw std::runtime_error("phonemes must be a list");
     }
 
+    if (!phonemesObj.empty() && phonemesObj[0].is_array()) {
+      for (auto &sentenceObj : phonemesObj) {
+        phonemes.emplace_back();
+        parsePhonemes(sentenceObj, phonemes.back());
+      }
+    } else {
+      phonemes.emplace_back();
+      parsePhonemes(phonemesObj, phonemes.back());
+    }
+  } else {
     auto text = lineObj["text"].get<std::string>();
     std::string processedText;
 
     if (lineObj.contains("processed_text")) {
       processedText = lineObj["processed_text"].get<std::string>();
     } else {
+      piper::TraceSpan processTextSpan("processText");
+      processTextSpan.addArg("text_bytes", text.size());
+
       processedText = runConfig.processText(text);
       lineObj["processed_text"] = processedText;
     }
 
-    std::vector<std::vector<piper::Phoneme>> phonemes;
-    if (!lineObj.contains("phonemes")) {
-      // Phonemize text
-      if (!runConfig.textToPhonemes) {
-        throw std::runtime_error("Text to phonemes function was not set.");
+    // Phonemize text
+    if (!runConfig.textToPhonemes) {
+      throw std::runtime_error(
+          "Line has no phonemes, and --espeak_data was not set");
+    }
+
+    piper::TraceSpan textToPhonemesSpan("textToPhonemes");
+    textToPhonemesSpan.addArg("text_bytes", processedText.size());
+
+    (*runConfig.textToPhonemes)(processedText, phonemes);
+    textToPhonemesSpan.end();
+
+    // Copy to JSON object
+    std::vector<std::string> linePhonemes;
+    for (auto &sentencePhonemes : phonemes) {
+      for (auto phoneme : sentencePhonemes) {
+        // Convert to UTF-8 string
+        std::u32string phonemeU32Str;
+        phonemeU32Str += phoneme;
+        linePhonemes.push_back(una::utf32to8(phonemeU32Str));
       }
+    }
+
+    lineObj["phonemes"] = linePhonemes;
+  }
+
+  // Ids are always computed, so phonemes can be mapped with a new
+  // phoneme/id map (--config).
+  piper::TraceSpan idsSpan("phonemes_to_ids");
+
+  // Add ids for phonenmes
+  std::vector<json::number_unsigned_t> phonemeIds;
+
+  for (auto &sentencePhonemes : phonemes) {
+    std::vector<piper::PhonemeId> sentIds;
+    piper::phonemes_to_ids(sentencePhonemes, idConfig, sentIds,
+                           missingPhonemes);
+    std::copy(sentIds.begin(), sentIds.end(), std::back_inserter(phonemeIds));
+  }
+
+  lineObj["phoneme_ids"] = phonemeIds;
+  idsSpan.addArg("ids", phonemeIds.size());
+}
+
+// Reads "phoneme_id_map" from the voice config (--config)
+piper::PhonemeIdMap loadPhonemeIdMap(RunConfig &runConfig) {
+  std::ifstream voiceConfigFile(runConfig.voiceConfigPath->string());
+  if (!voiceConfigFile.good()) {
+    throw std::runtime_error("Failed to open voice config: " +
+                             runConfig.voiceConfigPath->string());
+  }
+
+  auto voiceConfig = json::parse(voiceConfigFile);
+  if (!voiceConfig.contains("phoneme_id_map")) {
+    throw std::runtime_error("Voice config has no phoneme_id_map");
+  }
+
+  piper::PhonemeIdMap phonemeIdMap;
+  for (auto &phonemeAndIds : voiceConfig["phoneme_id_map"].items()) {
+    auto phonemeU32Str = una::utf8to32u(phonemeAndIds.key());
+    if (phonemeU32Str.size() != 1) {
+      throw std::runtime_error("Expected a single codepoint: " +
+                               phonemeAndIds.key());
+    }
+
+    phonemeIdMap[phonemeU32Str[0]] =
+        phonemeAndIds.value().get<std::vector<piper::PhonemeId>>();
+  }
+
+  return phonemeIdMap;
+}
+
+// Writes timeline from --trace
+void writeTrace(RunConfig &runConfig) {
+  if (!runConfig.traceFilePath) {
+    return;
+  }
+
+  piper::stop_trace();
+
+  std::ofstream traceFile(runConfig.traceFilePath->string());
+  piper::write_trace(traceFile);
+}
+
+// ----------------------------------------------------------------------------
+
+LineReader::LineReader(
+    const std::optional<std::filesystem::path> &inputPath) {
+  if (!inputPath) {
+    return;
+  }
+
+  fromFile = true;
+  auto path = inputPath->string();
+
+#ifdef _WIN32
+  // Whole file is read instead of mapped
+  std::ifstream inputFile(*inputPath, std::ios::binary);
+  if (!inputFile.good()) {
+    throw std::runtime_error("Failed to open input file: " + path);
+  }
+
+  std::stringstream inputStream;
+  inputStream << inputFile.rdbuf();
+  fileText = inputStream.str();
+  data = fileText.data();
+  size = fileText.size();
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open input file: " + path);
+  }
+
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0) {
+    close(fd);
+    throw std::runtime_error("Failed to open input file: " + path);
+  }
+
+  if (!S_ISREG(fileStat.st_mode)) {
+    // Size of a pipe is unknown, so it's read as it arrives
+    streamFd = fd;
+    return;
+  }
+
+  size = (std::size_t)fileStat.st_size;
+  if (size == 0) {
+    // Can't map an empty file
+    close(fd);
+    return;
+  }
+
+  // Mapping stays valid after the file is closed
+  void *mappedData = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mappedData == MAP_FAILED) {
+    throw std::runtime_error("Failed to map input file: " + path);
+  }
+
+  madvise(mappedData, size, MADV_SEQUENTIAL);
+  data = static_cast<const char *>(mappedData);
+  mapped = true;
+#endif
+}
+
+LineReader::~LineReader() {
+#ifndef _WIN32
+  if (mapped) {
+    munmap(const_cast<char *>(data), size);
+  }
+
+  if (streamFd >= 0) {
+    close(streamFd);
+  }
+#endif
+}
+
+bool LineReader::next(std::string_view &line) {
+  if (!fromFile) {
+    if (!std::getline(std::cin, stdinLine)) {
+      return false;
+    }
+
+    line = stdinLine;
+    return true;
+  }
+
+  if (streamFd >= 0) {
+    return nextStreamed(line);
+  }
+
+  if (offset >= size) {
+    return false;
+  }
+
+  // Same lines as std::getline: no empty line after a final newline
+  auto lineStart = data + offset;
+  auto newline = static_cast<const char *>(
+      std::memchr(lineStart, '\n', size - offset));
+  std::size_t lineLength =
+      newline ? (std::size_t)(newline - lineStart) : (size - offset);
+
+  line = std::string_view(lineStart, lineLength);
+  offset += lineLength + 1;
+
+  return true;
+}
+
+bool LineReader::nextStreamed(std::string_view &line) {
+  while (true) {
+    auto lineStart = streamBuffer.data() + streamOffset;
+    auto numBuffered = streamBuffer.size() - streamOffset;
+    auto newline =
+        static_cast<const char *>(std::memchr(lineStart, '\n', numBuffered));
+
+    if (newline) {
+      line = std::string_view(lineStart, newline - lineStart);
+      streamOffset += line.size() + 1;
+      return true;
+    }
+
+    if (streamEnded) {
+      // Last line may not end with a newline
+      if (numBuffered == 0) {
+        return false;
+      }
+
+      line = std::string_view(lineStart, numBuffered);
+      streamOffset = streamBuffer.size();
+      return true;
+    }
+
+    // Keep the partial line and read more after it
+    streamBuffer.erase(0, streamOffset);
+    streamOffset = 0;
 
-      (*runConfig.textToPhonemes)(processedText, phonemes);
+#ifndef _WIN32
+    auto bufferedSize = streamBuffer.size();
+    streamBuffer.resize(bufferedSize + INPUT_READ_BYTES);
 
-      // Copy to JSON object
-      std::vector<std::string> linePhonemes;
-      for (auto &sentencePhonemes : phonemes) {
-        for (auto phoneme : sentencePhonemes) {
-          // Convert to UTF-8 string
-          std::u32string phonemeU32Str;
-          phonemeU32Str += phoneme;
-          linePhonemes.push_back(una::utf32to8(phonemeU32Str));
+    ssize_t numRead = -1;
+    do {
+      numRead = read(streamFd, &streamBuffer[bufferedSize], INPUT_READ_BYTES);
+    } while ((numRead < 0) && (errno == EINTR));
+
+    if (numRead < 0) {
+      throw std::runtime_error("Failed to read input file");
+    }
+
+    streamBuffer.resize(bufferedSize + numRead);
+    streamEnded = (numRead == 0);
+#else
+    streamEnded = true;
+#endif
+  }
+}
+
+LineWriter::LineWriter(const std::optional<std::filesystem::path> &outputPath,
+                       bool lineBuffered)
+    : lineBuffered(lineBuffered) {
+  if (outputPath) {
+    file = std::fopen(outputPath->string().c_str(), "wb");
+    if (!file) {
+      throw std::runtime_error("Failed to open output file: " +
+                               outputPath->string());
+    }
+  }
+
+  buffer.reserve(OUTPUT_BUFFER_BYTES);
+}
+
+LineWriter::~LineWriter() {
+  if (!buffer.empty()) {
+    // Can't throw here
+    std::fwrite(buffer.data(), 1, buffer.size(), file);
+  }
+
+  if (file != stdout) {
+    std::fclose(file);
+  } else {
+    std::fflush(file);
+  }
+}
+
+void LineWriter::write(const std::string &line) {
+  buffer += line;
+  buffer += '\n';
+
+  if (lineBuffered || (buffer.size() >= OUTPUT_BUFFER_BYTES)) {
+    flush();
+  }
+}
+
+void LineWriter::flush() {
+  auto numWritten = std::fwrite(buffer.data(), 1, buffer.size(), file);
+  bool failed = (numWritten != buffer.size());
+  buffer.clear();
+
+  if ((std::fflush(file) != 0) || failed) {
+    throw std::runtime_error("Failed to write output");
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+#ifndef _WIN32
+
+// Written to by signal handler to stop the server
+static int stopServingPipe[2] = {-1, -1};
+
+static void stopServing(int) {
+  char stop = 1;
+  if (write(stopServingPipe[1], &stop, 1) < 0) {
+    _exit(1);
+  }
+}
+
+// Client connection, closed once the last response has been sent
+struct ServeConnection {
+  int fd;
+  std::mutex writeMutex;
+
+  explicit ServeConnection(int fd) : fd(fd) {}
+  ~ServeConnection() { close(fd); }
+
+  void send(const std::string &data) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+
+    std::size_t offset = 0;
+    while (offset < data.size()) {
+      auto numWritten = write(fd, data.data() + offset, data.size() - offset);
+      if (numWritten < 0) {
+        if (errno == EINTR) {
+          continue;
         }
+
+        // Client has gone away
+        return;
       }
 
-      lineObj["phonemes"] = linePhonemes;
+      offset += numWritten;
+    }
+  }
+};
+
+struct ServeRequest {
+  std::shared_ptr<ServeConnection> connection;
+  std::string line;
+};
+
+// Requests waiting for a worker.
+// Readers block in push while the queue is full, so a client that sends faster
+// than it is answered stops being read instead of growing the queue.
+struct ServeQueue {
+  std::mutex mutex;
+  std::condition_variable requestAdded;
+  std::condition_variable requestRemoved;
+  std::deque<ServeRequest> requests;
+
+  void push(ServeRequest request) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      requestRemoved.wait(
+          lock, [this] { return requests.size() < SERVE_QUEUE_REQUESTS; });
+      requests.push_back(std::move(request));
     }
 
-    if (!lineObj.contains("phonemes_ids")) {
-      // Add ids for phonenmes
-      std::vector<json::number_unsigned_t> phonemeIds;
+    requestAdded.notify_one();
+  }
+
+  ServeRequest pop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    requestAdded.wait(lock, [this] { return !requests.empty(); });
+
+    ServeRequest request = std::move(requests.front());
+    requests.pop_front();
+    lock.unlock();
+
+    requestRemoved.notify_one();
+
+    return request;
+  }
+};
 
-      for (auto &sentencePhonemes : phonemes) {
-        std::vector<piper::PhonemeId> sentIds;
-        piper::phonemes_to_ids(sentencePhonemes, idConfig, sentIds,
-                               missingPhonemes);
-        std::copy(sentIds.begin(), sentIds.end(),
-                  std::back_inserter(phonemeIds));
+// Number of connections with a running serveReader
+static std::atomic<std::size_t> numServeConnections(0);
+
+// Reads JSONL requests from a client until it closes its end.
+// Requests may be pipelined, so every complete line is queued immediately.
+void serveReader(std::shared_ptr<ServeConnection> connection,
+                 ServeQueue &queue) {
+  std::string buffer;
+  char chunk[4096];
+  bool lineTooLong = false;
+
+  while (true) {
+    auto numRead = read(connection->fd, chunk, sizeof(chunk));
+    if (numRead < 0) {
+      if (errno == EINTR) {
+        continue;
       }
 
-      lineObj["phoneme_ids"] = phonemeIds;
+      break;
     }
 
-    if ((missingPhonemes.size() > 0) && !runConfig.allowMissingPhonemes) {
-      // Fail early if there are any missing phonemes from the phoneme/id map.
-      for (auto phonemeAndCount : missingPhonemes) {
-        std::cerr << "Missing phoneme: \\u" << std::setw(4) << std::setfill('0')
-                  << std::hex << static_cast<uint32_t>(phonemeAndCount.first)
-                  << " for: " << lineObj.dump() << std::endl;
+    if (numRead == 0) {
+      // End of requests
+      break;
+    }
+
+    // Only the new chunk can contain a newline
+    std::size_t searchStart = buffer.size();
+    buffer.append(chunk, numRead);
+
+    std::size_t lineStart = 0;
+    std::size_t lineEnd = 0;
+    while ((lineEnd = buffer.find('\n', searchStart)) != std::string::npos) {
+      if ((lineEnd - lineStart) > SERVE_MAX_LINE_BYTES) {
+        lineTooLong = true;
+        break;
       }
-      return 1;
+
+      if (lineEnd > lineStart) {
+        queue.push({connection, buffer.substr(lineStart, lineEnd - lineStart)});
+      }
+
+      lineStart = lineEnd + 1;
+      searchStart = lineStart;
     }
 
-    std::cout << lineObj.dump() << std::endl;
+    buffer.erase(0, lineStart);
+
+    if (lineTooLong || (buffer.size() > SERVE_MAX_LINE_BYTES)) {
+      lineTooLong = true;
+      break;
+    }
   }
 
-  if (missingPhonemes.size() > 0) {
-    // Print missing phonemes.
-    // We'll only get here if --allow_missing_phonemes is set
-    std::cerr << "WARNING: There were " << missingPhonemes.size()
-              << " missing phonemes:" << std::endl;
+  if (lineTooLong) {
+    json errorObj;
+    errorObj["error"] = "Request is longer than " +
+                        std::to_string(SERVE_MAX_LINE_BYTES) + " bytes";
+    connection->send(errorObj.dump() + "\n");
 
-    for (auto phonemeAndCount : missingPhonemes) {
-      std::cerr << "\\u" << std::setw(4) << std::setfill('0') << std::hex
-                << static_cast<uint32_t>(phonemeAndCount.first)
-                << " (count=" << phonemeAndCount.second << ")" << std::endl;
+    // Discard the rest of the input, since closing a socket with unread data
+    // would reset the connection before the client reads the error.
+    while (true) {
+      auto numDiscarded = read(connection->fd, chunk, sizeof(chunk));
+      if ((numDiscarded == 0) || ((numDiscarded < 0) && (errno != EINTR))) {
+        break;
+      }
     }
+  } else if (!buffer.empty()) {
+    // Last request without a newline
+    queue.push({connection, buffer});
   }
 
-  if (runConfig.phonemeType == eSpeakPhonemes) {
-    // Terminate eSpeak
-    espeak_Terminate();
+  numServeConnections--;
+}
+
+// Processes requests from all clients.
+// Responses are sent as soon as they're ready, so they may be out of order.
+void serveWorker(std::size_t workerId, ServeQueue &queue,
+                 RunConfig &runConfig, piper::PhonemeIdConfig &idConfig) {
+  piper::set_trace_thread_name("worker " + std::to_string(workerId));
+
+  while (true) {
+    ServeRequest request = queue.pop();
+
+    piper::TraceSpan requestSpan("request");
+    requestSpan.addArg("request_bytes", request.line.size());
+
+    json lineObj;
+    try {
+      // Each request is a JSON object with:
+      // {
+      //   "id": <returned in response>,
+      //   "text": "Text to phonemize"
+      // }
+      lineObj = json::parse(request.line);
+
+      std::map<piper::Phoneme, std::size_t> missingPhonemes;
+      processLine(lineObj, runConfig, idConfig, missingPhonemes);
+
+      if ((missingPhonemes.size() > 0) && !runConfig.allowMissingPhonemes) {
+        std::stringstream errorStr;
+        errorStr << "Missing phonemes:";
+        for (auto phonemeAndCount : missingPhonemes) {
+          errorStr << " \\u" << std::setw(4) << std::setfill('0') << std::hex
+                   << static_cast<uint32_t>(phonemeAndCount.first);
+        }
+
+        throw std::runtime_error(errorStr.str());
+      }
+    } catch (const std::exception &e) {
+      json errorObj;
+      if (lineObj.is_object() && lineObj.contains("id")) {
+        errorObj["id"] = lineObj["id"];
+      }
+
+      errorObj["error"] = e.what();
+      lineObj = errorObj;
+    }
+
+    piper::TraceSpan serializeSpan("serialize");
+    request.connection->send(lineObj.dump() + "\n");
   }
+}
 
-  return 0;
+// Keeps eSpeak and tashkeel loaded, and answers JSONL requests over a Unix
+// domain socket until interrupted (the --trace file is written then).
+int serve(RunConfig &runConfig, piper::PhonemeIdConfig &idConfig,
+          tashkeel::State &tashkeelState) {
+  std::mutex eSpeakMutex;
+  if ((runConfig.phonemeType == eSpeakPhonemes) && runConfig.textToPhonemes) {
+    // eSpeak has global state, so only one thread may use it at a time
+    auto textToPhonemes = *runConfig.textToPhonemes;
+    runConfig.textToPhonemes =
+        [textToPhonemes,
+         &eSpeakMutex](std::string text,
+                       std::vector<std::vector<piper::Phoneme>> &phonemes) {
+          std::lock_guard<std::mutex> lock(eSpeakMutex);
+          textToPhonemes(text, phonemes);
+        };
+  }
+
+  std::unique_ptr<tashkeel::Service> tashkeelService;
+  if ((runConfig.language == "ar") && runConfig.tashkeelModelPath) {
+    // Text from concurrent requests is diacritized in batches
+    tashkeelService = std::make_unique<tashkeel::Service>(tashkeelState);
+    runConfig.processText = [&tashkeelService](std::string text) {
+      return tashkeelService->submit(text).get();
+    };
+  }
+
+  std::string serveSocketPath = runConfig.servePath->string();
+
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (serveSocketPath.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("Socket path is too long: " + serveSocketPath);
+  }
+
+  std::memcpy(address.sun_path, serveSocketPath.c_str(),
+              serveSocketPath.size());
+
+  struct stat socketStat;
+  if ((stat(serveSocketPath.c_str(), &socketStat) == 0) &&
+      S_ISSOCK(socketStat.st_mode)) {
+    // Only remove the socket if no server is listening on it
+    int probeFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probeFd < 0) {
+      throw std::runtime_error("Failed to create socket");
+    }
+
+    bool isListening =
+        (connect(probeFd, (sockaddr *)&address, sizeof(address)) == 0);
+    int connectError = errno;
+    close(probeFd);
+
+    if (isListening) {
+      throw std::runtime_error("Another server is listening on " +
+                               serveSocketPath);
+    }
+
+    if (connectError == ECONNREFUSED) {
+      // Left over from a previous server
+      unlink(serveSocketPath.c_str());
+    }
+  }
+
+  int serverFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (serverFd < 0) {
+    throw std::runtime_error("Failed to create socket");
+  }
+
+  if ((bind(serverFd, (sockaddr *)&address, sizeof(address)) != 0) ||
+      (listen(serverFd, SOMAXCONN) != 0)) {
+    throw std::runtime_error("Failed to listen on " + serveSocketPath);
+  }
+
+  if (pipe(stopServingPipe) != 0) {
+    throw std::runtime_error("Failed to create pipe");
+  }
+
+  std::signal(SIGPIPE, SIG_IGN);
+  std::signal(SIGINT, stopServing);
+  std::signal(SIGTERM, stopServing);
+
+  std::size_t numWorkers = runConfig.serveWorkers;
+  if (numWorkers < 1) {
+    numWorkers = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  ServeQueue queue;
+  for (std::size_t i = 0; i < numWorkers; i++) {
+    std::thread(serveWorker, i, std::ref(queue), std::ref(runConfig),
+                std::ref(idConfig))
+        .detach();
+  }
+
+  std::cerr << "Listening on " << serveSocketPath << " with " << numWorkers
+            << " worker(s)" << std::endl;
+
+  std::array<pollfd, 2> pollFds;
+  pollFds[0].fd = serverFd;
+  pollFds[0].events = POLLIN;
+  pollFds[1].fd = stopServingPipe[0];
+  pollFds[1].events = POLLIN;
+
+  while (true) {
+    if (poll(pollFds.data(), pollFds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      break;
+    }
+
+    if (pollFds[1].revents != 0) {
+      // Stopped by signal
+      break;
+    }
+
+    if (pollFds[0].revents == 0) {
+      continue;
+    }
+
+    int clientFd = accept(serverFd, nullptr, nullptr);
+    if (clientFd < 0) {
+      if ((errno == EINTR) || (errno == ECONNABORTED)) {
+        continue;
+      }
+
+      break;
+    }
+
+    auto connection = std::make_shared<ServeConnection>(clientFd);
+    if (numServeConnections >= SERVE_MAX_CONNECTIONS) {
+      json errorObj;
+      errorObj["error"] = "Too many connections";
+      connection->send(errorObj.dump() + "\n");
+      continue;
+    }
+
+    numServeConnections++;
+    std::thread(serveReader, connection, std::ref(queue)).detach();
+  }
+
+  unlink(serveSocketPath.c_str());
+  writeTrace(runConfig);
+
+  // Workers are still waiting on the queue
+  std::cout.flush();
+  _exit(0);
 }
 
+#endif // _WIN32
+
 // ----------------------------------------------------------------------------
 
 void printUsage(char *argv[]) {
@@ -218,6 +1042,10 @@ void printUsage(char *argv[]) {
   std::cerr
       << "   -l  LANG  --language     LANG  language of input text (required)"
       << std::endl;
+  std::cerr
+      << "   -c  FILE  --config      FILE  voice config with phoneme_id_map "
+         "(.onnx.json)"
+      << std::endl;
   std::cerr
       << "   --espeak_data           DIR   path to espeak-ng data directory"
       << std::endl;
@@ -225,6 +1053,15 @@ void printUsage(char *argv[]) {
       << "   --tashkeel_model        FILE  path to libtashkeel onnx model "
          "(arabic)"
       << std::endl;
+  std::cerr << "   --tashkeel_skip_diacritized   don't re-diacritize text that "
+               "already has harakat"
+            << std::endl;
+  std::cerr << "   --tashkeel_cache_bytes  BYTES cache diacritized text up to "
+               "memory limit"
+            << std::endl;
+  std::cerr << "   --max_phonemes          NUM   split longer sentences at "
+               "clauses/spaces (eSpeak)"
+            << std::endl;
   std::cerr
       << "   -j        --json_input        input is JSONL instead of plain text"
       << std::endl;
@@ -232,6 +1069,24 @@ void printUsage(char *argv[]) {
       << "   --allow_missing_phonemes      don't fail when phonemes are not "
          "recognized"
       << std::endl;
+  std::cerr << "   --serve                 FILE  answer JSONL requests on a Unix "
+               "socket"
+            << std::endl;
+  std::cerr << "   --workers               NUM   number of threads for --serve "
+               "(default: all cores)"
+            << std::endl;
+  std::cerr << "   --trace                 FILE  write timeline in Chrome trace "
+               "format"
+            << std::endl;
+  std::cerr << "   -i  FILE  --input       FILE  read lines from file instead "
+               "of stdin"
+            << std::endl;
+  std::cerr << "   -o  FILE  --output      FILE  write lines to file instead "
+               "of stdout"
+            << std::endl;
+  std::cerr << "   --line_buffered               write each line immediately "
+               "(interactive pipes)"
+            << std::endl;
   std::cerr << std::endl;
 }
 
@@ -244,25 +1099,53 @@ void ensureArg(int argc, char *argv[], int argi) {
 
 // Parse command-line arguments
 void parseArgs(int argc, char *argv[], RunConfig &runConfig) {
-  std::optional<std::filesystem::path> modelConfigPath;
-
   for (int i = 1; i < argc; i++) {
     std::string arg = argv[i];
 
     if (arg == "-l" || arg == "--language") {
       ensureArg(argc, argv, i);
       runConfig.language = std::string(argv[++i]);
+    } else if (arg == "-c" || arg == "--config") {
+      ensureArg(argc, argv, i);
+      runConfig.voiceConfigPath = std::filesystem::path(argv[++i]);
     } else if (arg == "--espeak_data" || arg == "--espeak-data") {
       ensureArg(argc, argv, i);
       runConfig.eSpeakDataPath = std::filesystem::path(argv[++i]);
     } else if (arg == "--tashkeel_model" || arg == "--tashkeel-model") {
       ensureArg(argc, argv, i);
       runConfig.tashkeelModelPath = std::filesystem::path(argv[++i]);
+    } else if (arg == "--tashkeel_skip_diacritized" ||
+               arg == "--tashkeel-skip-diacritized") {
+      runConfig.tashkeelSkipDiacritized = true;
+    } else if (arg == "--tashkeel_cache_bytes" ||
+               arg == "--tashkeel-cache-bytes") {
+      ensureArg(argc, argv, i);
+      runConfig.tashkeelCacheBytes = std::stoull(argv[++i]);
+    } else if (arg == "--max_phonemes" || arg == "--max-phonemes") {
+      ensureArg(argc, argv, i);
+      runConfig.maxSentencePhonemes = std::stoul(argv[++i]);
     } else if (arg == "-j" || arg == "--json_input" || arg == "--json-input") {
       runConfig.jsonInput = true;
     } else if (arg == "--allow_missing_phonemes" ||
                arg == "--allow-missing-phonemes") {
       runConfig.allowMissingPhonemes = true;
+    } else if (arg == "--serve") {
+      ensureArg(argc, argv, i);
+      runConfig.servePath = std::filesystem::path(argv[++i]);
+    } else if (arg == "--workers") {
+      ensureArg(argc, argv, i);
+      runConfig.serveWorkers = std::stoul(argv[++i]);
+    } else if (arg == "--trace") {
+      ensureArg(argc, argv, i);
+      runConfig.traceFilePath = std::filesystem::path(argv[++i]);
+    } else if (arg == "-i" || arg == "--input") {
+      ensureArg(argc, argv, i);
+      runConfig.inputPath = std::filesystem::path(argv[++i]);
+    } else if (arg == "-o" || arg == "--output") {
+      ensureArg(argc, argv, i);
+      runConfig.outputPath = std::filesystem::path(argv[++i]);
+    } else if (arg == "--line_buffered" || arg == "--line-buffered") {
+      runConfig.lineBuffered = true;
     } else if (arg == "-h" || arg == "--help") {
       printUsage(argv);
       exit(0);
@@ -0,0 +1,269 @@
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "normalize.hpp"
+#include "uni_algo.h"
+
+namespace piper {
+
+// Characters below this are looked up in a table
+const char32_t FAST_TABLE_END = 0x0500;
+
+// Longest result in the table range (e.g., "ΐ" with CASING_FOLD)
+const std::size_t MAX_FAST_LENGTH = 3;
+
+// Number of bytes converted at once in runs of ASCII
+const std::size_t ASCII_CHUNK_SIZE = 16;
+
+const std::size_t NO_POSITION = std::string::npos;
+
+struct FastEntry {
+  Phoneme codepoints[MAX_FAST_LENGTH] = {};
+
+  // 0 if the character must go through uni_algo
+  uint8_t length = 0;
+};
+
+typedef std::array<FastEntry, FAST_TABLE_END> FastTable;
+
+// Reference implementation (also used outside the table range)
+static void normalizeSlow(std::string_view text, TextCasing casing,
+                          std::vector<Phoneme> &output) {
+  std::string casedText;
+  if (casing == CASING_LOWER) {
+    casedText = una::cases::to_lowercase_utf8(text);
+  } else if (casing == CASING_UPPER) {
+    casedText = una::cases::to_uppercase_utf8(text);
+  } else if (casing == CASING_FOLD) {
+    casedText = una::cases::to_casefold_utf8(text);
+  } else {
+    casedText = std::string(text);
+  }
+
+  // Decompose, e.g. "ç" -> "c" + "̧"
+  auto textNorm = una::norm::to_nfd_utf8(casedText);
+  auto textRange = una::ranges::utf8_view{textNorm};
+  output.insert(output.end(), textRange.begin(), textRange.end());
+}
+
+// Combining marks can be reordered with the marks of the character before
+// them, so they (and the character) always go through uni_algo.
+static bool isCombiningMark(char32_t c) {
+  return ((c >= 0x0300) && (c <= 0x036F)) || ((c >= 0x0483) && (c <= 0x0489));
+}
+
+// Results of normalizeSlow for each character in the table range
+static const FastTable &fastTable(TextCasing casing) {
+  static std::array<FastTable, 4> tables;
+  static std::array<std::once_flag, 4> tablesBuilt;
+
+  std::call_once(tablesBuilt[casing], [casing]() {
+    auto &table = tables[casing];
+    std::vector<Phoneme> normalized;
+
+    for (char32_t c = 0; c < FAST_TABLE_END; c++) {
+      if (isCombiningMark(c)) {
+        continue;
+      }
+
+      normalized.clear();
+      normalizeSlow(una::utf32to8(std::u32string(1, c)), casing, normalized);
+      if (normalized.size() > MAX_FAST_LENGTH) {
+        continue;
+      }
+
+      std::copy(normalized.begin(), normalized.end(), table[c].codepoints);
+      table[c].length = (uint8_t)normalized.size();
+    }
+  });
+
+  return tables[casing];
+}
+
+// Decodes a 1 or 2 byte UTF-8 character at text[offset] in the table range.
+// Returns its length in bytes, or 0 if there isn't one.
+static std::size_t decodeFast(const uint8_t *text, std::size_t textLength,
+                              std::size_t offset, char32_t &c) {
+  uint8_t lead = text[offset];
+  if (lead < 0x80) {
+    c = lead;
+    return 1;
+  }
+
+  // U+0080 to U+04FF (leads 0xC0 and 0xC1 are overlong)
+  if ((lead >= 0xC2) && (lead <= 0xD3) && ((offset + 1) < textLength)) {
+    uint8_t next = text[offset + 1];
+    if ((next & 0xC0) == 0x80) {
+      c = ((char32_t)(lead & 0x1F) << 6) | (next & 0x3F);
+      return 2;
+    }
+  }
+
+  return 0;
+}
+
+// Appends ASCII_CHUNK_SIZE characters with casing applied, if they're all
+// ASCII. Returns false without appending anything otherwise.
+static bool appendAsciiChunk(const uint8_t *text, TextCasing casing,
+                             std::vector<Phoneme> &output) {
+#if defined(__SSE2__) || defined(_M_X64)
+  __m128i chunk = _mm_loadu_si128((const __m128i *)text);
+  if (_mm_movemask_epi8(chunk) != 0) {
+    return false;
+  }
+
+  if ((casing == CASING_LOWER) || (casing == CASING_FOLD)) {
+    __m128i isUpper =
+        _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('A' - 1)),
+                      _mm_cmplt_epi8(chunk, _mm_set1_epi8('Z' + 1)));
+    chunk = _mm_add_epi8(chunk, _mm_and_si128(isUpper, _mm_set1_epi8(0x20)));
+  } else if (casing == CASING_UPPER) {
+    __m128i isLower =
+        _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('a' - 1)),
+                      _mm_cmplt_epi8(chunk, _mm_set1_epi8('z' + 1)));
+    chunk = _mm_sub_epi8(chunk, _mm_and_si128(isLower, _mm_set1_epi8(0x20)));
+  }
+
+  // Widen bytes to 32-bit codepoints
+  auto outputStart = output.size();
+  output.resize(outputStart + ASCII_CHUNK_SIZE);
+  auto out = (__m128i *)(output.data() + outputStart);
+
+  __m128i zero = _mm_setzero_si128();
+  __m128i low = _mm_unpacklo_epi8(chunk, zero);
+  __m128i high = _mm_unpackhi_epi8(chunk, zero);
+  _mm_storeu_si128(out, _mm_unpacklo_epi16(low, zero));
+  _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(low, zero));
+  _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(high, zero));
+  _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(high, zero));
+
+  return true;
+#elif defined(__aarch64__)
+  uint8x16_t chunk = vld1q_u8(text);
+  if (vmaxvq_u8(chunk) >= 0x80) {
+    return false;
+  }
+
+  if ((casing == CASING_LOWER) || (casing == CASING_FOLD)) {
+    uint8x16_t isUpper = vandq_u8(vcgeq_u8(chunk, vdupq_n_u8('A')),
+                                  vcleq_u8(chunk, vdupq_n_u8('Z')));
+    chunk = vaddq_u8(chunk, vandq_u8(isUpper, vdupq_n_u8(0x20)));
+  } else if (casing == CASING_UPPER) {
+    uint8x16_t isLower = vandq_u8(vcgeq_u8(chunk, vdupq_n_u8('a')),
+                                  vcleq_u8(chunk, vdupq_n_u8('z')));
+    chunk = vsubq_u8(chunk, vandq_u8(isLower, vdupq_n_u8(0x20)));
+  }
+
+  // Widen bytes to 32-bit codepoints
+  auto outputStart = output.size();
+  output.resize(outputStart + ASCII_CHUNK_SIZE);
+  auto out = (uint32_t *)(output.data() + outputStart);
+
+  uint16x8_t low = vmovl_u8(vget_low_u8(chunk));
+  uint16x8_t high = vmovl_high_u8(chunk);
+  vst1q_u32(out, vmovl_u16(vget_low_u16(low)));
+  vst1q_u32(out + 4, vmovl_high_u16(low));
+  vst1q_u32(out + 8, vmovl_u16(vget_low_u16(high)));
+  vst1q_u32(out + 12, vmovl_high_u16(high));
+
+  return true;
+#else
+  // Characters go through the table one at a time instead
+  (void)text;
+  (void)casing;
+  (void)output;
+  return false;
+#endif
+}
+
+PIPERPHONEMIZE_EXPORT void normalize_codepoints(std::string_view text,
+                                                TextCasing casing,
+                                                std::vector<Phoneme> &output) {
+  // Lowercase sigma depends on the characters around it (σ or final ς)
+  if ((casing == CASING_LOWER) && (text.find("Σ") != std::string_view::npos)) {
+    normalizeSlow(text, casing, output);
+    return;
+  }
+
+  auto &table = fastTable(casing);
+  auto textBytes = (const uint8_t *)text.data();
+  auto textLength = text.size();
+
+  // Usually no more codepoints than bytes
+  output.reserve(output.size() + textLength);
+
+  // Start of text that is waiting to go through uni_algo
+  std::size_t slowStart = NO_POSITION;
+
+  // Last character taken from the table, which must be redone if a
+  // combining mark follows it
+  std::size_t lastStart = NO_POSITION;
+  std::size_t lastOutputStart = 0;
+
+  std::size_t offset = 0;
+  while (offset < textLength) {
+    if ((slowStart == NO_POSITION) && (textBytes[offset] < 0x80)) {
+      while (((offset + ASCII_CHUNK_SIZE) <= textLength) &&
+             appendAsciiChunk(textBytes + offset, casing, output)) {
+        offset += ASCII_CHUNK_SIZE;
+        lastStart = offset - 1;
+        lastOutputStart = output.size() - 1;
+      }
+
+      if (offset >= textLength) {
+        break;
+      }
+    }
+
+    char32_t c = 0;
+    auto charLength = decodeFast(textBytes, textLength, offset, c);
+    if ((charLength > 0) && (table[c].length > 0)) {
+      if (slowStart != NO_POSITION) {
+        normalizeSlow(text.substr(slowStart, offset - slowStart), casing,
+                      output);
+        slowStart = NO_POSITION;
+      }
+
+      lastStart = offset;
+      lastOutputStart = output.size();
+
+      auto &entry = table[c];
+      for (std::size_t i = 0; i < entry.length; i++) {
+        output.push_back(entry.codepoints[i]);
+      }
+
+      offset += charLength;
+      continue;
+    }
+
+    if (slowStart == NO_POSITION) {
+      if (lastStart != NO_POSITION) {
+        // Redo the previous character together with this one
+        output.resize(lastOutputStart);
+        slowStart = lastStart;
+      } else {
+        slowStart = offset;
+      }
+    }
+
+    // Continuation bytes are never taken from the table, so this doesn't
+    // split characters
+    offset++;
+  }
+
+  if (slowStart != NO_POSITION) {
+    normalizeSlow(text.substr(slowStart), casing, output);
+  }
+}
+
+} // namespace piper
@@ -0,0 +1,26 @@
+#ifndef NORMALIZE_H_
+#define NORMALIZE_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "phonemize.hpp"
+#include "shared.hpp"
+
+namespace piper {
+
+// Applies casing and then NFD decomposition to UTF-8 text, appending the
+// resulting codepoints to output.
+//
+// Same result as una::cases, una::norm::to_nfd_utf8, and decoding, but in a
+// single pass. Characters below U+0500 (Latin, IPA, Greek, Cyrillic) come
+// from precomputed tables, and runs of ASCII are converted 16 bytes at a time.
+// Combining marks and everything else go through uni_algo.
+PIPERPHONEMIZE_EXPORT void normalize_codepoints(std::string_view text,
+                                                TextCasing casing,
+                                                std::vector<Phoneme> &output);
+
+} // namespace piper
+
+#endif // NORMALIZE_H_
@@ -0,0 +1,419 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "phoneme_id_table.hpp"
+#include "stats.hpp"
+
+namespace piper {
+
+static_assert(sizeof(PhonemeIdTableHeader) == 64,
+              "Phoneme id table header must be 64 bytes");
+static_assert(sizeof(PhonemeIdTableEntry) == 12,
+              "Phoneme id table entry must be 12 bytes");
+static_assert(sizeof(PhonemeId) == 8, "Phoneme ids must be 64 bits");
+
+// CRC-32 (IEEE 802.3, reflected)
+static uint32_t crc32Update(uint32_t crc, const void *data, std::size_t size) {
+  static const std::array<uint32_t, 256> crcTable = []() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t value = i;
+      for (int bit = 0; bit < 8; bit++) {
+        value = (value & 1) ? (0xEDB88320 ^ (value >> 1)) : (value >> 1);
+      }
+
+      table[i] = value;
+    }
+
+    return table;
+  }();
+
+  auto bytes = static_cast<const uint8_t *>(data);
+  crc = ~crc;
+  for (std::size_t i = 0; i < size; i++) {
+    crc = crcTable[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
+
+// Checksum of the whole table with header.checksum = 0
+static uint32_t tableChecksum(const uint8_t *data, std::size_t size) {
+  PhonemeIdTableHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  header.checksum = 0;
+
+  uint32_t crc = crc32Update(0, &header, sizeof(header));
+  return crc32Update(crc, data + sizeof(header), size - sizeof(header));
+}
+
+static bool isLittleEndian() {
+  uint32_t value = 1;
+  uint8_t firstByte = 0;
+  std::memcpy(&firstByte, &value, 1);
+
+  return firstByte == 1;
+}
+
+// ----------------------------------------------------------------------------
+
+PIPERPHONEMIZE_EXPORT std::string
+compile_phoneme_id_table(const PhonemeIdMap &phonemeIdMap,
+                         const PhonemeIdConfig &config) {
+  if (!isLittleEndian()) {
+    throw std::runtime_error(
+        "Phoneme id tables are only supported on little endian systems");
+  }
+
+  // pad/bos/eos are checked once here instead of on every lookup
+  auto requirePhoneme = [&phonemeIdMap](Phoneme phoneme, const char *name) {
+    if (phonemeIdMap.count(phoneme) < 1) {
+      throw std::runtime_error(std::string("Phoneme id map is missing ") +
+                               name);
+    }
+  };
+
+  uint32_t flags = 0;
+  if (config.interspersePad) {
+    requirePhoneme(config.pad, "pad");
+    flags |= PHONEME_ID_TABLE_INTERSPERSE_PAD;
+  }
+
+  if (config.addBos) {
+    requirePhoneme(config.bos, "bos");
+    flags |= PHONEME_ID_TABLE_ADD_BOS;
+  }
+
+  if (config.addEos) {
+    requirePhoneme(config.eos, "eos");
+    flags |= PHONEME_ID_TABLE_ADD_EOS;
+  }
+
+  // std::map is already sorted by phoneme
+  std::vector<PhonemeIdTableEntry> entries;
+  std::vector<PhonemeId> ids;
+  for (auto &phonemeAndIds : phonemeIdMap) {
+    PhonemeIdTableEntry entry;
+    entry.phoneme = (uint32_t)phonemeAndIds.first;
+    entry.firstId = (uint32_t)ids.size();
+    entry.numIds = (uint32_t)phonemeAndIds.second.size();
+    entries.push_back(entry);
+
+    ids.insert(ids.end(), phonemeAndIds.second.begin(),
+               phonemeAndIds.second.end());
+  }
+
+  PhonemeIdTableHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = PHONEME_ID_TABLE_MAGIC;
+  header.version = PHONEME_ID_TABLE_VERSION;
+  header.headerSize = sizeof(header);
+  header.pad = (uint32_t)config.pad;
+  header.bos = (uint32_t)config.bos;
+  header.eos = (uint32_t)config.eos;
+  header.flags = flags;
+  header.numEntries = (uint32_t)entries.size();
+  header.numIds = (uint32_t)ids.size();
+  header.entriesOffset = sizeof(header);
+
+  auto entriesEnd =
+      header.entriesOffset + (entries.size() * sizeof(PhonemeIdTableEntry));
+  header.idsOffset = (entriesEnd + alignof(PhonemeId) - 1) &
+                     ~(uint64_t)(alignof(PhonemeId) - 1);
+  header.fileSize = header.idsOffset + (ids.size() * sizeof(PhonemeId));
+
+  std::string tableBytes(header.fileSize, '\0');
+  std::memcpy(&tableBytes[0], &header, sizeof(header));
+  if (!entries.empty()) {
+    std::memcpy(&tableBytes[header.entriesOffset], entries.data(),
+                entries.size() * sizeof(PhonemeIdTableEntry));
+  }
+
+  if (!ids.empty()) {
+    std::memcpy(&tableBytes[header.idsOffset], ids.data(),
+                ids.size() * sizeof(PhonemeId));
+  }
+
+  header.checksum = tableChecksum((const uint8_t *)tableBytes.data(),
+                                  tableBytes.size());
+  std::memcpy(&tableBytes[0], &header, sizeof(header));
+
+  return tableBytes;
+}
+
+// ----------------------------------------------------------------------------
+
+static void unmapFile(const void *data, [[maybe_unused]] std::size_t size) {
+#ifdef _WIN32
+  UnmapViewOfFile(data);
+#else
+  munmap(const_cast<void *>(data), size);
+#endif
+}
+
+// Maps a whole file read-only
+static const void *mapFile(const std::string &path, std::size_t &size) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    throw std::runtime_error("Failed to open phoneme id table: " + path);
+  }
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize)) {
+    CloseHandle(file);
+    throw std::runtime_error("Failed to open phoneme id table: " + path);
+  }
+
+  size = (std::size_t)fileSize.QuadPart;
+  if (size < sizeof(PhonemeIdTableHeader)) {
+    CloseHandle(file);
+    throw std::runtime_error("Phoneme id table is too small: " + path);
+  }
+
+  // View stays valid after both handles are closed
+  HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (mapping == nullptr) {
+    throw std::runtime_error("Failed to map phoneme id table: " + path);
+  }
+
+  const void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (data == nullptr) {
+    throw std::runtime_error("Failed to map phoneme id table: " + path);
+  }
+
+  return data;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open phoneme id table: " + path);
+  }
+
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0) {
+    close(fd);
+    throw std::runtime_error("Failed to open phoneme id table: " + path);
+  }
+
+  size = (std::size_t)fileStat.st_size;
+  if (size < sizeof(PhonemeIdTableHeader)) {
+    close(fd);
+    throw std::runtime_error("Phoneme id table is too small: " + path);
+  }
+
+  // Mapping stays valid after the file is closed
+  void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("Failed to map phoneme id table: " + path);
+  }
+
+  return data;
+#endif
+}
+
+// Throws if the mapped table is not usable
+static void checkTable(const uint8_t *data, std::size_t size) {
+  PhonemeIdTableHeader header;
+  std::memcpy(&header, data, sizeof(header));
+
+  if (header.magic != PHONEME_ID_TABLE_MAGIC) {
+    throw std::runtime_error("Not a phoneme id table");
+  }
+
+  if (header.version != PHONEME_ID_TABLE_VERSION) {
+    throw std::runtime_error("Unsupported phoneme id table version");
+  }
+
+  if ((header.headerSize != sizeof(header)) || (header.fileSize != size)) {
+    throw std::runtime_error("Phoneme id table is truncated");
+  }
+
+  auto entriesEnd = header.entriesOffset +
+                    ((uint64_t)header.numEntries * sizeof(PhonemeIdTableEntry));
+  auto idsEnd =
+      header.idsOffset + ((uint64_t)header.numIds * sizeof(PhonemeId));
+  if ((header.entriesOffset < sizeof(header)) || (entriesEnd > size) ||
+      (header.idsOffset < entriesEnd) || (idsEnd > size) ||
+      ((header.entriesOffset % alignof(PhonemeIdTableEntry)) != 0) ||
+      ((header.idsOffset % alignof(PhonemeId)) != 0)) {
+    throw std::runtime_error("Phoneme id table is truncated");
+  }
+
+  if (tableChecksum(data, size) != header.checksum) {
+    throw std::runtime_error("Phoneme id table checksum mismatch");
+  }
+}
+
+PIPERPHONEMIZE_EXPORT std::shared_ptr<const PhonemeIdTable>
+load_phoneme_id_table(const std::string &path) {
+  if (!isLittleEndian()) {
+    throw std::runtime_error(
+        "Phoneme id tables are only supported on little endian systems");
+  }
+
+  // Constructor is private
+  std::shared_ptr<PhonemeIdTable> table(new PhonemeIdTable());
+  table->mappedData = mapFile(path, table->mappedSize);
+
+  auto data = static_cast<const uint8_t *>(table->mappedData);
+  checkTable(data, table->mappedSize);
+
+  PhonemeIdTableHeader header;
+  std::memcpy(&header, data, sizeof(header));
+
+  table->entries =
+      reinterpret_cast<const PhonemeIdTableEntry *>(data + header.entriesOffset);
+  table->numEntries = header.numEntries;
+  table->ids = reinterpret_cast<const PhonemeId *>(data + header.idsOffset);
+
+  // Entries must be sorted and refer to ids in the table
+  for (std::size_t i = 0; i < table->numEntries; i++) {
+    auto &entry = table->entries[i];
+    if (((i > 0) && (table->entries[i - 1].phoneme >= entry.phoneme)) ||
+        (((uint64_t)entry.firstId + entry.numIds) > header.numIds)) {
+      throw std::runtime_error("Phoneme id table is corrupt");
+    }
+  }
+
+  auto &config = table->tableConfig;
+  config.pad = (Phoneme)header.pad;
+  config.bos = (Phoneme)header.bos;
+  config.eos = (Phoneme)header.eos;
+  config.interspersePad = (header.flags & PHONEME_ID_TABLE_INTERSPERSE_PAD);
+  config.addBos = (header.flags & PHONEME_ID_TABLE_ADD_BOS);
+  config.addEos = (header.flags & PHONEME_ID_TABLE_ADD_EOS);
+
+  std::size_t numIds = 0;
+  if ((config.interspersePad && !table->find(config.pad, numIds)) ||
+      (config.addBos && !table->find(config.bos, numIds)) ||
+      (config.addEos && !table->find(config.eos, numIds))) {
+    throw std::runtime_error("Phoneme id table is corrupt");
+  }
+
+  return table;
+}
+
+PIPERPHONEMIZE_EXPORT PhonemeIdTable::~PhonemeIdTable() {
+  if (mappedData) {
+    unmapFile(mappedData, mappedSize);
+  }
+}
+
+PIPERPHONEMIZE_EXPORT const PhonemeId *
+PhonemeIdTable::find(Phoneme phoneme, std::size_t &numIds) const {
+  auto entriesEnd = entries + numEntries;
+  auto entry = std::lower_bound(entries, entriesEnd, (uint32_t)phoneme,
+                                [](const PhonemeIdTableEntry &entry,
+                                   uint32_t phoneme) {
+                                  return entry.phoneme < phoneme;
+                                });
+
+  if ((entry == entriesEnd) || (entry->phoneme != (uint32_t)phoneme)) {
+    return nullptr;
+  }
+
+  numIds = entry->numIds;
+  return ids + entry->firstId;
+}
+
+PIPERPHONEMIZE_EXPORT PhonemeIdMap PhonemeIdTable::toMap() const {
+  PhonemeIdMap phonemeIdMap;
+  for (std::size_t i = 0; i < numEntries; i++) {
+    auto &entry = entries[i];
+    phonemeIdMap[(Phoneme)entry.phoneme].assign(
+        ids + entry.firstId, ids + entry.firstId + entry.numIds);
+  }
+
+  return phonemeIdMap;
+}
+
+// ----------------------------------------------------------------------------
+
+PIPERPHONEMIZE_EXPORT void
+phonemes_to_ids(const std::vector<Phoneme> &phonemes,
+                const PhonemeIdTable &table,
+                std::vector<PhonemeId> &phonemeIds,
+                std::map<Phoneme, std::size_t> &missingPhonemes) {
+  PIPERPHONEMIZE_STAGE_TIMER(idsTimer, STAGE_PHONEME_IDS);
+  PIPERPHONEMIZE_STAGE_ADD(idsTimer, phonemes, phonemes.size());
+  [[maybe_unused]] auto idsStart = phonemeIds.size();
+
+  auto &config = table.config();
+
+  // pad/bos/eos were checked when the table was loaded
+  std::size_t numIds = 0;
+  auto appendIds = [&phonemeIds, &table, &numIds](Phoneme phoneme) {
+    auto mappedIds = table.find(phoneme, numIds);
+    phonemeIds.insert(phonemeIds.end(), mappedIds, mappedIds + numIds);
+  };
+
+  // Beginning of sentence symbol (^)
+  if (config.addBos) {
+    appendIds(config.bos);
+
+    if (config.interspersePad) {
+      // Pad after bos (_)
+      appendIds(config.pad);
+    }
+  }
+
+  if (config.interspersePad) {
+    // Add ids for each phoneme *with* padding
+    std::size_t numPadIds = 0;
+    auto padIds = table.find(config.pad, numPadIds);
+
+    for (auto const phoneme : phonemes) {
+      auto mappedIds = table.find(phoneme, numIds);
+      if (!mappedIds) {
+        // Phoneme is missing from id map
+        missingPhonemes[phoneme] += 1;
+        continue;
+      }
+
+      phonemeIds.insert(phonemeIds.end(), mappedIds, mappedIds + numIds);
+
+      // pad (_)
+      phonemeIds.insert(phonemeIds.end(), padIds, padIds + numPadIds);
+    }
+  } else {
+    // Add ids for each phoneme *without* padding
+    for (auto const phoneme : phonemes) {
+      auto mappedIds = table.find(phoneme, numIds);
+      if (!mappedIds) {
+        // Same as phonemes_to_ids
+        throw std::out_of_range("Phoneme is missing from id map");
+      }
+
+      phonemeIds.insert(phonemeIds.end(), mappedIds, mappedIds + numIds);
+    }
+  }
+
+  // End of sentence symbol ($)
+  if (config.addEos) {
+    appendIds(config.eos);
+  }
+
+  PIPERPHONEMIZE_STAGE_ADD(idsTimer, bytesOut,
+                           (phonemeIds.size() - idsStart) * sizeof(PhonemeId));
+}
+
+} // namespace piper
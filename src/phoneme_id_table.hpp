@@ -0,0 +1,125 @@
+#ifndef PHONEME_ID_TABLE_H_
+#define PHONEME_ID_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "phoneme_ids.hpp"
+#include "phonemize.hpp"
+#include "shared.hpp"
+
+namespace piper {
+
+// Compiled phoneme id map files (.ppid).
+//
+// Layout (little endian, offsets are from the start of the file):
+//   PhonemeIdTableHeader
+//   PhonemeIdTableEntry[numEntries], sorted by phoneme
+//   PhonemeId[numIds], 8-byte aligned
+//
+// Create them with piper_phonemize_compile_ids or compile_phoneme_id_table.
+
+// "PPID" in little endian
+const uint32_t PHONEME_ID_TABLE_MAGIC = 0x44495050;
+const uint32_t PHONEME_ID_TABLE_VERSION = 1;
+
+// Bits of PhonemeIdTableHeader::flags
+const uint32_t PHONEME_ID_TABLE_INTERSPERSE_PAD = 1;
+const uint32_t PHONEME_ID_TABLE_ADD_BOS = 2;
+const uint32_t PHONEME_ID_TABLE_ADD_EOS = 4;
+
+struct PhonemeIdTableHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t headerSize;
+
+  // CRC-32 of the whole file, computed with this field set to 0
+  uint32_t checksum;
+
+  uint64_t fileSize;
+
+  // From PhonemeIdConfig
+  uint32_t pad;
+  uint32_t bos;
+  uint32_t eos;
+  uint32_t flags;
+
+  uint32_t numEntries;
+  uint32_t numIds;
+  uint64_t entriesOffset;
+  uint64_t idsOffset;
+};
+
+struct PhonemeIdTableEntry {
+  uint32_t phoneme;
+
+  // Ids of phoneme are ids[firstId] to ids[firstId + numIds]
+  uint32_t firstId;
+  uint32_t numIds;
+};
+
+class PhonemeIdTable;
+
+// Memory maps a compiled table.
+// Throws if the file is not a valid table (wrong version, bad checksum, etc.)
+PIPERPHONEMIZE_EXPORT std::shared_ptr<const PhonemeIdTable>
+load_phoneme_id_table(const std::string &path);
+
+// Compiled phoneme id map, loaded with load_phoneme_id_table.
+//
+// The file is memory mapped and used in place, so loading is cheap and its
+// pages are shared between processes that load the same file. Immutable, so
+// it can be shared between threads.
+class PhonemeIdTable {
+public:
+  PhonemeIdTable(const PhonemeIdTable &) = delete;
+  PhonemeIdTable &operator=(const PhonemeIdTable &) = delete;
+
+  PIPERPHONEMIZE_EXPORT ~PhonemeIdTable();
+
+  // Ids of a phoneme, or nullptr if it's not in the table
+  PIPERPHONEMIZE_EXPORT const PhonemeId *find(Phoneme phoneme,
+                                              std::size_t &numIds) const;
+
+  // Settings the table was compiled with (phonemeIdMap is not set)
+  const PhonemeIdConfig &config() const { return tableConfig; }
+
+  std::size_t size() const { return numEntries; }
+
+  // Same map the table was compiled from
+  PIPERPHONEMIZE_EXPORT PhonemeIdMap toMap() const;
+
+private:
+  PhonemeIdTable() = default;
+
+  friend std::shared_ptr<const PhonemeIdTable>
+  load_phoneme_id_table(const std::string &path);
+
+  const void *mappedData = nullptr;
+  std::size_t mappedSize = 0;
+
+  PhonemeIdConfig tableConfig;
+  const PhonemeIdTableEntry *entries = nullptr;
+  std::size_t numEntries = 0;
+  const PhonemeId *ids = nullptr;
+};
+
+// Serializes a map and the pad/bos/eos settings of config
+PIPERPHONEMIZE_EXPORT std::string
+compile_phoneme_id_table(const PhonemeIdMap &phonemeIdMap,
+                         const PhonemeIdConfig &config);
+
+// Like phonemes_to_ids, with the map and settings of a compiled table
+PIPERPHONEMIZE_EXPORT void
+phonemes_to_ids(const std::vector<Phoneme> &phonemes,
+                const PhonemeIdTable &table,
+                std::vector<PhonemeId> &phonemeIds,
+                std::map<Phoneme, std::size_t> &missingPhonemes);
+
+} // namespace piper
+
+#endif // PHONEME_ID_TABLE_H_
@@ -1,20 +1,282 @@
+#include <algorithm>
+#include <iterator>
 #include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "phoneme_ids.hpp"
+#include "stats.hpp"
 
 namespace piper {
 
+// Default tables are plain constant data, so they are neither built at
+// startup nor copied into every translation unit. Maps are only created from
+// them on first use (see get_espeak_phoneme_id_map).
+struct PhonemeIdEntry {
+  Phoneme phoneme;
+  PhonemeId id;
+};
+
+struct DefaultAlphabet {
+  const char *language;
+  const PhonemeIdEntry *entries;
+  std::size_t numEntries;
+};
+
+constexpr PhonemeIdEntry DEFAULT_PHONEME_IDS[] = {
+    {U'_', 0},
+    {U'^', 1},
+    {U'$', 2},
+    {U' ', 3},
+    {U'!', 4},
+    {U'\'', 5},
+    {U'(', 6},
+    {U')', 7},
+    {U',', 8},
+    {U'-', 9},
+    {U'.', 10},
+    {U':', 11},
+    {U';', 12},
+    {U'?', 13},
+    {U'a', 14},
+    {U'b', 15},
+    {U'c', 16},
+    {U'd', 17},
+    {U'e', 18},
+    {U'f', 19},
+    {U'h', 20},
+    {U'i', 21},
+    {U'j', 22},
+    {U'k', 23},
+    {U'l', 24},
+    {U'm', 25},
+    {U'n', 26},
+    {U'o', 27},
+    {U'p', 28},
+    {U'q', 29},
+    {U'r', 30},
+    {U's', 31},
+    {U't', 32},
+    {U'u', 33},
+    {U'v', 34},
+    {U'w', 35},
+    {U'x', 36},
+    {U'y', 37},
+    {U'z', 38},
+    {U'æ', 39},
+    {U'ç', 40},
+    {U'ð', 41},
+    {U'ø', 42},
+    {U'ħ', 43},
+    {U'ŋ', 44},
+    {U'œ', 45},
+    {U'ǀ', 46},
+    {U'ǁ', 47},
+    {U'ǂ', 48},
+    {U'ǃ', 49},
+    {U'ɐ', 50},
+    {U'ɑ', 51},
+    {U'ɒ', 52},
+    {U'ɓ', 53},
+    {U'ɔ', 54},
+    {U'ɕ', 55},
+    {U'ɖ', 56},
+    {U'ɗ', 57},
+    {U'ɘ', 58},
+    {U'ə', 59},
+    {U'ɚ', 60},
+    {U'ɛ', 61},
+    {U'ɜ', 62},
+    {U'ɞ', 63},
+    {U'ɟ', 64},
+    {U'ɠ', 65},
+    {U'ɡ', 66},
+    {U'ɢ', 67},
+    {U'ɣ', 68},
+    {U'ɤ', 69},
+    {U'ɥ', 70},
+    {U'ɦ', 71},
+    {U'ɧ', 72},
+    {U'ɨ', 73},
+    {U'ɪ', 74},
+    {U'ɫ', 75},
+    {U'ɬ', 76},
+    {U'ɭ', 77},
+    {U'ɮ', 78},
+    {U'ɯ', 79},
+    {U'ɰ', 80},
+    {U'ɱ', 81},
+    {U'ɲ', 82},
+    {U'ɳ', 83},
+    {U'ɴ', 84},
+    {U'ɵ', 85},
+    {U'ɶ', 86},
+    {U'ɸ', 87},
+    {U'ɹ', 88},
+    {U'ɺ', 89},
+    {U'ɻ', 90},
+    {U'ɽ', 91},
+    {U'ɾ', 92},
+    {U'ʀ', 93},
+    {U'ʁ', 94},
+    {U'ʂ', 95},
+    {U'ʃ', 96},
+    {U'ʄ', 97},
+    {U'ʈ', 98},
+    {U'ʉ', 99},
+    {U'ʊ', 100},
+    {U'ʋ', 101},
+    {U'ʌ', 102},
+    {U'ʍ', 103},
+    {U'ʎ', 104},
+    {U'ʏ', 105},
+    {U'ʐ', 106},
+    {U'ʑ', 107},
+    {U'ʒ', 108},
+    {U'ʔ', 109},
+    {U'ʕ', 110},
+    {U'ʘ', 111},
+    {U'ʙ', 112},
+    {U'ʛ', 113},
+    {U'ʜ', 114},
+    {U'ʝ', 115},
+    {U'ʟ', 116},
+    {U'ʡ', 117},
+    {U'ʢ', 118},
+    {U'ʲ', 119},
+    {U'ˈ', 120},
+    {U'ˌ', 121},
+    {U'ː', 122},
+    {U'ˑ', 123},
+    {U'˞', 124},
+    {U'β', 125},
+    {U'θ', 126},
+    {U'χ', 127},
+    {U'ᵻ', 128},
+    {U'ⱱ', 129},
+
+    // tones
+    {U'0', 130},
+    {U'1', 131},
+    {U'2', 132},
+    {U'3', 133},
+    {U'4', 134},
+    {U'5', 135},
+    {U'6', 136},
+    {U'7', 137},
+    {U'8', 138},
+    {U'9', 139},
+    {U'\u0327', 140}, // combining cedilla
+    {U'\u0303', 141}, // combining tilde
+    {U'\u032a', 142}, // combining bridge below
+    {U'\u032f', 143}, // combining inverted breve below
+    {U'\u0329', 144}, // combining vertical line below
+    {U'ʰ', 145},
+    {U'ˤ', 146},
+    {U'ε', 147},
+    {U'↓', 148},
+    {U'#', 149},  // Icelandic
+    {U'\"', 150}, // Russian
+
+    {U'↑', 151},
+
+    // Basque
+    {U'\u033a', 152},
+    {U'\u033b', 153},
+
+    // Luxembourgish
+    {U'g', 154},
+    {U'ʦ', 155},
+    {U'X', 156},
+
+    // Czech
+    {U'\u031d', 157},
+    {U'\u030a', 158},
+};
+
+// Ukrainian
+constexpr PhonemeIdEntry UK_PHONEME_IDS[] = {
+    {U'_', 0},  {U'^', 1},       {U'$', 2},       {U' ', 3},
+    {U'!', 4},  {U'\'', 5},      {U',', 6},       {U'-', 7},
+    {U'.', 8},  {U':', 9},       {U';', 10},      {U'?', 11},
+    {U'а', 12}, {U'б', 13},      {U'в', 14},      {U'г', 15},
+    {U'ґ', 16}, {U'д', 17},      {U'е', 18},      {U'є', 19},
+    {U'ж', 20}, {U'з', 21},      {U'и', 22},      {U'і', 23},
+    {U'ї', 24}, {U'й', 25},      {U'к', 26},      {U'л', 27},
+    {U'м', 28}, {U'н', 29},      {U'о', 30},      {U'п', 31},
+    {U'р', 32}, {U'с', 33},      {U'т', 34},      {U'у', 35},
+    {U'ф', 36}, {U'х', 37},      {U'ц', 38},      {U'ч', 39},
+    {U'ш', 40}, {U'щ', 41},      {U'ь', 42},      {U'ю', 43},
+    {U'я', 44}, {U'\u0301', 45}, {U'\u0306', 46}, {U'\u0308', 47},
+    {U'—', 48},
+};
+
+// language -> phoneme ids
+constexpr DefaultAlphabet DEFAULT_ALPHABET[] = {
+    {"uk", UK_PHONEME_IDS, std::size(UK_PHONEME_IDS)},
+};
+
+static PhonemeIdMap toPhonemeIdMap(const PhonemeIdEntry *entries,
+                                   std::size_t numEntries) {
+  PhonemeIdMap phonemeIdMap;
+  for (std::size_t i = 0; i < numEntries; i++) {
+    phonemeIdMap[entries[i].phoneme].push_back(entries[i].id);
+  }
+
+  return phonemeIdMap;
+}
+
+PIPERPHONEMIZE_EXPORT const std::shared_ptr<const PhonemeIdMap> &
+get_espeak_phoneme_id_map() {
+  static const std::shared_ptr<const PhonemeIdMap> phonemeIdMap =
+      std::make_shared<const PhonemeIdMap>(toPhonemeIdMap(
+          DEFAULT_PHONEME_IDS, std::size(DEFAULT_PHONEME_IDS)));
+
+  return phonemeIdMap;
+}
+
+PIPERPHONEMIZE_EXPORT std::shared_ptr<const PhonemeIdMap>
+get_codepoints_phoneme_id_map(const std::string &language) {
+  static std::mutex registryMutex;
+  static std::map<std::string, std::shared_ptr<const PhonemeIdMap>> registry;
+
+  std::lock_guard<std::mutex> lock(registryMutex);
+  auto phonemeIdMap = registry.find(language);
+  if (phonemeIdMap != registry.end()) {
+    return phonemeIdMap->second;
+  }
+
+  for (auto &alphabet : DEFAULT_ALPHABET) {
+    if (language == alphabet.language) {
+      return registry[language] = std::make_shared<const PhonemeIdMap>(
+                 toPhonemeIdMap(alphabet.entries, alphabet.numEntries));
+    }
+  }
+
+  return nullptr;
+}
+
+PIPERPHONEMIZE_EXPORT std::vector<std::string> get_codepoints_languages() {
+  std::vector<std::string> languages;
+  for (auto &alphabet : DEFAULT_ALPHABET) {
+    languages.push_back(alphabet.language);
+  }
+
+  return languages;
+}
+
 PIPERPHONEMIZE_EXPORT void
 phonemes_to_ids(const std::vector<Phoneme> &phonemes, PhonemeIdConfig &config,
                 std::vector<PhonemeId> &phonemeIds,
                 std::map<Phoneme, std::size_t> &missingPhonemes) {
+  PIPERPHONEMIZE_STAGE_TIMER(idsTimer, STAGE_PHONEME_IDS);
+  PIPERPHONEMIZE_STAGE_ADD(idsTimer, phonemes, phonemes.size());
+  [[maybe_unused]] auto idsStart = phonemeIds.size();
 
-  auto phonemeIdMap = std::make_shared<PhonemeIdMap>(DEFAULT_PHONEME_ID_MAP);
-  if (config.phonemeIdMap) {
-    phonemeIdMap = config.phonemeIdMap;
-  }
+  const PhonemeIdMap *phonemeIdMap = config.phonemeIdMap
+                                        ? config.phonemeIdMap.get()
+                                        : get_espeak_phoneme_id_map().get();
 
   // Beginning of sentence symbol (^)
   if (config.addBos) {
@@ -63,6 +325,67 @@ phonemes_to_ids(const std::vector<Phoneme> &phonemes, PhonemeIdConfig &config,
     auto const eosIds = &(phonemeIdMap->at(config.eos));
     phonemeIds.insert(phonemeIds.end(), eosIds->begin(), eosIds->end());
   }
+
+  PIPERPHONEMIZE_STAGE_ADD(idsTimer, bytesOut,
+                           (phonemeIds.size() - idsStart) * sizeof(PhonemeId));
+}
+
+PIPERPHONEMIZE_EXPORT void
+plan_phoneme_id_batches(const std::vector<std::vector<PhonemeId>> &sentenceIds,
+                        const PhonemeIdBatchConfig &config,
+                        std::vector<PhonemeIdBatch> &batches) {
+  // Shortest first, keeping input order for equal lengths
+  std::vector<std::size_t> sentenceOrder(sentenceIds.size());
+  for (std::size_t i = 0; i < sentenceOrder.size(); i++) {
+    sentenceOrder[i] = i;
+  }
+
+  std::stable_sort(sentenceOrder.begin(), sentenceOrder.end(),
+                   [&sentenceIds](std::size_t a, std::size_t b) {
+                     return sentenceIds[a].size() < sentenceIds[b].size();
+                   });
+
+  auto maxBatchSize = std::max<std::size_t>(1, config.maxBatchSize);
+  PhonemeIdBatch *batch = nullptr;
+  std::size_t minLength = 0;
+
+  for (auto sentenceIdx : sentenceOrder) {
+    auto length = sentenceIds[sentenceIdx].size();
+
+    if (batch) {
+      // Every row is padded to this sentence's length
+      bool fits = (batch->size() < maxBatchSize) &&
+                  ((config.maxBatchIds == 0) ||
+                   (((batch->size() + 1) * length) <= config.maxBatchIds)) &&
+                  ((length - minLength) <= (config.maxPadFraction * length));
+      if (!fits) {
+        batch = nullptr;
+      }
+    }
+
+    if (!batch) {
+      batches.emplace_back();
+      batch = &batches.back();
+      minLength = length;
+    }
+
+    batch->sentenceIndexes.push_back(sentenceIdx);
+    batch->lengths.push_back((int64_t)length);
+    batch->maxLength = length;
+  }
+}
+
+PIPERPHONEMIZE_EXPORT void
+pack_phoneme_id_batch(const std::vector<std::vector<PhonemeId>> &sentenceIds,
+                      const PhonemeIdBatch &batch, PhonemeId padId,
+                      PhonemeId *output) {
+  for (auto sentenceIdx : batch.sentenceIndexes) {
+    auto &ids = sentenceIds[sentenceIdx];
+    auto rowEnd = std::copy(ids.begin(), ids.end(), output);
+
+    output += batch.maxLength;
+    std::fill(rowEnd, output, padId);
+  }
 }
 
 } // namespace piper
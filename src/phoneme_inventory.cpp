@@ -0,0 +1,198 @@
+#include <stdexcept>
+
+#include "phoneme_inventory.hpp"
+
+namespace piper {
+
+// Combining characters, length marks, and modifier letters that belong to
+// the token before them
+static bool continuesToken(Phoneme phoneme) {
+  return ((phoneme >= 0x0300) && (phoneme <= 0x036F)) || // combining marks
+         (phoneme == U'ː') || (phoneme == U'ˑ') ||      // length
+         ((phoneme >= 0x02B0) && (phoneme <= 0x02B8)) || // ʰ ʲ ʷ etc.
+         (phoneme == U'˞') ||                           // rhotic hook
+         ((phoneme >= 0x02E0) && (phoneme <= 0x02E4)) || // ˠ ˤ etc.
+         ((phoneme >= 0x1AB0) && (phoneme <= 0x1AFF)) ||
+         ((phoneme >= 0x1DC0) && (phoneme <= 0x1DFF)) ||
+         ((phoneme >= 0x20D0) && (phoneme <= 0x20FF)) ||
+         ((phoneme >= 0xFE20) && (phoneme <= 0xFE2F));
+}
+
+// Joins the codepoints before and after (e.g., "t͡ʃ")
+static bool isTieBar(Phoneme phoneme) {
+  return (phoneme == 0x0361) || (phoneme == 0x035C);
+}
+
+PIPERPHONEMIZE_EXPORT PhonemeSymbol
+PhonemeInventory::intern(const std::u32string &token) {
+  auto symbolIter = symbolsByToken.find(token);
+  if (symbolIter != symbolsByToken.end()) {
+    return symbolIter->second;
+  }
+
+  if (tokens.size() >= MAX_PHONEME_SYMBOLS) {
+    throw std::runtime_error("Phoneme inventory is full");
+  }
+
+  PhonemeSymbol symbol = (PhonemeSymbol)tokens.size();
+  tokens.push_back(token);
+  symbolsByToken[token] = symbol;
+
+  return symbol;
+}
+
+PIPERPHONEMIZE_EXPORT bool PhonemeInventory::find(const std::u32string &token,
+                                                  PhonemeSymbol &symbol) const {
+  auto symbolIter = symbolsByToken.find(token);
+  if (symbolIter == symbolsByToken.end()) {
+    return false;
+  }
+
+  symbol = symbolIter->second;
+  return true;
+}
+
+PIPERPHONEMIZE_EXPORT void
+PhonemeInventory::tokenize(const std::vector<Phoneme> &phonemes,
+                           std::vector<PhonemeSymbol> &symbols) {
+  std::u32string token;
+  std::size_t i = 0;
+
+  while (i < phonemes.size()) {
+    token.clear();
+    token += phonemes[i];
+    i++;
+
+    bool joinNext = isTieBar(token.back());
+    while ((i < phonemes.size()) &&
+           (joinNext || continuesToken(phonemes[i]))) {
+      joinNext = isTieBar(phonemes[i]);
+      token += phonemes[i];
+      i++;
+    }
+
+    symbols.push_back(intern(token));
+  }
+}
+
+PIPERPHONEMIZE_EXPORT void
+PhonemeInventory::expand(const std::vector<PhonemeSymbol> &symbols,
+                         std::vector<Phoneme> &phonemes) const {
+  for (auto symbol : symbols) {
+    auto &symbolToken = token(symbol);
+    phonemes.insert(phonemes.end(), symbolToken.begin(), symbolToken.end());
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+PIPERPHONEMIZE_EXPORT void
+PhonemeSymbolIds::update(const PhonemeInventory &inventory) {
+  const PhonemeIdMap &phonemeIdMap =
+      config.phonemeIdMap ? *config.phonemeIdMap : *get_espeak_phoneme_id_map();
+
+  std::vector<PhonemeId> padIds;
+  if (config.interspersePad) {
+    padIds = phonemeIdMap.at(config.pad);
+  }
+
+  for (std::size_t symbol = hasMissing.size(); symbol < inventory.size();
+       symbol++) {
+    bool symbolHasMissing = false;
+
+    for (auto phoneme : inventory.token((PhonemeSymbol)symbol)) {
+      auto mappedIds = phonemeIdMap.find(phoneme);
+      if (mappedIds == phonemeIdMap.end()) {
+        symbolHasMissing = true;
+        continue;
+      }
+
+      ids.insert(ids.end(), mappedIds->second.begin(), mappedIds->second.end());
+      ids.insert(ids.end(), padIds.begin(), padIds.end());
+    }
+
+    offsets.push_back(ids.size());
+    hasMissing.push_back(symbolHasMissing);
+  }
+}
+
+PIPERPHONEMIZE_EXPORT void
+symbols_to_ids(const std::vector<PhonemeSymbol> &symbols,
+               const PhonemeInventory &inventory, PhonemeSymbolIds &symbolIds,
+               std::vector<PhonemeId> &phonemeIds,
+               std::map<Phoneme, std::size_t> &missingPhonemes) {
+  auto &config = symbolIds.config;
+  const PhonemeIdMap &phonemeIdMap =
+      config.phonemeIdMap ? *config.phonemeIdMap : *get_espeak_phoneme_id_map();
+
+  if (symbolIds.hasMissing.size() < inventory.size()) {
+    symbolIds.update(inventory);
+  }
+
+  // Beginning of sentence symbol (^)
+  if (config.addBos) {
+    auto &bosIds = phonemeIdMap.at(config.bos);
+    phonemeIds.insert(phonemeIds.end(), bosIds.begin(), bosIds.end());
+
+    if (config.interspersePad) {
+      // Pad after bos (_)
+      auto &padIds = phonemeIdMap.at(config.pad);
+      phonemeIds.insert(phonemeIds.end(), padIds.begin(), padIds.end());
+    }
+  }
+
+  for (auto symbol : symbols) {
+    if (symbolIds.hasMissing[symbol]) {
+      if (!config.interspersePad) {
+        // Same as phonemes_to_ids
+        throw std::out_of_range("Phoneme is missing from id map");
+      }
+
+      for (auto phoneme : inventory.token(symbol)) {
+        if (phonemeIdMap.count(phoneme) < 1) {
+          missingPhonemes[phoneme] += 1;
+        }
+      }
+    }
+
+    phonemeIds.insert(phonemeIds.end(),
+                      symbolIds.ids.begin() + symbolIds.offsets[symbol],
+                      symbolIds.ids.begin() + symbolIds.offsets[symbol + 1]);
+  }
+
+  // End of sentence symbol ($)
+  if (config.addEos) {
+    auto &eosIds = phonemeIdMap.at(config.eos);
+    phonemeIds.insert(phonemeIds.end(), eosIds.begin(), eosIds.end());
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+PIPERPHONEMIZE_EXPORT void
+phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
+                 PhonemeInventory &inventory,
+                 std::vector<std::vector<PhonemeSymbol>> &symbols) {
+  std::vector<std::vector<Phoneme>> phonemes;
+  phonemize_eSpeak(std::move(text), config, phonemes);
+
+  for (auto &sentencePhonemes : phonemes) {
+    symbols.emplace_back();
+    inventory.tokenize(sentencePhonemes, symbols.back());
+  }
+}
+
+PIPERPHONEMIZE_EXPORT void
+phonemize_codepoints(std::string text, CodepointsPhonemeConfig &config,
+                     PhonemeInventory &inventory,
+                     std::vector<std::vector<PhonemeSymbol>> &symbols) {
+  std::vector<std::vector<Phoneme>> phonemes;
+  phonemize_codepoints(std::move(text), config, phonemes);
+
+  for (auto &sentencePhonemes : phonemes) {
+    symbols.emplace_back();
+    inventory.tokenize(sentencePhonemes, symbols.back());
+  }
+}
+
+} // namespace piper
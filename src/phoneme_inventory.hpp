@@ -0,0 +1,97 @@
+#ifndef PHONEME_INVENTORY_H_
+#define PHONEME_INVENTORY_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "phoneme_ids.hpp"
+#include "phonemize.hpp"
+#include "shared.hpp"
+
+namespace piper {
+
+// Index of an interned phoneme token in a PhonemeInventory
+typedef uint16_t PhonemeSymbol;
+
+const std::size_t MAX_PHONEME_SYMBOLS = 65536;
+
+// Dense symbols for the phoneme tokens of a voice.
+//
+// A token is a base codepoint plus any combining diacritics, length marks,
+// and modifier letters after it (e.g., "ç" after NFD, "aː", "tʲ"). A tie bar
+// also joins the next codepoint, so "t͡ʃ" is a single token.
+//
+// New tokens are added as they are seen, so an inventory must not be shared
+// between threads while it is in use.
+class PhonemeInventory {
+public:
+  // Symbol for token, adding it if necessary
+  PIPERPHONEMIZE_EXPORT PhonemeSymbol intern(const std::u32string &token);
+
+  // False if token has not been interned
+  PIPERPHONEMIZE_EXPORT bool find(const std::u32string &token,
+                                  PhonemeSymbol &symbol) const;
+
+  const std::u32string &token(PhonemeSymbol symbol) const {
+    return tokens.at(symbol);
+  }
+
+  std::size_t size() const { return tokens.size(); }
+
+  // Splits codepoints into tokens and appends their symbols
+  PIPERPHONEMIZE_EXPORT void tokenize(const std::vector<Phoneme> &phonemes,
+                                      std::vector<PhonemeSymbol> &symbols);
+
+  // Appends the codepoints of each symbol
+  PIPERPHONEMIZE_EXPORT void expand(const std::vector<PhonemeSymbol> &symbols,
+                                    std::vector<Phoneme> &phonemes) const;
+
+private:
+  std::vector<std::u32string> tokens;
+  std::unordered_map<std::u32string, PhonemeSymbol> symbolsByToken;
+};
+
+// Phoneme ids of every symbol in an inventory, so that mapping a symbol is a
+// single array index. Ids are the same as phonemes_to_ids on the symbol's
+// codepoints (including pad when interspersed).
+//
+// Symbols added to the inventory later are filled in by symbols_to_ids.
+struct PhonemeSymbolIds {
+  PhonemeIdConfig config;
+
+  // Ids of symbol s are ids[offsets[s]] to ids[offsets[s + 1]]
+  std::vector<PhonemeId> ids;
+  std::vector<std::size_t> offsets = {0};
+
+  // True if some codepoints of the symbol are not in the id map
+  std::vector<bool> hasMissing;
+
+  // Adds ids for symbols that are new in the inventory
+  PIPERPHONEMIZE_EXPORT void update(const PhonemeInventory &inventory);
+};
+
+// Like phonemize_eSpeak, but with one symbol per token
+PIPERPHONEMIZE_EXPORT void
+phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
+                 PhonemeInventory &inventory,
+                 std::vector<std::vector<PhonemeSymbol>> &symbols);
+
+// Like phonemize_codepoints, but with one symbol per token
+PIPERPHONEMIZE_EXPORT void
+phonemize_codepoints(std::string text, CodepointsPhonemeConfig &config,
+                     PhonemeInventory &inventory,
+                     std::vector<std::vector<PhonemeSymbol>> &symbols);
+
+// Like phonemes_to_ids, but for symbols of an inventory
+PIPERPHONEMIZE_EXPORT void
+symbols_to_ids(const std::vector<PhonemeSymbol> &symbols,
+               const PhonemeInventory &inventory, PhonemeSymbolIds &symbolIds,
+               std::vector<PhonemeId> &phonemeIds,
+               std::map<Phoneme, std::size_t> &missingPhonemes);
+
+} // namespace piper
+
+#endif // PHONEME_INVENTORY_H_
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+#include "phoneme_rewriter.hpp"
+
+namespace piper {
+
+PIPERPHONEMIZE_EXPORT
+PhonemeRewriter::PhonemeRewriter(const std::vector<PhonemeRewriteRule> &rules) {
+  compile(rules);
+}
+
+PIPERPHONEMIZE_EXPORT
+PhonemeRewriter::PhonemeRewriter(const PhonemeMap &phonemeMap) {
+  std::vector<PhonemeRewriteRule> rules;
+  for (auto &phonemeAndMapped : phonemeMap) {
+    rules.push_back({{phonemeAndMapped.first}, phonemeAndMapped.second});
+  }
+
+  compile(rules);
+}
+
+void PhonemeRewriter::compile(const std::vector<PhonemeRewriteRule> &rules) {
+  // Later rules replace earlier ones with the same sequence
+  std::map<std::vector<Phoneme>, const std::vector<Phoneme> *> uniqueRules;
+  for (auto &rule : rules) {
+    if (rule.from.empty()) {
+      throw std::runtime_error("Phoneme rewrite rule has nothing to replace");
+    }
+
+    uniqueRules[rule.from] = &rule.to;
+  }
+
+  bool useFlatTable = true;
+  Phoneme maxPhoneme = 0;
+  outputOffsets.push_back(0);
+
+  for (auto &fromAndTo : uniqueRules) {
+    outputs.insert(outputs.end(), fromAndTo.second->begin(),
+                   fromAndTo.second->end());
+    outputOffsets.push_back(outputs.size());
+
+    if ((fromAndTo.first.size() > 1) ||
+        (fromAndTo.first[0] >= FLAT_TABLE_LIMIT)) {
+      useFlatTable = false;
+    } else {
+      maxPhoneme = std::max(maxPhoneme, fromAndTo.first[0]);
+    }
+  }
+
+  if (uniqueRules.empty()) {
+    return;
+  }
+
+  if (useFlatTable) {
+    flatTable.resize(maxPhoneme + 1, 0);
+
+    uint32_t rule = 0;
+    for (auto &fromAndTo : uniqueRules) {
+      flatTable[fromAndTo.first[0]] = rule + 1;
+      rule++;
+    }
+
+    return;
+  }
+
+  // Build a trie, then store the edges of each state together
+  std::vector<std::map<Phoneme, uint32_t>> children(1);
+  std::vector<uint32_t> stateRules(1, 0);
+
+  uint32_t rule = 0;
+  for (auto &fromAndTo : uniqueRules) {
+    uint32_t state = 0;
+    for (auto phoneme : fromAndTo.first) {
+      auto child = children[state].find(phoneme);
+      if (child == children[state].end()) {
+        children[state][phoneme] = (uint32_t)children.size();
+        state = (uint32_t)children.size();
+        children.emplace_back();
+        stateRules.push_back(0);
+      } else {
+        state = child->second;
+      }
+    }
+
+    stateRules[state] = rule + 1;
+    rule++;
+  }
+
+  states.resize(children.size());
+  for (std::size_t state = 0; state < children.size(); state++) {
+    states[state].firstEdge = (uint32_t)edgePhonemes.size();
+    states[state].numEdges = (uint32_t)children[state].size();
+    states[state].rule = stateRules[state];
+
+    for (auto &phonemeAndChild : children[state]) {
+      edgePhonemes.push_back(phonemeAndChild.first);
+      edgeTargets.push_back(phonemeAndChild.second);
+    }
+  }
+}
+
+PIPERPHONEMIZE_EXPORT void
+PhonemeRewriter::rewrite(const std::vector<Phoneme> &phonemes,
+                         std::vector<Phoneme> &output) const {
+  auto appendRule = [this, &output](uint32_t rule) {
+    output.insert(output.end(), outputs.begin() + outputOffsets[rule],
+                  outputs.begin() + outputOffsets[rule + 1]);
+  };
+
+  if (states.empty()) {
+    // Flat table (or no rules)
+    for (auto phoneme : phonemes) {
+      if ((phoneme < flatTable.size()) && (flatTable[phoneme] > 0)) {
+        appendRule(flatTable[phoneme] - 1);
+      } else {
+        output.push_back(phoneme);
+      }
+    }
+
+    return;
+  }
+
+  std::size_t start = 0;
+  while (start < phonemes.size()) {
+    // Longest rule starting here
+    uint32_t state = 0;
+    uint32_t matchedRule = 0;
+    std::size_t matchedLength = 0;
+
+    for (std::size_t i = start; i < phonemes.size(); i++) {
+      auto edgesBegin = edgePhonemes.begin() + states[state].firstEdge;
+      auto edgesEnd = edgesBegin + states[state].numEdges;
+      auto edge = std::lower_bound(edgesBegin, edgesEnd, phonemes[i]);
+      if ((edge == edgesEnd) || (*edge != phonemes[i])) {
+        break;
+      }
+
+      state = edgeTargets[edge - edgePhonemes.begin()];
+      if (states[state].rule > 0) {
+        matchedRule = states[state].rule;
+        matchedLength = (i - start) + 1;
+      }
+    }
+
+    if (matchedRule > 0) {
+      appendRule(matchedRule - 1);
+      start += matchedLength;
+    } else {
+      output.push_back(phonemes[start]);
+      start++;
+    }
+  }
+}
+
+} // namespace piper
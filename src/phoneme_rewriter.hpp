@@ -0,0 +1,76 @@
+#ifndef PHONEME_REWRITER_H_
+#define PHONEME_REWRITER_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "phonemize.hpp"
+#include "shared.hpp"
+
+namespace piper {
+
+struct PhonemeRewriteRule {
+  // Sequence to replace (e.g., "t͡ʃ" or a vowel + "ː")
+  std::vector<Phoneme> from;
+
+  // Replacement (may be empty)
+  std::vector<Phoneme> to;
+};
+
+// Compiled phoneme map that rewrites sequences of phonemes.
+//
+// When rules overlap, the longest rule starting at the earliest position
+// wins, and matching continues after it (replacements are not rewritten
+// again). Immutable once compiled, so it can be shared between threads.
+class PhonemeRewriter {
+public:
+  PIPERPHONEMIZE_EXPORT explicit PhonemeRewriter(
+      const std::vector<PhonemeRewriteRule> &rules);
+
+  // Single phoneme rules (e.g., DEFAULT_PHONEME_MAP)
+  PIPERPHONEMIZE_EXPORT explicit PhonemeRewriter(const PhonemeMap &phonemeMap);
+
+  // Appends rewritten phonemes to output
+  PIPERPHONEMIZE_EXPORT void rewrite(const std::vector<Phoneme> &phonemes,
+                                     std::vector<Phoneme> &output) const;
+
+private:
+  // Largest flat table (one entry per phoneme below this)
+  static constexpr Phoneme FLAT_TABLE_LIMIT = 0x10000;
+
+  void compile(const std::vector<PhonemeRewriteRule> &rules);
+
+  // Replacement of rule r is outputs[outputOffsets[r]] to
+  // outputs[outputOffsets[r + 1]]
+  std::vector<Phoneme> outputs;
+  std::vector<uint32_t> outputOffsets;
+
+  // When every rule replaces a single phoneme below FLAT_TABLE_LIMIT:
+  // flatTable[phoneme] = rule + 1, or 0 if no rule
+  std::vector<uint32_t> flatTable;
+
+  // Otherwise, a trie with the edges of each state stored together (sorted
+  // by phoneme).
+  struct TrieState {
+    uint32_t firstEdge = 0;
+    uint32_t numEdges = 0;
+
+    // Rule that ends here + 1, or 0 if none
+    uint32_t rule = 0;
+  };
+
+  std::vector<TrieState> states;
+  std::vector<Phoneme> edgePhonemes;
+  std::vector<uint32_t> edgeTargets;
+};
+
+// Compiled DEFAULT_PHONEME_MAP of a voice (nullptr if it doesn't have one).
+// Compiled once per voice and shared by all callers and threads.
+PIPERPHONEMIZE_EXPORT std::shared_ptr<const PhonemeRewriter>
+get_phoneme_rewriter(const std::string &voice);
+
+} // namespace piper
+
+#endif // PHONEME_REWRITER_H_
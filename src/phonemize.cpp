@@ -1,11 +1,19 @@
+#include <algorithm>
 #include <map>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include <espeak-ng/speak_lib.h>
-#include <onnxruntime_cxx_api.h>
 
+#include "normalize.hpp"
+#include "phoneme_rewriter.hpp"
 #include "phonemize.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
 #include "uni_algo.h"
 
 namespace piper {
@@ -14,9 +22,123 @@ namespace piper {
 std::map<std::string, PhonemeMap> DEFAULT_PHONEME_MAP = {
     {"pt-br", {{U'c', {U'k'}}}}};
 
+PIPERPHONEMIZE_EXPORT std::shared_ptr<const PhonemeRewriter>
+get_phoneme_rewriter(const std::string &voice) {
+  static std::mutex registryMutex;
+  static std::map<std::string, std::shared_ptr<const PhonemeRewriter>>
+      registry;
+
+  std::lock_guard<std::mutex> lock(registryMutex);
+  auto phonemeRewriter = registry.find(voice);
+  if (phonemeRewriter != registry.end()) {
+    return phonemeRewriter->second;
+  }
+
+  // Voices without a map are also cached (as nullptr)
+  std::shared_ptr<const PhonemeRewriter> newRewriter;
+  auto phonemeMap = DEFAULT_PHONEME_MAP.find(voice);
+  if (phonemeMap != DEFAULT_PHONEME_MAP.end()) {
+    newRewriter = std::make_shared<const PhonemeRewriter>(phonemeMap->second);
+  }
+
+  registry[voice] = newRewriter;
+
+  return newRewriter;
+}
+
+// Compiled phonemeMap of a config, shared by all callers and threads.
+// Compiled again if the map has changed since it was last compiled.
+static std::shared_ptr<const PhonemeRewriter>
+getMapRewriter(const std::shared_ptr<PhonemeMap> &phonemeMap) {
+  struct CompiledMap {
+    std::weak_ptr<PhonemeMap> phonemeMap;
+
+    // Copy of the map that was compiled
+    PhonemeMap compiledMap;
+
+    std::shared_ptr<const PhonemeRewriter> rewriter;
+  };
+
+  static std::mutex compiledMutex;
+  static std::map<const PhonemeMap *, CompiledMap> compiledMaps;
+
+  std::lock_guard<std::mutex> lock(compiledMutex);
+  auto compiled = compiledMaps.find(phonemeMap.get());
+  if ((compiled != compiledMaps.end()) &&
+      (compiled->second.phonemeMap.lock() == phonemeMap) &&
+      (compiled->second.compiledMap == *phonemeMap)) {
+    return compiled->second.rewriter;
+  }
+
+  // Forget maps that were freed
+  for (auto it = compiledMaps.begin(); it != compiledMaps.end();) {
+    if (it->second.phonemeMap.expired()) {
+      it = compiledMaps.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  auto rewriter = std::make_shared<const PhonemeRewriter>(*phonemeMap);
+  compiledMaps[phonemeMap.get()] = {phonemeMap, *phonemeMap, rewriter};
+
+  return rewriter;
+}
+
+// Splits the last sentence until it has at most config.maxSentencePhonemes.
+// Splits before the clause at clauseStart if the sentence before it fits,
+// then at the last space that fits, and in the middle of a word as a last
+// resort.
+static void splitLongSentence(const eSpeakPhonemeConfig &config,
+                              std::size_t clauseStart,
+                              std::vector<std::vector<Phoneme>> &phonemes) {
+  auto maxPhonemes = config.maxSentencePhonemes;
+
+  while (phonemes.back().size() > maxPhonemes) {
+    auto &sentencePhonemes = phonemes.back();
+
+    std::size_t splitIndex = maxPhonemes;
+    if ((clauseStart > 0) && (clauseStart <= maxPhonemes)) {
+      // Previous clauses become their own sentence
+      splitIndex = clauseStart;
+    } else {
+      for (auto i = maxPhonemes; i > 0; i--) {
+        if (sentencePhonemes[i] == config.space) {
+          splitIndex = i;
+          break;
+        }
+      }
+    }
+
+    clauseStart = 0;
+
+    // Spaces around the split are dropped
+    auto nextStart = sentencePhonemes.begin() + splitIndex;
+    while ((nextStart != sentencePhonemes.end()) &&
+           (*nextStart == config.space)) {
+      nextStart++;
+    }
+
+    std::vector<Phoneme> nextPhonemes(nextStart, sentencePhonemes.end());
+    sentencePhonemes.resize(splitIndex);
+    while (!sentencePhonemes.empty() &&
+           (sentencePhonemes.back() == config.space)) {
+      sentencePhonemes.pop_back();
+    }
+
+    if (sentencePhonemes.empty()) {
+      sentencePhonemes = std::move(nextPhonemes);
+    } else if (!nextPhonemes.empty()) {
+      phonemes.push_back(std::move(nextPhonemes));
+    }
+  }
+}
+
 PIPERPHONEMIZE_EXPORT void
 phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
                  std::vector<std::vector<Phoneme>> &phonemes) {
+  PIPERPHONEMIZE_STAGE_TIMER(phonemizeTimer, STAGE_PHONEMIZE_ESPEAK);
+  PIPERPHONEMIZE_STAGE_ADD(phonemizeTimer, bytesIn, text.size());
 
   auto voice = config.voice;
   int result = espeak_SetVoiceByName(voice.c_str());
@@ -24,13 +146,20 @@ phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
     throw std::runtime_error("Failed to set eSpeak-ng voice");
   }
 
-  std::shared_ptr<PhonemeMap> phonemeMap;
-  if (config.phonemeMap) {
-    phonemeMap = config.phonemeMap;
-  } else if (DEFAULT_PHONEME_MAP.count(voice) > 0) {
-    phonemeMap = std::make_shared<PhonemeMap>(DEFAULT_PHONEME_MAP[voice]);
+  std::shared_ptr<const PhonemeRewriter> phonemeRewriter =
+      config.phonemeRewriter;
+  if (phonemeRewriter) {
+    // Already compiled
+  } else if (config.phonemeMap) {
+    phonemeRewriter = getMapRewriter(config.phonemeMap);
+  } else {
+    // Set config.phonemeRewriter to skip this lookup
+    phonemeRewriter = get_phoneme_rewriter(voice);
   }
 
+  // Reused for each clause
+  std::vector<Phoneme> clausePhonemesNorm;
+
   // Modified by eSpeak
   std::string textCopy(text);
 
@@ -39,14 +168,40 @@ phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
   int terminator = 0;
 
   while (inputTextPointer != NULL) {
-    // Modified espeak-ng API to get access to clause terminator
-    std::string clausePhonemes(espeak_TextToPhonemesWithTerminator(
-        (const void **)&inputTextPointer,
-        /*textmode*/ espeakCHARS_AUTO,
-        /*phonememode = IPA*/ 0x02, &terminator));
-
-    // Decompose, e.g. "ç" -> "c" + "̧"
-    auto phonemesNorm = una::norm::to_nfd_utf8(clausePhonemes);
+    TraceSpan clauseSpan("clause");
+
+    std::string clausePhonemes;
+    {
+      PIPERPHONEMIZE_STAGE_TIMER(eSpeakTimer, STAGE_ESPEAK);
+      TraceSpan eSpeakSpan("espeak");
+      const char *clauseText = inputTextPointer;
+
+      // Modified espeak-ng API to get access to clause terminator
+      clausePhonemes = espeak_TextToPhonemesWithTerminator(
+          (const void **)&inputTextPointer,
+          /*textmode*/ espeakCHARS_AUTO,
+          /*phonememode = IPA*/ 0x02, &terminator);
+
+      std::size_t clauseBytes =
+          (inputTextPointer ? inputTextPointer
+                            : (textCopy.c_str() + textCopy.size())) -
+          clauseText;
+      PIPERPHONEMIZE_STAGE_ADD(eSpeakTimer, bytesIn, clauseBytes);
+      clauseSpan.addArg("text_bytes", clauseBytes);
+      PIPERPHONEMIZE_STAGE_ADD(eSpeakTimer, bytesOut, clausePhonemes.size());
+    }
+
+    std::string phonemesNorm;
+    {
+      PIPERPHONEMIZE_STAGE_TIMER(normalizeTimer, STAGE_NORMALIZE);
+
+      // Decompose, e.g. "ç" -> "c" + "̧"
+      phonemesNorm = una::norm::to_nfd_utf8(clausePhonemes);
+
+      PIPERPHONEMIZE_STAGE_ADD(normalizeTimer, bytesIn, clausePhonemes.size());
+      PIPERPHONEMIZE_STAGE_ADD(normalizeTimer, bytesOut, phonemesNorm.size());
+    }
+
     auto phonemesRange = una::ranges::utf8_view{phonemesNorm};
 
     if (!sentencePhonemes) {
@@ -55,25 +210,22 @@ phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
       sentencePhonemes = &phonemes[phonemes.size() - 1];
     }
 
+    auto clauseStart = sentencePhonemes->size();
+
     // Maybe use phoneme map
     std::vector<Phoneme> mappedSentPhonemes;
-    if (phonemeMap) {
-      for (auto phoneme : phonemesRange) {
-        if (phonemeMap->count(phoneme) < 1) {
-          // No mapping for phoneme
-          mappedSentPhonemes.push_back(phoneme);
-        } else {
-          // Mapping for phoneme
-          auto mappedPhonemes = &(phonemeMap->at(phoneme));
-          mappedSentPhonemes.insert(mappedSentPhonemes.end(),
-                                    mappedPhonemes->begin(),
-                                    mappedPhonemes->end());
-        }
+    {
+      PIPERPHONEMIZE_STAGE_TIMER(mapTimer, STAGE_PHONEME_MAP);
+      if (phonemeRewriter) {
+        clausePhonemesNorm.assign(phonemesRange.begin(), phonemesRange.end());
+        phonemeRewriter->rewrite(clausePhonemesNorm, mappedSentPhonemes);
+      } else {
+        // No phoneme map
+        mappedSentPhonemes.insert(mappedSentPhonemes.end(),
+                                  phonemesRange.begin(), phonemesRange.end());
       }
-    } else {
-      // No phoneme map
-      mappedSentPhonemes.insert(mappedSentPhonemes.end(), phonemesRange.begin(),
-                                phonemesRange.end());
+
+      PIPERPHONEMIZE_STAGE_ADD(mapTimer, phonemes, mappedSentPhonemes.size());
     }
 
     auto phonemeIter = mappedSentPhonemes.begin();
@@ -84,6 +236,9 @@ phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
       sentencePhonemes->insert(sentencePhonemes->end(), phonemeIter,
                                phonemeEnd);
     } else {
+      PIPERPHONEMIZE_STAGE_TIMER(flagsTimer, STAGE_LANGUAGE_FLAGS);
+      PIPERPHONEMIZE_STAGE_ADD(flagsTimer, phonemes, mappedSentPhonemes.size());
+
       // Filter out (lang) switch (flags).
       // These surround words from languages other than the current voice.
       bool inLanguageFlag = false;
@@ -124,6 +279,17 @@ phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
       sentencePhonemes->push_back(config.space);
     }
 
+    PIPERPHONEMIZE_STAGE_ADD(phonemizeTimer, phonemes,
+                             sentencePhonemes->size() - clauseStart);
+    clauseSpan.addArg("phonemes", sentencePhonemes->size() - clauseStart);
+
+    if ((config.maxSentencePhonemes > 0) &&
+        (sentencePhonemes->size() > config.maxSentencePhonemes)) {
+      // Later clauses of the sentence go into the last part
+      splitLongSentence(config, clauseStart, phonemes);
+      sentencePhonemes = &phonemes[phonemes.size() - 1];
+    }
+
     if ((terminator & CLAUSE_TYPE_SENTENCE) == CLAUSE_TYPE_SENTENCE) {
       // End of sentence
       sentencePhonemes = nullptr;
@@ -135,43 +301,212 @@ phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
 
 // ----------------------------------------------------------------------------
 
+// Decodes the UTF-8 character at text[offset], returning its length in
+// bytes. Invalid bytes are decoded one at a time as U+FFFD.
+static std::size_t decodeUtf8(std::string_view text, std::size_t offset,
+                              char32_t &c) {
+  auto lead = (uint8_t)text[offset];
+  std::size_t length = 1;
+  if (lead < 0x80) {
+    c = lead;
+    return 1;
+  } else if ((lead & 0xE0) == 0xC0) {
+    c = lead & 0x1F;
+    length = 2;
+  } else if ((lead & 0xF0) == 0xE0) {
+    c = lead & 0x0F;
+    length = 3;
+  } else if ((lead & 0xF8) == 0xF0) {
+    c = lead & 0x07;
+    length = 4;
+  } else {
+    c = U'\uFFFD';
+    return 1;
+  }
+
+  if ((offset + length) > text.size()) {
+    c = U'\uFFFD';
+    return 1;
+  }
+
+  for (std::size_t i = 1; i < length; i++) {
+    auto next = (uint8_t)text[offset + i];
+    if ((next & 0xC0) != 0x80) {
+      c = U'\uFFFD';
+      return 1;
+    }
+
+    c = (c << 6) | (next & 0x3F);
+  }
+
+  return length;
+}
+
+// Closing quotes and brackets that stay with the sentence before them
+static bool isSentenceCloser(char32_t c) {
+  switch (c) {
+  case U'"':
+  case U'\'':
+  case U')':
+  case U']':
+  case U'}':
+  case U'’':
+  case U'”':
+  case U'»':
+  case U'›':
+  case U'」':
+  case U'』':
+  case U'）':
+    return true;
+  default:
+    return false;
+  }
+}
+
+PIPERPHONEMIZE_EXPORT void
+split_sentences(std::string_view text, const std::u32string &terminators,
+                std::vector<std::string_view> &sentences) {
+  const auto NO_POSITION = std::string_view::npos;
+
+  // First non-whitespace character of the current sentence
+  std::size_t sentenceStart = NO_POSITION;
+
+  // End of the terminators (and closers) that may end the current sentence
+  std::size_t terminatorEnd = NO_POSITION;
+  bool needsSpace = false;
+
+  // End of the last non-whitespace character
+  std::size_t contentEnd = 0;
+
+  std::size_t offset = 0;
+  while (offset < text.size()) {
+    char32_t c = 0;
+    auto nextOffset = offset + decodeUtf8(text, offset, c);
+    bool isTerminator = (terminators.find(c) != std::u32string::npos);
+    bool isSpace = una::codepoint::is_whitespace(c);
+
+    if ((terminatorEnd != NO_POSITION) && !isTerminator &&
+        !isSentenceCloser(c)) {
+      if (isSpace || !needsSpace) {
+        sentences.push_back(
+            text.substr(sentenceStart, terminatorEnd - sentenceStart));
+        sentenceStart = NO_POSITION;
+      }
+
+      terminatorEnd = NO_POSITION;
+    }
+
+    if (!isSpace) {
+      if (sentenceStart == NO_POSITION) {
+        sentenceStart = offset;
+      }
+
+      contentEnd = nextOffset;
+    }
+
+    if (isTerminator) {
+      if (terminatorEnd == NO_POSITION) {
+        needsSpace = true;
+      }
+
+      // "3.14" is one sentence, but "你好。再见" is two
+      if (c >= 0x80) {
+        needsSpace = false;
+      }
+
+      terminatorEnd = nextOffset;
+    } else if ((terminatorEnd != NO_POSITION) && isSentenceCloser(c)) {
+      terminatorEnd = nextOffset;
+    }
+
+    offset = nextOffset;
+  }
+
+  if (sentenceStart != NO_POSITION) {
+    sentences.push_back(
+        text.substr(sentenceStart, contentEnd - sentenceStart));
+  }
+}
+
+// Normalizes and maps the codepoints of one sentence
+static void phonemizeCodepointsSentence(std::string_view text,
+                                        TextCasing casing,
+                                        const PhonemeRewriter *phonemeRewriter,
+                                        std::vector<Phoneme> &sentPhonemes) {
+  // Without a phoneme map, codepoints go straight into the output
+  thread_local std::vector<Phoneme> unmappedPhonemes;
+  auto normPhonemes = phonemeRewriter ? &unmappedPhonemes : &sentPhonemes;
+  normPhonemes->clear();
+
+  {
+    PIPERPHONEMIZE_STAGE_TIMER(normalizeTimer, STAGE_NORMALIZE);
+    PIPERPHONEMIZE_STAGE_ADD(normalizeTimer, bytesIn, text.size());
+
+    // Casing and NFD decomposition, e.g. "ç" -> "c" + "̧"
+    normalize_codepoints(text, casing, *normPhonemes);
+
+    PIPERPHONEMIZE_STAGE_ADD(normalizeTimer, bytesOut,
+                             normPhonemes->size() * sizeof(Phoneme));
+  }
+
+  PIPERPHONEMIZE_STAGE_TIMER(mapTimer, STAGE_PHONEME_MAP);
+
+  if (phonemeRewriter) {
+    // Most rules replace one phoneme with one phoneme
+    sentPhonemes.reserve(sentPhonemes.size() + unmappedPhonemes.size());
+    phonemeRewriter->rewrite(unmappedPhonemes, sentPhonemes);
+  }
+
+  PIPERPHONEMIZE_STAGE_ADD(mapTimer, phonemes, sentPhonemes.size());
+}
+
 PIPERPHONEMIZE_EXPORT void
 phonemize_codepoints(std::string text, CodepointsPhonemeConfig &config,
                      std::vector<std::vector<Phoneme>> &phonemes) {
+  PIPERPHONEMIZE_STAGE_TIMER(phonemizeTimer, STAGE_PHONEMIZE_CODEPOINTS);
+  PIPERPHONEMIZE_STAGE_ADD(phonemizeTimer, bytesIn, text.size());
 
-  if (config.casing == CASING_LOWER) {
-    text = una::cases::to_lowercase_utf8(text);
-  } else if (config.casing == CASING_UPPER) {
-    text = una::cases::to_uppercase_utf8(text);
-  } else if (config.casing == CASING_FOLD) {
-    text = una::cases::to_casefold_utf8(text);
+  std::shared_ptr<const PhonemeRewriter> phonemeRewriter =
+      config.phonemeRewriter;
+  if (!phonemeRewriter && config.phonemeMap) {
+    phonemeRewriter = getMapRewriter(config.phonemeMap);
   }
 
-  // Decompose, e.g. "ç" -> "c" + "̧"
-  auto phonemesNorm = una::norm::to_nfd_utf8(text);
-  auto phonemesRange = una::ranges::utf8_view{phonemesNorm};
+  auto firstSentence = phonemes.size();
 
-  // No sentence boundary detection
-  phonemes.emplace_back();
-  auto sentPhonemes = &phonemes[phonemes.size() - 1];
+  if (!config.splitSentences) {
+    // Whole text is one sentence
+    phonemes.emplace_back();
+    phonemizeCodepointsSentence(text, config.casing, phonemeRewriter.get(),
+                                phonemes.back());
+  } else {
+    std::vector<std::string_view> sentences;
+    split_sentences(text, config.sentenceTerminators, sentences);
+    phonemes.resize(firstSentence + sentences.size());
 
-  if (config.phonemeMap) {
-    for (auto phoneme : phonemesRange) {
-      if (config.phonemeMap->count(phoneme) < 1) {
-        // No mapping for phoneme
-        sentPhonemes->push_back(phoneme);
-      } else {
-        // Mapping for phoneme
-        auto mappedPhonemes = &(config.phonemeMap->at(phoneme));
-        sentPhonemes->insert(sentPhonemes->end(), mappedPhonemes->begin(),
-                             mappedPhonemes->end());
-      }
+    std::size_t numThreads = config.numThreads;
+    if (numThreads == 0) {
+      numThreads = std::max(1u, std::thread::hardware_concurrency());
     }
-  } else {
-    // No phoneme map
-    sentPhonemes->insert(sentPhonemes->end(), phonemesRange.begin(),
-                         phonemesRange.end());
+
+    // Sentences are independent (no espeak state), so they are phonemized
+    // on the library's thread pool.
+    std::vector<std::size_t> sentenceCosts(sentences.size());
+    for (std::size_t i = 0; i < sentences.size(); i++) {
+      sentenceCosts[i] = sentences[i].size();
+    }
+
+    run_tasks(sentenceCosts, numThreads,
+              [&](std::size_t sentence, std::size_t) {
+                phonemizeCodepointsSentence(
+                    sentences[sentence], config.casing, phonemeRewriter.get(),
+                    phonemes[firstSentence + sentence]);
+              });
+  }
+
+  for (auto i = firstSentence; i < phonemes.size(); i++) {
+    PIPERPHONEMIZE_STAGE_ADD(phonemizeTimer, phonemes, phonemes[i].size());
   }
-} // phonemize_text
+} // phonemize_codepoints
 
 } // namespace piper
@@ -4,6 +4,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "shared.hpp"
@@ -29,6 +30,9 @@ namespace piper {
 typedef char32_t Phoneme;
 typedef std::map<Phoneme, std::vector<Phoneme>> PhonemeMap;
 
+// See phoneme_rewriter.hpp
+class PhonemeRewriter;
+
 struct eSpeakPhonemeConfig {
   std::string voice = "en-us";
 
@@ -43,7 +47,17 @@ struct eSpeakPhonemeConfig {
   // Remove language switch flags like "(en)"
   bool keepLanguageFlags = false;
 
+  // Split sentences longer than this many phonemes (0 = no limit).
+  // Splits at the last comma, colon, or semicolon clause that fits, then at
+  // spaces. With interspersed pad, a sentence of n phonemes has 2n + 3 ids,
+  // so (MAX_PHONEMES - 3) / 2 keeps ids within MAX_PHONEMES.
+  std::size_t maxSentencePhonemes = 0;
+
   std::shared_ptr<PhonemeMap> phonemeMap;
+
+  // Used instead of phonemeMap when set. Rewrites sequences within a clause.
+  // Otherwise, phonemeMap is compiled once and cached until it changes.
+  std::shared_ptr<const PhonemeRewriter> phonemeRewriter;
 };
 
 // Phonemizes text using espeak-ng.
@@ -65,16 +79,39 @@ enum TextCasing {
 struct CodepointsPhonemeConfig {
   TextCasing casing = CASING_FOLD;
   std::shared_ptr<PhonemeMap> phonemeMap;
+
+  // Used instead of phonemeMap when set. Otherwise, phonemeMap is compiled
+  // once and cached until it changes.
+  std::shared_ptr<const PhonemeRewriter> phonemeRewriter;
+
+  // Return a separate std::vector for each sentence
+  bool splitSentences = false;
+
+  // Characters that end a sentence when splitSentences is set.
+  // ASCII terminators must be followed by whitespace (so "3.14" is not
+  // split), others (e.g., "。") end a sentence anywhere. Closing quotes and
+  // brackets after a terminator stay with its sentence.
+  std::u32string sentenceTerminators = U".?!…。？！";
+
+  // Phonemize sentences on this many threads when splitSentences is set
+  // (0 = one per CPU).
+  std::size_t numThreads = 1;
 };
 
 // "Phonemizes" text as a series of normalized UTF-8 codepoints.
-// Returns a single std::vector of "phonemes".
-//
-// Does not detect sentence boundaries.
+// Returns a single std::vector of "phonemes", or one per sentence with
+// splitSentences. Whitespace between sentences is dropped.
 PIPERPHONEMIZE_EXPORT void
 phonemize_codepoints(std::string text, CodepointsPhonemeConfig &config,
                      std::vector<std::vector<Phoneme>> &phonemes);
 
+// Splits text after sentence terminators, as described for
+// CodepointsPhonemeConfig::sentenceTerminators. Appends views into text,
+// without the whitespace around sentences (none for whitespace-only text).
+PIPERPHONEMIZE_EXPORT void
+split_sentences(std::string_view text, const std::u32string &terminators,
+                std::vector<std::string_view> &sentences);
+
 } // namespace piper
 
 #endif // PHONEMIZE_H_
@@ -9,7 +9,9 @@
 #include <pybind11/stl.h>
 
 #include "phoneme_ids.hpp"
+#include "phoneme_rewriter.hpp"
 #include "phonemize.hpp"
+#include "stats.hpp"
 #include "tashkeel.hpp"
 
 #define STRINGIFY(x) #x
@@ -27,7 +29,8 @@ std::map<std::string, tashkeel::State> tashkeelStates;
 // ----------------------------------------------------------------------------
 
 std::vector<std::vector<piper::Phoneme>>
-phonemize_espeak(std::string text, std::string voice, std::string dataPath) {
+phonemize_espeak(std::string text, std::string voice, std::string dataPath,
+                 std::size_t maxPhonemes) {
   if (!eSpeakInitialized) {
     int result =
         espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS, 0, dataPath.c_str(), 0);
@@ -40,6 +43,8 @@ phonemize_espeak(std::string text, std::string voice, std::string dataPath) {
 
   piper::eSpeakPhonemeConfig config;
   config.voice = voice;
+  config.phonemeRewriter = piper::get_phoneme_rewriter(voice);
+  config.maxSentencePhonemes = maxPhonemes;
 
   std::vector<std::vector<piper::Phoneme>> phonemes;
   piper::phonemize_eSpeak(text, config, phonemes);
@@ -48,8 +53,11 @@ phonemize_espeak(std::string text, std::string voice, std::string dataPath) {
 }
 
 std::vector<std::vector<piper::Phoneme>>
-phonemize_codepoints(std::string text, std::string casing) {
+phonemize_codepoints(std::string text, std::string casing,
+                     bool splitSentences, std::size_t numThreads) {
   piper::CodepointsPhonemeConfig config;
+  config.splitSentences = splitSentences;
+  config.numThreads = numThreads;
 
   if (casing == "ignore") {
     config.casing = piper::CASING_IGNORE;
@@ -82,13 +90,12 @@ phoneme_ids_espeak(std::vector<piper::Phoneme> &phonemes) {
 std::pair<std::vector<piper::PhonemeId>, std::map<piper::Phoneme, std::size_t>>
 phoneme_ids_codepoints(std::string language,
                        std::vector<piper::Phoneme> &phonemes) {
-  if (piper::DEFAULT_ALPHABET.count(language) < 1) {
+  piper::PhonemeIdConfig config;
+  config.phonemeIdMap = piper::get_codepoints_phoneme_id_map(language);
+  if (!config.phonemeIdMap) {
     throw std::runtime_error("No phoneme/id map for language");
   }
 
-  piper::PhonemeIdConfig config;
-  config.phonemeIdMap =
-      std::make_shared<piper::PhonemeIdMap>(piper::DEFAULT_ALPHABET[language]);
   std::vector<piper::PhonemeId> phonemeIds;
   std::map<piper::Phoneme, std::size_t> missingPhonemes;
 
@@ -99,20 +106,90 @@ phoneme_ids_codepoints(std::string language,
 
 std::size_t get_max_phonemes() { return piper::MAX_PHONEMES; }
 
-piper::PhonemeIdMap get_espeak_map() { return piper::DEFAULT_PHONEME_ID_MAP; }
+piper::PhonemeIdMap get_espeak_map() {
+  return *piper::get_espeak_phoneme_id_map();
+}
 
 std::map<std::string, piper::PhonemeIdMap> get_codepoints_map() {
-  return piper::DEFAULT_ALPHABET;
+  std::map<std::string, piper::PhonemeIdMap> codepointsMap;
+  for (auto &language : piper::get_codepoints_languages()) {
+    codepointsMap[language] = *piper::get_codepoints_phoneme_id_map(language);
+  }
+
+  return codepointsMap;
 }
 
-std::string tashkeel_run(std::string modelPath, std::string text) {
+tashkeel::State &get_tashkeel_state(std::string modelPath) {
   if (tashkeelStates.count(modelPath) < 1) {
     tashkeel::State newState;
     tashkeel::tashkeel_load(modelPath, newState);
     tashkeelStates[modelPath] = std::move(newState);
   }
 
-  return tashkeel::tashkeel_run(text, tashkeelStates[modelPath]);
+  return tashkeelStates[modelPath];
+}
+
+std::string tashkeel_run(std::string modelPath, std::string text,
+                         bool skipDiacritized, std::size_t cacheBytes) {
+  auto &state = get_tashkeel_state(modelPath);
+  state.skipDiacritized = skipDiacritized;
+  state.cache.setMaxBytes(cacheBytes);
+
+  return tashkeel::tashkeel_run(text, state);
+}
+
+std::map<std::string, std::size_t>
+tashkeel_cache_stats(std::string modelPath) {
+  auto &cache = get_tashkeel_state(modelPath).cache;
+
+  return {{"hits", cache.hits},
+          {"misses", cache.misses},
+          {"entries", cache.size()},
+          {"bytes", cache.bytes()},
+          {"max_bytes", cache.maxBytes}};
+}
+
+py::dict get_stats() {
+  auto stats = piper::get_stats();
+
+  py::dict statsDict;
+  statsDict["enabled"] = stats.enabled;
+
+  py::dict stagesDict;
+  for (std::size_t s = 0; s < piper::NUM_STATS_STAGES; s++) {
+    auto &stage = stats.stages[s];
+
+    py::dict stageDict;
+    stageDict["calls"] = stage.calls;
+    stageDict["nanos"] = stage.nanos;
+    stageDict["bytes_in"] = stage.bytesIn;
+    stageDict["bytes_out"] = stage.bytesOut;
+    stageDict["phonemes"] = stage.phonemes;
+    stageDict["cache_hits"] = stage.cacheHits;
+    stageDict["cache_misses"] = stage.cacheMisses;
+
+    auto cacheLookups = stage.cacheHits + stage.cacheMisses;
+    stageDict["cache_hit_rate"] =
+        (cacheLookups > 0) ? ((double)stage.cacheHits / cacheLookups) : 0.0;
+
+    // (upper bound in nanoseconds or None, count)
+    py::list latencyList;
+    for (std::size_t b = 0; b < piper::NUM_LATENCY_BUCKETS; b++) {
+      py::object bound = py::none();
+      if (b < piper::LATENCY_BUCKET_BOUNDS_NANOS.size()) {
+        bound = py::int_(piper::LATENCY_BUCKET_BOUNDS_NANOS[b]);
+      }
+
+      latencyList.append(py::make_tuple(bound, stage.latencyCounts[b]));
+    }
+
+    stageDict["latency_histogram"] = latencyList;
+    stagesDict[piper::stats_stage_name((piper::StatsStage)s)] = stageDict;
+  }
+
+  statsDict["stages"] = stagesDict;
+
+  return statsDict;
 }
 
 // ----------------------------------------------------------------------------
@@ -136,6 +213,9 @@ PYBIND11_MODULE(piper_phonemize_cpp, m) {
            get_max_phonemes
            tashkeel_load
            tashkeel_run
+           tashkeel_cache_stats
+           get_stats
+           reset_stats
     )pbdoc";
 
   m.def("phonemize_espeak", &phonemize_espeak, R"pbdoc(
@@ -170,6 +250,18 @@ PYBIND11_MODULE(piper_phonemize_cpp, m) {
         Add diacritics to Arabic text (must call tashkeel_load first)
     )pbdoc");
 
+  m.def("tashkeel_cache_stats", &tashkeel_cache_stats, R"pbdoc(
+        Get hit/miss counts and memory usage of the tashkeel cache
+    )pbdoc");
+
+  m.def("get_stats", &get_stats, R"pbdoc(
+        Get per-stage latency and throughput stats (all threads)
+    )pbdoc");
+
+  m.def("reset_stats", &piper::reset_stats, R"pbdoc(
+        Reset per-stage stats to zero
+    )pbdoc");
+
 #ifdef VERSION_INFO
   m.attr("__version__") = MACRO_STRINGIFY(VERSION_INFO);
 #else
@@ -9,6 +9,9 @@ from piper_phonemize import (
     get_espeak_map,
     get_max_phonemes,
     tashkeel_run,
+    tashkeel_cache_stats,
+    get_stats,
+    reset_stats,
 )
 
 # -----------------------------------------------------------------------------
@@ -74,6 +77,12 @@ assert phonemize_codepoints("ВЕСЕ́ЛКА", casing="upper") == [
     ["В", "Е", "С", "Е", "́", "Л", "К", "А"]
 ]
 
+# One list per sentence
+assert phonemize_codepoints("Так. Ні!", split_sentences=True, num_threads=2) == [
+    ["т", "а", "к", "."],
+    ["н", "і", "!"],
+]
+
 # Verify missing phoneme counts
 missing_phonemes = Counter()
 assert phoneme_ids_codepoints(
@@ -89,6 +98,33 @@ expected_text = "مَرْحَبًا"
 actual_text = tashkeel_run("مرحبا")
 assert actual_text == expected_text, f"Expected {expected_text}, got {actual_text}"
 
+# Repeated text is served from the cache
+for _ in range(2):
+    actual_text = tashkeel_run("مرحبا", cache_bytes=1024 * 1024)
+    assert actual_text == expected_text, f"Expected {expected_text}, got {actual_text}"
+
+cache_stats = tashkeel_cache_stats()
+assert cache_stats["hits"] == 1, cache_stats
+assert cache_stats["misses"] == 1, cache_stats
+
+# Disabling the cache drops its entries
+tashkeel_run("مرحبا", cache_bytes=0)
+cache_stats = tashkeel_cache_stats()
+assert cache_stats["entries"] == 0, cache_stats
+assert cache_stats["bytes"] == 0, cache_stats
+
+# -----------------------------------------------------------------------------
+
+# Per-stage stats (only collected when built with PIPER_PHONEMIZE_STATS=1)
+stats = get_stats()
+if stats["enabled"]:
+    assert stats["stages"]["tashkeel"]["calls"] > 0, stats
+    assert stats["stages"]["tashkeel"]["cache_hits"] == 1, stats
+
+    reset_stats()
+    stats = get_stats()
+    assert stats["stages"]["tashkeel"]["calls"] == 0, stats
+
 # -----------------------------------------------------------------------------
 
 print("OK")
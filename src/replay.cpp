@@ -0,0 +1,530 @@
+// Replays a request log against libpiper_phonemize at a target rate.
+//
+// Each line of the log is a JSON object like:
+//   {"text": "...", "language": "en-us", "timestamp": 12.5}
+// where "language" defaults to --language and "timestamp" (seconds) is only
+// used without --qps. Plain text lines are also accepted.
+//
+// Requests are scheduled ahead of time (open loop), so latency includes time
+// spent waiting for a free thread when the library can't keep up. Every
+// --report_seconds, a JSON line is written with latency percentiles and
+// resident memory for that window. A summary follows at the end.
+//
+// Example:
+//   replay_piper_phonemize --espeak_data espeak-ng-data --log requests.jsonl
+//     --qps 200 --threads 8 --duration 3600
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <espeak-ng/speak_lib.h>
+
+#include "json.hpp"
+#include "phoneme_ids.hpp"
+#include "phonemize.hpp"
+#include "tashkeel.hpp"
+
+using json = nlohmann::json;
+
+enum ReplayTarget { PipelineTarget, eSpeakTarget, TashkeelTarget };
+
+struct ReplayConfig {
+  std::filesystem::path eSpeakDataPath;
+  std::optional<std::filesystem::path> tashkeelModelPath;
+  std::filesystem::path logPath;
+  std::string language = "en-us";
+  ReplayTarget target = PipelineTarget;
+
+  // 0 = use timestamps from the log
+  double qps = 0;
+
+  // Timestamps are divided by this
+  double speed = 1;
+
+  std::size_t threads = 4;
+
+  // Log is repeated until this many seconds have passed (0 = once)
+  double durationSeconds = 0;
+
+  double reportSeconds = 10;
+};
+
+struct LogRequest {
+  std::string text;
+  std::string language;
+  double timestamp = 0;
+};
+
+// Latencies of requests that finished in the current window
+struct ReplayWindow {
+  std::mutex mutex;
+  std::vector<double> latencyMillis;
+  std::size_t errors = 0;
+};
+
+std::vector<LogRequest> loadLog(ReplayConfig &replayConfig) {
+  std::ifstream logFile(replayConfig.logPath);
+  if (!logFile.good()) {
+    throw std::runtime_error("Failed to open log: " +
+                             replayConfig.logPath.string());
+  }
+
+  std::vector<LogRequest> requests;
+  std::string line;
+  while (std::getline(logFile, line)) {
+    if (line.empty()) {
+      continue;
+    }
+
+    LogRequest request;
+    request.language = replayConfig.language;
+
+    if (line[0] == '{') {
+      auto lineObj = json::parse(line);
+      request.text = lineObj["text"].get<std::string>();
+      request.language = lineObj.value("language", request.language);
+      request.timestamp = lineObj.value("timestamp", 0.0);
+    } else {
+      request.text = line;
+    }
+
+    requests.push_back(request);
+  }
+
+  if (requests.empty()) {
+    throw std::runtime_error("Log is empty");
+  }
+
+  // Timestamps are relative to the first request
+  auto firstTimestamp = requests[0].timestamp;
+  for (auto &request : requests) {
+    request.timestamp = std::max(0.0, request.timestamp - firstTimestamp);
+  }
+
+  return requests;
+}
+
+// Current resident set size
+long residentKilobytes() {
+#ifdef __linux__
+  std::ifstream statmFile("/proc/self/statm");
+  long totalPages = 0;
+  long residentPages = 0;
+  if (statmFile >> totalPages >> residentPages) {
+    return residentPages * (sysconf(_SC_PAGESIZE) / 1024);
+  }
+#endif
+
+  // Peak instead of current (kilobytes on Linux, bytes on macOS)
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+json summarize(std::vector<double> &latencyMillis) {
+  if (latencyMillis.empty()) {
+    return nullptr;
+  }
+
+  std::sort(latencyMillis.begin(), latencyMillis.end());
+
+  auto percentile = [&latencyMillis](double p) {
+    auto index = (std::size_t)(p * (latencyMillis.size() - 1) + 0.5);
+    return latencyMillis[index];
+  };
+
+  return {{"p50", percentile(0.5)},   {"p95", percentile(0.95)},
+          {"p99", percentile(0.99)},  {"p999", percentile(0.999)},
+          {"max", latencyMillis.back()}};
+}
+
+// Least squares slope of RSS over time (kilobytes per hour)
+double rssSlope(const std::vector<std::pair<double, long>> &rssSamples) {
+  if (rssSamples.size() < 2) {
+    return 0;
+  }
+
+  double meanX = 0;
+  double meanY = 0;
+  for (auto &sample : rssSamples) {
+    meanX += sample.first;
+    meanY += sample.second;
+  }
+
+  meanX /= rssSamples.size();
+  meanY /= rssSamples.size();
+
+  double covariance = 0;
+  double variance = 0;
+  for (auto &sample : rssSamples) {
+    covariance += (sample.first - meanX) * (sample.second - meanY);
+    variance += (sample.first - meanX) * (sample.first - meanX);
+  }
+
+  if (variance <= 0) {
+    return 0;
+  }
+
+  return (covariance / variance) * 3600;
+}
+
+void printUsage(char *argv[]) {
+  std::cerr << std::endl;
+  std::cerr << "usage: " << argv[0] << " [options]" << std::endl;
+  std::cerr << std::endl;
+  std::cerr << "options:" << std::endl;
+  std::cerr << "   -h        --help              show this message and exit"
+            << std::endl;
+  std::cerr << "   --log                   FILE  request log (required)"
+            << std::endl;
+  std::cerr << "   --espeak_data           DIR   path to espeak-ng data "
+               "directory (required)"
+            << std::endl;
+  std::cerr << "   --tashkeel_model        FILE  path to libtashkeel model "
+               "(for Arabic)"
+            << std::endl;
+  std::cerr << "   -l  LANG  --language     LANG  language of requests "
+               "without one (default: en-us)"
+            << std::endl;
+  std::cerr << "   --target                NAME  pipeline, espeak, or "
+               "tashkeel (default: pipeline)"
+            << std::endl;
+  std::cerr << "   --qps                   NUM   requests per second "
+               "(default: use log timestamps)"
+            << std::endl;
+  std::cerr << "   --speed                 NUM   divide log timestamps by "
+               "NUM (default: 1)"
+            << std::endl;
+  std::cerr << "   -t  NUM   --threads      NUM   number of threads "
+               "(default: 4)"
+            << std::endl;
+  std::cerr << "   --duration              SEC   repeat log for SEC "
+               "seconds (default: once)"
+            << std::endl;
+  std::cerr << "   --report_seconds        SEC   length of each report "
+               "window (default: 10)"
+            << std::endl;
+  std::cerr << std::endl;
+}
+
+void ensureArg(int argc, char *argv[], int argi) {
+  if ((argi + 1) >= argc) {
+    printUsage(argv);
+    exit(0);
+  }
+}
+
+// Parse command-line arguments
+void parseArgs(int argc, char *argv[], ReplayConfig &replayConfig) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "--log") {
+      ensureArg(argc, argv, i);
+      replayConfig.logPath = std::filesystem::path(argv[++i]);
+    } else if (arg == "--espeak_data" || arg == "--espeak-data") {
+      ensureArg(argc, argv, i);
+      replayConfig.eSpeakDataPath = std::filesystem::path(argv[++i]);
+    } else if (arg == "--tashkeel_model" || arg == "--tashkeel-model") {
+      ensureArg(argc, argv, i);
+      replayConfig.tashkeelModelPath = std::filesystem::path(argv[++i]);
+    } else if (arg == "-l" || arg == "--language") {
+      ensureArg(argc, argv, i);
+      replayConfig.language = argv[++i];
+    } else if (arg == "--target") {
+      ensureArg(argc, argv, i);
+      std::string target = argv[++i];
+      if (target == "pipeline") {
+        replayConfig.target = PipelineTarget;
+      } else if (target == "espeak") {
+        replayConfig.target = eSpeakTarget;
+      } else if (target == "tashkeel") {
+        replayConfig.target = TashkeelTarget;
+      } else {
+        throw std::runtime_error("Unknown target: " + target);
+      }
+    } else if (arg == "--qps") {
+      ensureArg(argc, argv, i);
+      replayConfig.qps = std::stod(argv[++i]);
+    } else if (arg == "--speed") {
+      ensureArg(argc, argv, i);
+      replayConfig.speed = std::stod(argv[++i]);
+    } else if (arg == "-t" || arg == "--threads") {
+      ensureArg(argc, argv, i);
+      replayConfig.threads = std::stoul(argv[++i]);
+    } else if (arg == "--duration") {
+      ensureArg(argc, argv, i);
+      replayConfig.durationSeconds = std::stod(argv[++i]);
+    } else if (arg == "--report_seconds" || arg == "--report-seconds") {
+      ensureArg(argc, argv, i);
+      replayConfig.reportSeconds = std::stod(argv[++i]);
+    } else if (arg == "-h" || arg == "--help") {
+      printUsage(argv);
+      exit(0);
+    }
+  }
+
+  if (replayConfig.logPath.empty() ||
+      (replayConfig.eSpeakDataPath.empty() &&
+       (replayConfig.target != TashkeelTarget)) ||
+      (replayConfig.threads < 1) || (replayConfig.speed <= 0) ||
+      (replayConfig.reportSeconds <= 0)) {
+    printUsage(argv);
+    exit(1);
+  }
+
+  if ((replayConfig.target == TashkeelTarget) &&
+      !replayConfig.tashkeelModelPath) {
+    throw std::runtime_error("--tashkeel_model is required for tashkeel");
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+  ReplayConfig replayConfig;
+  parseArgs(argc, argv, replayConfig);
+
+  auto requests = loadLog(replayConfig);
+  auto logSeconds = requests.back().timestamp / replayConfig.speed;
+  if (replayConfig.qps > 0) {
+    logSeconds = requests.size() / replayConfig.qps;
+  }
+
+  if (replayConfig.target != TashkeelTarget) {
+    int result =
+        espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS, 0,
+                          replayConfig.eSpeakDataPath.string().c_str(), 0);
+    if (result < 0) {
+      throw std::runtime_error("Failed to initialize eSpeak");
+    }
+  }
+
+  // Batches requests from all threads, like piper_phonemize --serve
+  tashkeel::State tashkeelState;
+  std::unique_ptr<tashkeel::Service> tashkeelService;
+  if (replayConfig.tashkeelModelPath) {
+    tashkeel::tashkeel_load(replayConfig.tashkeelModelPath->string(),
+                            tashkeelState);
+    tashkeelService = std::make_unique<tashkeel::Service>(tashkeelState);
+  }
+
+  // eSpeak is not thread safe
+  std::mutex eSpeakMutex;
+
+  auto processRequest = [&replayConfig, &tashkeelService,
+                         &eSpeakMutex](const LogRequest &request) {
+    std::string text = request.text;
+    if ((request.language == "ar") && tashkeelService &&
+        (replayConfig.target != eSpeakTarget)) {
+      text = tashkeelService->submit(text).get();
+    }
+
+    if (replayConfig.target == TashkeelTarget) {
+      return;
+    }
+
+    piper::eSpeakPhonemeConfig eSpeakConfig;
+    eSpeakConfig.voice = request.language;
+
+    std::vector<std::vector<piper::Phoneme>> phonemes;
+    {
+      std::lock_guard<std::mutex> lock(eSpeakMutex);
+      piper::phonemize_eSpeak(text, eSpeakConfig, phonemes);
+    }
+
+    if (replayConfig.target == PipelineTarget) {
+      piper::PhonemeIdConfig idConfig;
+      std::vector<piper::PhonemeId> phonemeIds;
+      std::map<piper::Phoneme, std::size_t> missingPhonemes;
+      for (auto &sentencePhonemes : phonemes) {
+        piper::phonemes_to_ids(sentencePhonemes, idConfig, phonemeIds,
+                               missingPhonemes);
+      }
+    }
+  };
+
+  ReplayWindow window;
+  std::atomic<std::size_t> nextRequest{0};
+  std::atomic<std::size_t> finishedThreads{0};
+  auto startTime = std::chrono::steady_clock::now();
+
+  // Time from start that request number n is due, or nullopt when done
+  auto scheduledSeconds =
+      [&replayConfig, &requests,
+       logSeconds](std::size_t n) -> std::optional<double> {
+    auto pass = n / requests.size();
+    auto &request = requests[n % requests.size()];
+    double seconds = request.timestamp / replayConfig.speed;
+    if (replayConfig.qps > 0) {
+      seconds = (n % requests.size()) / replayConfig.qps;
+    }
+
+    // Leave one request interval between passes
+    seconds += pass * (logSeconds + (logSeconds / requests.size()));
+
+    if ((pass > 0) && (seconds >= replayConfig.durationSeconds)) {
+      return std::nullopt;
+    }
+
+    return seconds;
+  };
+
+  std::vector<std::thread> threads;
+  for (std::size_t t = 0; t < replayConfig.threads; t++) {
+    threads.emplace_back([&]() {
+      while (true) {
+        auto n = nextRequest++;
+        auto seconds = scheduledSeconds(n);
+        if (!seconds) {
+          break;
+        }
+
+        auto dueTime =
+            startTime + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::duration<double>(*seconds));
+        std::this_thread::sleep_until(dueTime);
+
+        bool failed = false;
+        try {
+          processRequest(requests[n % requests.size()]);
+        } catch (const std::exception &) {
+          failed = true;
+        }
+
+        // Measured from when the request was due, not when it started
+        auto latencyMillis = std::chrono::duration<double, std::milli>(
+                                 std::chrono::steady_clock::now() - dueTime)
+                                 .count();
+
+        std::lock_guard<std::mutex> lock(window.mutex);
+        window.latencyMillis.push_back(latencyMillis);
+        if (failed) {
+          window.errors++;
+        }
+      }
+
+      finishedThreads++;
+    });
+  }
+
+  std::vector<double> allLatencyMillis;
+  std::vector<std::pair<double, long>> rssSamples;
+  std::size_t totalErrors = 0;
+  long startRssKilobytes = residentKilobytes();
+  auto reportInterval = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::duration<double>(replayConfig.reportSeconds));
+  auto nextReportTime = startTime + reportInterval;
+  std::size_t windowIndex = 0;
+
+  while (true) {
+    bool finished = false;
+    while (std::chrono::steady_clock::now() < nextReportTime) {
+      if (finishedThreads == replayConfig.threads) {
+        finished = true;
+        break;
+      }
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    std::vector<double> latencyMillis;
+    std::size_t errors = 0;
+    {
+      std::lock_guard<std::mutex> lock(window.mutex);
+      latencyMillis.swap(window.latencyMillis);
+      std::swap(errors, window.errors);
+    }
+
+    auto elapsedSeconds = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - startTime)
+                              .count();
+    auto rssKilobytes = residentKilobytes();
+    rssSamples.emplace_back(elapsedSeconds, rssKilobytes);
+    totalErrors += errors;
+    allLatencyMillis.insert(allLatencyMillis.end(), latencyMillis.begin(),
+                            latencyMillis.end());
+
+    if (finished && latencyMillis.empty() && (windowIndex > 0)) {
+      // Nothing finished since the last report
+      break;
+    }
+
+    json report;
+    report["window"] = windowIndex;
+    report["elapsed_seconds"] = elapsedSeconds;
+    report["requests"] = latencyMillis.size();
+    report["errors"] = errors;
+    report["latency_ms"] = summarize(latencyMillis);
+    report["rss_kb"] = rssKilobytes;
+    std::cout << report.dump() << std::endl;
+
+    windowIndex++;
+    nextReportTime += reportInterval;
+
+    if (finished) {
+      break;
+    }
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  auto elapsedSeconds = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - startTime)
+                            .count();
+
+  // First window includes eSpeak voice loading, caches filling up, etc.
+  std::vector<std::pair<double, long>> steadyRssSamples = rssSamples;
+  if (steadyRssSamples.size() > 2) {
+    steadyRssSamples.erase(steadyRssSamples.begin());
+  }
+
+  json summary;
+  summary["requests"] = allLatencyMillis.size();
+  summary["errors"] = totalErrors;
+  summary["elapsed_seconds"] = elapsedSeconds;
+  summary["qps"] = allLatencyMillis.size() / elapsedSeconds;
+  summary["threads"] = replayConfig.threads;
+  summary["latency_ms"] = summarize(allLatencyMillis);
+  summary["rss_start_kb"] = startRssKilobytes;
+  summary["rss_end_kb"] = rssSamples.back().second;
+  summary["rss_growth_kb"] = rssSamples.back().second - startRssKilobytes;
+  summary["rss_growth_kb_per_hour"] = rssSlope(steadyRssSamples);
+
+  if (tashkeelService) {
+    // Requests that went through the model (cache misses)
+    summary["tashkeel_model_requests"] = tashkeelService->getStats().requests;
+  }
+
+  json result;
+  result["summary"] = summary;
+  std::cout << result.dump() << std::endl;
+
+  tashkeelService.reset();
+
+  if (replayConfig.target != TashkeelTarget) {
+    espeak_Terminate();
+  }
+
+  return (totalErrors > 0) ? 1 : 0;
+}
@@ -0,0 +1,202 @@
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "stats.hpp"
+
+namespace piper {
+
+#ifdef PIPERPHONEMIZE_STATS
+
+// Counters of one stage for one thread.
+// Only the owning thread writes, so updates don't need atomic
+// read-modify-write operations.
+struct StageCounters {
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> nanos{0};
+  std::atomic<uint64_t> bytesIn{0};
+  std::atomic<uint64_t> bytesOut{0};
+  std::atomic<uint64_t> phonemes{0};
+  std::atomic<uint64_t> cacheHits{0};
+  std::atomic<uint64_t> cacheMisses{0};
+  std::array<std::atomic<uint64_t>, NUM_LATENCY_BUCKETS> latencyCounts{};
+};
+
+struct ThreadStats {
+  std::array<StageCounters, NUM_STATS_STAGES> stages;
+
+  ThreadStats();
+  ~ThreadStats();
+};
+
+// Counters of all live threads, plus totals from threads that have exited
+struct StatsRegistry {
+  std::mutex mutex;
+  std::vector<ThreadStats *> threads;
+  Stats exited;
+
+  // Subtracted from totals (set by reset_stats)
+  Stats baseline;
+};
+
+static StatsRegistry &statsRegistry() {
+  // Never destroyed, so threads can exit during static destruction
+  static StatsRegistry *registry = new StatsRegistry();
+  return *registry;
+}
+
+static inline void addCounter(std::atomic<uint64_t> &counter, uint64_t value) {
+  counter.store(counter.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+}
+
+// Adds a thread's counters to stats
+static void addThreadStats(const ThreadStats &threadStats, Stats &stats) {
+  for (std::size_t s = 0; s < NUM_STATS_STAGES; s++) {
+    auto &counters = threadStats.stages[s];
+    auto &stage = stats.stages[s];
+
+    stage.calls += counters.calls.load(std::memory_order_relaxed);
+    stage.nanos += counters.nanos.load(std::memory_order_relaxed);
+    stage.bytesIn += counters.bytesIn.load(std::memory_order_relaxed);
+    stage.bytesOut += counters.bytesOut.load(std::memory_order_relaxed);
+    stage.phonemes += counters.phonemes.load(std::memory_order_relaxed);
+    stage.cacheHits += counters.cacheHits.load(std::memory_order_relaxed);
+    stage.cacheMisses += counters.cacheMisses.load(std::memory_order_relaxed);
+
+    for (std::size_t b = 0; b < NUM_LATENCY_BUCKETS; b++) {
+      stage.latencyCounts[b] +=
+          counters.latencyCounts[b].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+// Live threads plus exited threads (registry mutex must be held)
+static Stats totalStats(StatsRegistry &registry) {
+  Stats stats = registry.exited;
+  for (auto *threadStats : registry.threads) {
+    addThreadStats(*threadStats, stats);
+  }
+
+  return stats;
+}
+
+ThreadStats::ThreadStats() {
+  auto &registry = statsRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.threads.push_back(this);
+}
+
+ThreadStats::~ThreadStats() {
+  auto &registry = statsRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  addThreadStats(*this, registry.exited);
+
+  for (auto it = registry.threads.begin(); it != registry.threads.end();
+       it++) {
+    if (*it == this) {
+      registry.threads.erase(it);
+      break;
+    }
+  }
+}
+
+static ThreadStats &threadStats() {
+  thread_local ThreadStats stats;
+  return stats;
+}
+
+PIPERPHONEMIZE_EXPORT void record_stage(StatsStage stage, uint64_t nanos,
+                                        uint64_t bytesIn, uint64_t bytesOut,
+                                        uint64_t phonemes) {
+  auto &counters = threadStats().stages[stage];
+  addCounter(counters.calls, 1);
+  addCounter(counters.nanos, nanos);
+  addCounter(counters.bytesIn, bytesIn);
+  addCounter(counters.bytesOut, bytesOut);
+  addCounter(counters.phonemes, phonemes);
+
+  std::size_t bucket = 0;
+  while ((bucket < LATENCY_BUCKET_BOUNDS_NANOS.size()) &&
+         (nanos > LATENCY_BUCKET_BOUNDS_NANOS[bucket])) {
+    bucket++;
+  }
+
+  addCounter(counters.latencyCounts[bucket], 1);
+}
+
+PIPERPHONEMIZE_EXPORT void record_cache(StatsStage stage, uint64_t hits,
+                                        uint64_t misses) {
+  auto &counters = threadStats().stages[stage];
+  addCounter(counters.cacheHits, hits);
+  addCounter(counters.cacheMisses, misses);
+}
+
+PIPERPHONEMIZE_EXPORT Stats get_stats() {
+  auto &registry = statsRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+
+  Stats stats = totalStats(registry);
+  stats.enabled = true;
+
+  for (std::size_t s = 0; s < NUM_STATS_STAGES; s++) {
+    auto &stage = stats.stages[s];
+    auto &baseline = registry.baseline.stages[s];
+
+    stage.calls -= baseline.calls;
+    stage.nanos -= baseline.nanos;
+    stage.bytesIn -= baseline.bytesIn;
+    stage.bytesOut -= baseline.bytesOut;
+    stage.phonemes -= baseline.phonemes;
+    stage.cacheHits -= baseline.cacheHits;
+    stage.cacheMisses -= baseline.cacheMisses;
+
+    for (std::size_t b = 0; b < NUM_LATENCY_BUCKETS; b++) {
+      stage.latencyCounts[b] -= baseline.latencyCounts[b];
+    }
+  }
+
+  return stats;
+}
+
+PIPERPHONEMIZE_EXPORT void reset_stats() {
+  // Counters are never cleared, since other threads may be writing them
+  auto &registry = statsRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.baseline = totalStats(registry);
+}
+
+#else
+
+PIPERPHONEMIZE_EXPORT Stats get_stats() { return Stats(); }
+
+PIPERPHONEMIZE_EXPORT void reset_stats() {}
+
+#endif // PIPERPHONEMIZE_STATS
+
+PIPERPHONEMIZE_EXPORT const char *stats_stage_name(StatsStage stage) {
+  switch (stage) {
+  case STAGE_PHONEMIZE_ESPEAK:
+    return "phonemize_espeak";
+  case STAGE_PHONEMIZE_CODEPOINTS:
+    return "phonemize_codepoints";
+  case STAGE_ESPEAK:
+    return "espeak";
+  case STAGE_NORMALIZE:
+    return "normalize";
+  case STAGE_PHONEME_MAP:
+    return "phoneme_map";
+  case STAGE_LANGUAGE_FLAGS:
+    return "language_flags";
+  case STAGE_PHONEME_IDS:
+    return "phoneme_ids";
+  case STAGE_TASHKEEL:
+    return "tashkeel";
+  case STAGE_TASHKEEL_MODEL:
+    return "tashkeel_model";
+  default:
+    return "unknown";
+  }
+}
+
+} // namespace piper
@@ -0,0 +1,135 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+#include "shared.hpp"
+
+// Per-stage latency and throughput counters.
+//
+// Only collected when built with PIPERPHONEMIZE_STATS (CMake option
+// PIPER_PHONEMIZE_STATS). Otherwise the PIPERPHONEMIZE_STAGE_* macros expand
+// to nothing and get_stats always returns zeros.
+namespace piper {
+
+enum StatsStage {
+  // phonemize_eSpeak (all stages below except ids)
+  STAGE_PHONEMIZE_ESPEAK = 0,
+
+  // phonemize_codepoints (all stages below except ids)
+  STAGE_PHONEMIZE_CODEPOINTS = 1,
+
+  // espeak-ng text to phonemes, one call per clause
+  STAGE_ESPEAK = 2,
+
+  // Casing and NFD normalization
+  STAGE_NORMALIZE = 3,
+
+  // Phoneme map (e.g., DEFAULT_PHONEME_MAP)
+  STAGE_PHONEME_MAP = 4,
+
+  // Removing "(lang)" switch flags
+  STAGE_LANGUAGE_FLAGS = 5,
+
+  // phonemes_to_ids
+  STAGE_PHONEME_IDS = 6,
+
+  // tashkeel_run (including inference)
+  STAGE_TASHKEEL = 7,
+
+  // Tashkeel model inference, one call per batch
+  STAGE_TASHKEEL_MODEL = 8,
+
+  NUM_STATS_STAGES = 9
+};
+
+const std::size_t NUM_LATENCY_BUCKETS = 12;
+
+// Upper bounds of latency buckets (last bucket is unbounded)
+const std::array<uint64_t, NUM_LATENCY_BUCKETS - 1>
+    LATENCY_BUCKET_BOUNDS_NANOS = {
+        1000,    4000,     16000,    64000,     256000,     1000000,
+        4000000, 16000000, 64000000, 256000000, 1000000000,
+};
+
+struct StageStats {
+  uint64_t calls = 0;
+  uint64_t nanos = 0;
+  uint64_t bytesIn = 0;
+  uint64_t bytesOut = 0;
+
+  // Phonemes produced (phonemes processed for STAGE_LANGUAGE_FLAGS and
+  // STAGE_PHONEME_IDS)
+  uint64_t phonemes = 0;
+
+  // Only for stages with a cache (STAGE_TASHKEEL)
+  uint64_t cacheHits = 0;
+  uint64_t cacheMisses = 0;
+
+  // latencyCounts[i] = calls that took at most LATENCY_BUCKET_BOUNDS_NANOS[i]
+  std::array<uint64_t, NUM_LATENCY_BUCKETS> latencyCounts = {};
+};
+
+struct Stats {
+  // False if built without PIPERPHONEMIZE_STATS
+  bool enabled = false;
+
+  std::array<StageStats, NUM_STATS_STAGES> stages;
+};
+
+// Totals from all threads since the last reset_stats
+PIPERPHONEMIZE_EXPORT Stats get_stats();
+PIPERPHONEMIZE_EXPORT void reset_stats();
+
+// Name like "espeak" or "phoneme_ids"
+PIPERPHONEMIZE_EXPORT const char *stats_stage_name(StatsStage stage);
+
+#ifdef PIPERPHONEMIZE_STATS
+
+// Adds to the calling thread's counters (no locks)
+PIPERPHONEMIZE_EXPORT void record_stage(StatsStage stage, uint64_t nanos,
+                                        uint64_t bytesIn, uint64_t bytesOut,
+                                        uint64_t phonemes);
+PIPERPHONEMIZE_EXPORT void record_cache(StatsStage stage, uint64_t hits,
+                                        uint64_t misses);
+
+// Records one call of a stage when it goes out of scope
+class StageTimer {
+public:
+  explicit StageTimer(StatsStage stage)
+      : stage(stage), startTime(std::chrono::steady_clock::now()) {}
+
+  ~StageTimer() {
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - startTime)
+                     .count();
+    record_stage(stage, nanos, bytesIn, bytesOut, phonemes);
+  }
+
+  uint64_t bytesIn = 0;
+  uint64_t bytesOut = 0;
+  uint64_t phonemes = 0;
+
+private:
+  StatsStage stage;
+  std::chrono::steady_clock::time_point startTime;
+};
+
+#define PIPERPHONEMIZE_STAGE_TIMER(timer, stage) piper::StageTimer timer(stage)
+#define PIPERPHONEMIZE_STAGE_ADD(timer, field, value) (timer).field += (value)
+#define PIPERPHONEMIZE_STAGE_CACHE(stage, hits, misses)                        \
+  piper::record_cache(stage, hits, misses)
+
+#else
+
+#define PIPERPHONEMIZE_STAGE_TIMER(timer, stage)
+#define PIPERPHONEMIZE_STAGE_ADD(timer, field, value)
+#define PIPERPHONEMIZE_STAGE_CACHE(stage, hits, misses)
+
+#endif // PIPERPHONEMIZE_STATS
+
+} // namespace piper
+
+#endif // STATS_H_
@@ -1,19 +1,59 @@
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <future>
 #include <iostream>
-#include <map>
-#include <set>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
+#if defined(__SSE__) || defined(_M_X64) ||                                     \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 1))
+#include <xmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#ifdef PIPERPHONEMIZE_LAZY_ONNXRUNTIME
+// API pointer is set by loadOnnxRuntime instead of at static initialization
+#define ORT_API_MANUAL_INIT
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+#endif
+
 #include <onnxruntime_cxx_api.h>
 
+#include "stats.hpp"
 #include "tashkeel.hpp"
+#include "trace.hpp"
 #include "uni_algo.h"
 
 namespace tashkeel {
 
-std::map<char32_t, int> inputVocab{
+// Vocabularies are constant data, compiled into the lookup tables of
+// VocabTables below.
+struct InputVocabEntry {
+  char32_t c;
+  int id;
+};
+
+struct OutputVocabEntry {
+  int id;
+
+  // Harakat to add after the character (0 = none)
+  char32_t harakat[2];
+};
+
+constexpr InputVocabEntry inputVocab[] = {
     {U'\u0009', 8},   {U'\u0020', 28},  {U'\u00a0', 84},  {U'\u00ab', 74},
     {U'\u00ad', 40},  {U'\u00b0', 5},   {U'\u00b4', 110}, {U'\u00bb', 30},
     {U'\u03ad', 69},  {U'\u03af', 112}, {U'\u03b1', 47},  {U'\u03b3', 80},
@@ -45,7 +85,7 @@ std::map<char32_t, int> inputVocab{
     {U'\ufef5', 83},  {U'\ufef7', 98},  {U'\ufef9', 21},  {U'\ufefb', 79},
 };
 
-std::map<int, std::vector<char32_t>> outputVocab{
+constexpr OutputVocabEntry outputVocab[] = {
     {4, {U'\u0640'}},
     {5, {U'\u064e'}},
     {6, {U'\u064f', U'\u0651'}},
@@ -72,17 +112,89 @@ std::map<int, std::vector<char32_t>> outputVocab{
     {27, {U'\u0651', U'\u0651'}},
 };
 
-std::set<char32_t> HARAKAT_CHARS{
+constexpr char32_t HARAKAT_CHARS[] = {
     U'\u064c', U'\u064d', U'\u064e', U'\u064f', U'\u0650', U'\u0651', U'\u0652',
 };
 
-std::set<int> INVALID_HARAKA_IDS{UNK_ID, 8};
+constexpr int INVALID_HARAKA_IDS[] = {UNK_ID, 8};
+
+// Members are destroyed in reverse order, so the session goes before the env
+struct OnnxModel {
+  Ort::Env env{nullptr};
+  Ort::SessionOptions options;
+  Ort::Session session{nullptr};
+};
+
+#ifdef PIPERPHONEMIZE_LAZY_ONNXRUNTIME
+
+#ifndef ONNXRUNTIME_LIBRARY_NAME
+#if defined(_WIN32)
+#define ONNXRUNTIME_LIBRARY_NAME "onnxruntime.dll"
+#elif defined(__APPLE__)
+#define ONNXRUNTIME_LIBRARY_NAME "libonnxruntime.dylib"
+#else
+#define ONNXRUNTIME_LIBRARY_NAME "libonnxruntime.so"
+#endif
+#endif
+
+static std::once_flag onnxRuntimeLoaded;
+
+// Opens the onnxruntime library and initializes the C++ API.
+// The library stays loaded until the process exits.
+static void loadOnnxRuntime() {
+  // Not marked as done if this throws, so a later call can try again
+  std::call_once(onnxRuntimeLoaded, []() {
+    std::string libraryPath = ONNXRUNTIME_LIBRARY_NAME;
+    const char *libraryPathEnv = std::getenv("PIPER_PHONEMIZE_ONNXRUNTIME");
+    if (libraryPathEnv && *libraryPathEnv) {
+      libraryPath = libraryPathEnv;
+    }
+
+#ifdef _WIN32
+    HMODULE library = LoadLibraryA(libraryPath.c_str());
+    auto getApiBase = library ? reinterpret_cast<decltype(&OrtGetApiBase)>(
+                                    GetProcAddress(library, "OrtGetApiBase"))
+                              : nullptr;
+#else
+    void *library = dlopen(libraryPath.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!library) {
+      const char *error = dlerror();
+      throw std::runtime_error("Failed to load " + libraryPath + ": " +
+                               (error ? error : "unknown error"));
+    }
+
+    auto getApiBase = reinterpret_cast<decltype(&OrtGetApiBase)>(
+        dlsym(library, "OrtGetApiBase"));
+#endif
+
+    if (!getApiBase) {
+      throw std::runtime_error("Failed to load onnxruntime from " +
+                               libraryPath);
+    }
+
+    const OrtApi *api = getApiBase()->GetApi(ORT_API_VERSION);
+    if (!api) {
+      throw std::runtime_error(
+          libraryPath + " is older than onnxruntime API version " +
+          std::to_string(ORT_API_VERSION));
+    }
+
+    Ort::InitApi(api);
+  });
+}
+
+#endif // PIPERPHONEMIZE_LAZY_ONNXRUNTIME
 
 PIPERPHONEMIZE_EXPORT void tashkeel_load(std::string modelPath, State &state) {
-  state.env = Ort::Env(OrtLoggingLevel::ORT_LOGGING_LEVEL_WARNING,
+#ifdef PIPERPHONEMIZE_LAZY_ONNXRUNTIME
+  loadOnnxRuntime();
+#endif
+
+  auto onnx = std::make_shared<OnnxModel>();
+  onnx->env = Ort::Env(OrtLoggingLevel::ORT_LOGGING_LEVEL_WARNING,
                        instanceName.c_str());
-  state.env.DisableTelemetryEvents();
-  state.options.SetExecutionMode(ExecutionMode::ORT_PARALLEL);
+  onnx->env.DisableTelemetryEvents();
+  onnx->options.SetExecutionMode(ExecutionMode::ORT_PARALLEL);
 
 #ifdef _WIN32
   auto modelPathW = std::wstring(modelPath.begin(), modelPath.end());
@@ -91,36 +203,551 @@ PIPERPHONEMIZE_EXPORT void tashkeel_load(std::string modelPath, State &state) {
   auto modelPathStr = modelPath.c_str();
 #endif
 
-  state.onnx = Ort::Session(state.env, modelPathStr, state.options);
+  onnx->session = Ort::Session(onnx->env, modelPathStr, onnx->options);
+
+  // Batch dimension is -1 if the model accepts any batch size
+  auto inputShape =
+      onnx->session.GetInputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape();
+  state.maxBatchSize =
+      (!inputShape.empty() && (inputShape[0] > 0)) ? inputShape[0] : 0;
+  state.onnx = onnx;
 }
 
-PIPERPHONEMIZE_EXPORT std::string tashkeel_run(std::string text, State &state) {
-  auto memoryInfo = Ort::MemoryInfo::CreateCpu(
-      OrtAllocatorType::OrtArenaAllocator, OrtMemType::OrtMemTypeDefault);
+// ----------------------------------------------------------------------------
 
-  std::vector<Ort::Value> inputTensors;
+// Direct-indexed lookup tables built from inputVocab, outputVocab and
+// HARAKAT_CHARS at compile time. Every input vocab character falls in one of
+// three ranges:
+//   U+0000 - U+06FF: whitespace, Latin-1, Greek, Hebrew, Arabic
+//   U+2000 - U+203F: general punctuation
+//   U+FB50 - U+FEFF: Arabic presentation forms
+const char32_t VOCAB_LOW_END = 0x0700;
+const char32_t VOCAB_PUNCT_START = 0x2000;
+const char32_t VOCAB_PUNCT_END = 0x2040;
+const char32_t VOCAB_FORMS_START = 0xFB50;
+const char32_t VOCAB_FORMS_END = 0xFF00;
 
-  // Strip haraka and convert to vocab ints
-  std::string strippedText = std::string_view(text) | una::views::utf8 |
-                             una::views::filter([](char32_t c) {
-                               return HARAKAT_CHARS.count(c) < 1;
-                             }) |
-                             una::ranges::to_utf8<std::string>();
+// Marks a haraka in the input tables (stripped before inference)
+const uint8_t HARAKA_INPUT = 0xFF;
 
-  auto inputIdRange = std::string_view(strippedText) | una::views::utf8 |
-                      una::views::transform([](char32_t c) {
-                        return inputVocab.count(c) > 0 ? inputVocab[c] : UNK_ID;
-                      });
+// Largest output id that can be looked up
+const std::size_t MAX_OUTPUT_ID = 32;
 
+// Output ids are stored as single bytes in the prediction cache
+const std::size_t MAX_CACHED_OUTPUT_ID = 0xFF;
+
+// Approximate per-entry bookkeeping cost (list and hash nodes)
+const std::size_t CACHE_ENTRY_OVERHEAD = 128;
+
+struct HarakaBytes {
+  char bytes[8] = {};
+  std::size_t length = 0;
+};
+
+struct VocabTables {
+  std::array<uint8_t, VOCAB_LOW_END> low{};
+  std::array<uint8_t, VOCAB_PUNCT_END - VOCAB_PUNCT_START> punct{};
+  std::array<uint8_t, VOCAB_FORMS_END - VOCAB_FORMS_START> forms{};
+
+  // Predicted id -> UTF-8 haraka (empty if none should be added)
+  std::array<HarakaBytes, MAX_OUTPUT_ID> haraka{};
+
+  // Errors here fail the build, since the tables are constexpr
+  constexpr VocabTables() {
+    for (auto &id : low) {
+      id = UNK_ID;
+    }
+
+    for (auto &id : punct) {
+      id = UNK_ID;
+    }
+
+    for (auto &id : forms) {
+      id = UNK_ID;
+    }
+
+    for (auto &charAndId : inputVocab) {
+      if (uint8_t *slot = find(charAndId.c)) {
+        *slot = (uint8_t)charAndId.id;
+      } else {
+        throw std::logic_error("Tashkeel input vocab is out of table range");
+      }
+    }
+
+    for (auto c : HARAKAT_CHARS) {
+      *find(c) = HARAKA_INPUT;
+    }
+
+    for (auto &idAndHaraka : outputVocab) {
+      auto id = (std::size_t)idAndHaraka.id;
+      if ((id >= MAX_OUTPUT_ID) || isInvalidHarakaId(idAndHaraka.id)) {
+        continue;
+      }
+
+      // UTF-8 (harakat are all below U+0800)
+      auto &harakaBytes = haraka[id];
+      for (auto c : idAndHaraka.harakat) {
+        if (c == 0) {
+          continue;
+        }
+
+        if ((c < 0x80) || (c >= 0x800) ||
+            ((harakaBytes.length + 2) > sizeof(harakaBytes.bytes))) {
+          throw std::logic_error(
+              "Tashkeel output vocab entry is too long or out of range");
+        }
+
+        harakaBytes.bytes[harakaBytes.length++] = (char)(0xC0 | (c >> 6));
+        harakaBytes.bytes[harakaBytes.length++] = (char)(0x80 | (c & 0x3F));
+      }
+    }
+  }
+
+  static constexpr bool isInvalidHarakaId(int id) {
+    for (auto invalidId : INVALID_HARAKA_IDS) {
+      if (id == invalidId) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  constexpr uint8_t *find(char32_t c) {
+    if (c < VOCAB_LOW_END) {
+      return &low[c];
+    } else if ((c >= VOCAB_PUNCT_START) && (c < VOCAB_PUNCT_END)) {
+      return &punct[c - VOCAB_PUNCT_START];
+    } else if ((c >= VOCAB_FORMS_START) && (c < VOCAB_FORMS_END)) {
+      return &forms[c - VOCAB_FORMS_START];
+    }
+
+    return nullptr;
+  }
+
+  constexpr uint8_t inputId(char32_t c) const {
+    if (c < VOCAB_LOW_END) {
+      return low[c];
+    } else if ((c >= VOCAB_PUNCT_START) && (c < VOCAB_PUNCT_END)) {
+      return punct[c - VOCAB_PUNCT_START];
+    } else if ((c >= VOCAB_FORMS_START) && (c < VOCAB_FORMS_END)) {
+      return forms[c - VOCAB_FORMS_START];
+    }
+
+    return UNK_ID;
+  }
+};
+
+static const VocabTables &vocabTables() {
+  static constexpr VocabTables tables{};
+  return tables;
+}
+
+// Decodes one UTF-8 character starting at text[offset].
+// Returns its length in bytes, or 0 if the sequence is malformed.
+static std::size_t decodeUtf8(const std::string &text, std::size_t offset,
+                              char32_t &c) {
+  auto byteAt = [&text](std::size_t i) { return (unsigned char)text[i]; };
+  unsigned char lead = byteAt(offset);
+  std::size_t length = 0;
+
+  if (lead < 0x80) {
+    c = lead;
+    return 1;
+  } else if ((lead >= 0xC2) && (lead <= 0xDF)) {
+    c = lead & 0x1F;
+    length = 2;
+  } else if ((lead >= 0xE0) && (lead <= 0xEF)) {
+    c = lead & 0x0F;
+    length = 3;
+  } else if ((lead >= 0xF0) && (lead <= 0xF4)) {
+    c = lead & 0x07;
+    length = 4;
+  } else {
+    return 0;
+  }
+
+  if ((offset + length) > text.size()) {
+    return 0;
+  }
+
+  for (std::size_t i = 1; i < length; i++) {
+    unsigned char next = byteAt(offset + i);
+    if ((next & 0xC0) != 0x80) {
+      return 0;
+    }
+
+    c = (c << 6) | (next & 0x3F);
+  }
+
+  // Reject overlong encodings, surrogates, and out of range values
+  if (((length == 3) && (c < 0x800)) || ((length == 4) && (c < 0x10000)) ||
+      ((c >= 0xD800) && (c <= 0xDFFF)) || (c > 0x10FFFF)) {
+    return 0;
+  }
+
+  return length;
+}
+
+// Index of the highest probability (first one wins ties).
+// Returns 0 if no probability is positive.
+static std::size_t argmaxProb(const float *probs, std::size_t numProbs) {
+  std::size_t j = 0;
+  float maxProb = 0.0f;
+
+#if defined(__SSE__) || defined(_M_X64) ||                                     \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 1))
+  __m128 maxProbs = _mm_setzero_ps();
+  for (; (j + 4) <= numProbs; j += 4) {
+    // NaN in the first operand yields the second (running max)
+    maxProbs = _mm_max_ps(_mm_loadu_ps(probs + j), maxProbs);
+  }
+
+  maxProbs = _mm_max_ps(maxProbs, _mm_movehl_ps(maxProbs, maxProbs));
+  maxProbs = _mm_max_ss(maxProbs, _mm_shuffle_ps(maxProbs, maxProbs, 1));
+  maxProb = _mm_cvtss_f32(maxProbs);
+#elif defined(__aarch64__)
+  float32x4_t maxProbs = vdupq_n_f32(0.0f);
+  for (; (j + 4) <= numProbs; j += 4) {
+    // Ignores NaN like the scalar comparison below
+    maxProbs = vmaxnmq_f32(maxProbs, vld1q_f32(probs + j));
+  }
+
+  maxProb = vmaxnmvq_f32(maxProbs);
+#endif
+
+  for (; j < numProbs; j++) {
+    if (probs[j] > maxProb) {
+      maxProb = probs[j];
+    }
+  }
+
+  if (!(maxProb > 0.0f)) {
+    return 0;
+  }
+
+  for (j = 0; j < numProbs; j++) {
+    if (probs[j] == maxProb) {
+      break;
+    }
+  }
+
+  return j;
+}
+
+// ----------------------------------------------------------------------------
+
+PIPERPHONEMIZE_EXPORT bool PredictionCache::get(const std::string &key,
+                                                std::string &outputIds) {
+  auto found = index.find(key);
+  if (found == index.end()) {
+    misses++;
+    return false;
+  }
+
+  // Move to front (most recently used)
+  entries.splice(entries.begin(), entries, found->second);
+  outputIds = found->second->second;
+  hits++;
+
+  return true;
+}
+
+PIPERPHONEMIZE_EXPORT void PredictionCache::put(const std::string &key,
+                                                const std::string &outputIds) {
+  std::size_t entryBytes =
+      (2 * key.size()) + outputIds.size() + CACHE_ENTRY_OVERHEAD;
+  if ((maxBytes == 0) || (entryBytes > maxBytes) || (index.count(key) > 0)) {
+    return;
+  }
+
+  evict(maxBytes - entryBytes);
+
+  entries.emplace_front(key, outputIds);
+  index[entries.front().first] = entries.begin();
+  usedBytes += entryBytes;
+}
+
+PIPERPHONEMIZE_EXPORT void PredictionCache::clear() {
+  index.clear();
+  entries.clear();
+  usedBytes = 0;
+}
+
+PIPERPHONEMIZE_EXPORT void
+PredictionCache::setMaxBytes(std::size_t newMaxBytes) {
+  maxBytes = newMaxBytes;
+  if (maxBytes == 0) {
+    // Disabled
+    clear();
+  } else {
+    evict(maxBytes);
+  }
+}
+
+void PredictionCache::evict(std::size_t targetBytes) {
+  while (!entries.empty() && (usedBytes > targetBytes)) {
+    auto &oldest = entries.back();
+    usedBytes -=
+        (2 * oldest.first.size()) + oldest.second.size() + CACHE_ENTRY_OVERHEAD;
+    index.erase(oldest.first);
+    entries.pop_back();
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+// True for letters of the Arabic script (including presentation forms)
+static bool isArabicLetter(char32_t c) {
+  return ((c >= 0x0620) && (c <= 0x064A)) || ((c >= 0x066E) && (c <= 0x06D3)) ||
+         (c == 0x06D5) || ((c >= 0xFB50) && (c <= 0xFD3D)) ||
+         ((c >= 0xFD50) && (c <= 0xFDFB)) || ((c >= 0xFE70) && (c <= 0xFEFC));
+}
+
+// True for letters that end a run of Arabic text (Latin, Cyrillic, etc.)
+static bool isForeignLetter(char32_t c) {
+  if (c < 0x80) {
+    return ((c >= U'a') && (c <= U'z')) || ((c >= U'A') && (c <= U'Z'));
+  }
+
+  if (((c >= 0x0600) && (c <= 0x06FF)) || ((c >= 0xFB50) && (c <= 0xFDFF)) ||
+      ((c >= 0xFE70) && (c <= 0xFEFF))) {
+    // Arabic blocks
+    return false;
+  }
+
+  return una::codepoint::is_alphabetic(c);
+}
+
+// True for Arabic letters that are usually written without haraka even in
+// fully diacritized text (long vowels, tatweel).
+static bool isUndiacritizedLetter(char32_t c) {
+  return (c == 0x0622) || (c == 0x0627) || (c == 0x0640) || (c == 0x0648) ||
+         (c == 0x0649) || (c == 0x064A) || (c == 0x0671);
+}
+
+// True for any Arabic diacritic that the model can predict
+static bool isDiacritic(char32_t c) { return (c >= 0x064B) && (c <= 0x0652); }
+
+// One decoded character of the input text
+struct TextChar {
+  char32_t codepoint;
+  std::size_t offset;
+  uint8_t length;
+  uint8_t inputId;
+  bool isArabicLetter;
+  bool isForeignLetter;
+};
+
+// Span of characters [start, end) that is sent to the model
+struct TextRun {
+  std::size_t start;
+  std::size_t end;
+};
+
+// Marks the separator between runs in a model window
+const std::size_t NO_CHAR = (std::size_t)-1;
+
+// Characters packed into one model input
+struct ModelWindow {
   std::vector<float> inputIds;
-  for (auto id : inputIdRange) {
-    inputIds.push_back(id);
+
+  // Index into PreparedText::chars or NO_CHAR for each input id
+  std::vector<std::size_t> chars;
+};
+
+// Text that has been decoded, split into runs, and packed into model windows
+struct PreparedText {
+  std::string text;
+  std::vector<TextChar> chars;
+  std::vector<TextRun> runs;
+  std::vector<ModelWindow> windows;
+
+  // Predicted output id for each character (filled in by predictWindows)
+  std::vector<std::size_t> predictedIds;
+};
+
+// Window of a prepared text that needs a prediction
+struct WindowRef {
+  PreparedText *prepared;
+  std::size_t window;
+};
+
+// Decodes text, finds the runs of Arabic text that need diacritics, and packs
+// them into model windows.
+static void prepareText(std::string text, bool skipDiacritized,
+                        PreparedText &prepared) {
+  const auto &tables = vocabTables();
+  auto &chars = prepared.chars;
+  auto &runs = prepared.runs;
+
+  // Decode text once, looking up vocab ids and character classes
+  chars.reserve(text.size());
+
+  bool hasArabicLetters = false;
+  std::size_t offset = 0;
+  while (offset < text.size()) {
+    char32_t c = 0;
+    std::size_t length = decodeUtf8(text, offset, c);
+    if (length == 0) {
+      // Malformed UTF-8: replace invalid sequences and start over
+      text = una::utf32to8(una::utf8to32u(text));
+      chars.clear();
+      hasArabicLetters = false;
+      offset = 0;
+      continue;
+    }
+
+    TextChar textChar;
+    textChar.codepoint = c;
+    textChar.offset = offset;
+    textChar.length = (uint8_t)length;
+    textChar.inputId = tables.inputId(c);
+    textChar.isArabicLetter = isArabicLetter(c);
+    textChar.isForeignLetter =
+        !textChar.isArabicLetter && (c > U' ') && isForeignLetter(c);
+    chars.push_back(textChar);
+
+    hasArabicLetters = hasArabicLetters || textChar.isArabicLetter;
+    offset += length;
   }
 
-  // Model has a fixed input size
-  inputIds.resize(MAX_INPUT_CHARS, PAD_ID);
+  prepared.text = std::move(text);
+
+  if (!hasArabicLetters) {
+    // Nothing to diacritize
+    return;
+  }
 
-  std::vector<int64_t> inputIdsShape{1, (int64_t)inputIds.size()};
+  // Split text at foreign letters. Spans with Arabic letters are sent to the
+  // model, everything else is copied as-is.
+  std::size_t runStart = 0;
+  bool runHasArabic = false;
+  bool runIsDiacritized = true;
+
+  for (std::size_t i = 0; i <= chars.size(); i++) {
+    if ((i == chars.size()) || chars[i].isForeignLetter) {
+      if (runHasArabic && !(skipDiacritized && runIsDiacritized)) {
+        runs.push_back({runStart, i});
+      }
+
+      runStart = i + 1;
+      runHasArabic = false;
+      runIsDiacritized = true;
+      continue;
+    }
+
+    if (chars[i].isArabicLetter) {
+      runHasArabic = true;
+
+      if (runIsDiacritized) {
+        // Letter must be followed by haraka unless it doesn't normally take one
+        bool hasHaraka = ((i + 1) < chars.size()) &&
+                         isDiacritic(chars[i + 1].codepoint);
+        if (!hasHaraka) {
+          runIsDiacritized = isUndiacritizedLetter(chars[i].codepoint);
+        }
+      }
+    }
+  }
+
+  // Pack runs into fixed-size model windows without harakat. Runs that are
+  // too long are split at whitespace.
+  const float SEPARATOR_ID = (float)tables.inputId(U' ');
+
+  prepared.predictedIds.assign(chars.size(), 0);
+
+  std::vector<std::size_t> pieceChars;
+  for (auto &run : runs) {
+    std::size_t pieceStart = 0;
+    pieceChars.clear();
+
+    for (std::size_t i = run.start; i < run.end; i++) {
+      if (chars[i].inputId != HARAKA_INPUT) {
+        pieceChars.push_back(i);
+      }
+    }
+
+    while (pieceStart < pieceChars.size()) {
+      // Take as many characters as fit in a window, preferring to break
+      // after whitespace.
+      std::size_t pieceEnd = pieceChars.size();
+      if ((pieceEnd - pieceStart) > MAX_INPUT_CHARS) {
+        pieceEnd = pieceStart + MAX_INPUT_CHARS;
+        for (std::size_t j = pieceEnd; j > (pieceStart + 1); j--) {
+          if (chars[pieceChars[j - 1]].codepoint == U' ') {
+            pieceEnd = j;
+            break;
+          }
+        }
+      }
+
+      std::size_t pieceLength = pieceEnd - pieceStart;
+      std::size_t separatorLength = 0;
+
+      if (!prepared.windows.empty() &&
+          !prepared.windows.back().chars.empty()) {
+        separatorLength = 1;
+      }
+
+      if (prepared.windows.empty() ||
+          ((prepared.windows.back().chars.size() + separatorLength +
+            pieceLength) > MAX_INPUT_CHARS)) {
+        prepared.windows.emplace_back();
+        prepared.windows.back().inputIds.reserve(MAX_INPUT_CHARS);
+        separatorLength = 0;
+      }
+
+      auto &window = prepared.windows.back();
+      if (separatorLength > 0) {
+        window.inputIds.push_back(SEPARATOR_ID);
+        window.chars.push_back(NO_CHAR);
+      }
+
+      for (std::size_t j = pieceStart; j < pieceEnd; j++) {
+        window.inputIds.push_back(chars[pieceChars[j]].inputId);
+        window.chars.push_back(pieceChars[j]);
+      }
+
+      pieceStart = pieceEnd;
+    }
+  }
+}
+
+// Copies predicted output ids for a window into its prepared text
+static void applyWindowOutput(const WindowRef &ref, const uint8_t *outputIds,
+                              std::size_t numOutputIds) {
+  auto &window = ref.prepared->windows[ref.window];
+  for (std::size_t i = 0; (i < window.chars.size()) && (i < numOutputIds);
+       i++) {
+    if (window.chars[i] != NO_CHAR) {
+      ref.prepared->predictedIds[window.chars[i]] = outputIds[i];
+    }
+  }
+}
+
+// Runs the model on [numWindows x MAX_INPUT_CHARS] input ids.
+// Writes [numWindows x numOutputChars x numOutputProbs] probabilities.
+static void runModel(std::vector<float> &inputIds, std::size_t numWindows,
+                     State &state, std::vector<float> &outputProbs,
+                     std::size_t &numOutputChars,
+                     std::size_t &numOutputProbs) {
+  PIPERPHONEMIZE_STAGE_TIMER(modelTimer, piper::STAGE_TASHKEEL_MODEL);
+  piper::TraceSpan modelSpan("tashkeel_model");
+  modelSpan.addArg("windows", numWindows);
+  PIPERPHONEMIZE_STAGE_ADD(modelTimer, bytesIn,
+                           inputIds.size() * sizeof(float));
+
+  if (!state.onnx) {
+    throw std::runtime_error("Tashkeel model is not loaded");
+  }
+
+  auto memoryInfo = Ort::MemoryInfo::CreateCpu(
+      OrtAllocatorType::OrtArenaAllocator, OrtMemType::OrtMemTypeDefault);
+
+  std::vector<Ort::Value> inputTensors;
+  std::vector<int64_t> inputIdsShape{(int64_t)numWindows,
+                                     (int64_t)MAX_INPUT_CHARS};
   inputTensors.push_back(Ort::Value::CreateTensor<float>(
       memoryInfo, inputIds.data(), inputIds.size(), inputIdsShape.data(),
       inputIdsShape.size()));
@@ -130,7 +757,7 @@ PIPERPHONEMIZE_EXPORT std::string tashkeel_run(std::string text, State &state) {
   std::array<const char *, 1> inputNames = {"embedding_7_input"};
   std::array<const char *, 1> outputNames = {"dense_7"};
 
-  auto outputTensors = state.onnx.Run(
+  auto outputTensors = state.onnx->session.Run(
       Ort::RunOptions{nullptr}, inputNames.data(), inputTensors.data(),
       inputTensors.size(), outputNames.data(), outputNames.size());
 
@@ -143,53 +770,369 @@ PIPERPHONEMIZE_EXPORT std::string tashkeel_run(std::string text, State &state) {
       outputTensors.front().GetTensorTypeAndShapeInfo().GetShape();
 
   // batch x chars x probabilities
-  std::size_t numOutputChars = outputIdsShape[1];
-  std::size_t numOutputProbs = outputIdsShape[2];
-
-  // Add predicted haraka to stripped string
-  auto strippedView = std::string_view(strippedText) | una::views::utf8;
-  std::u32string processedText;
-  std::size_t i = 0;
-  for (auto c : strippedView) {
-    processedText += c;
-
-    if (i < numOutputChars) {
-      int maxId = 0;
-      float maxIdProb = 0.0f;
-
-      // Get the id with the maximum probability
-      for (std::size_t j = 0; j < numOutputProbs; j++) {
-        float currentProb = outputIdProbs[(i * numOutputProbs) + j];
-        if (currentProb > maxIdProb) {
-          maxIdProb = currentProb;
-          maxId = j;
-        }
+  numOutputChars = outputIdsShape[1];
+  numOutputProbs = outputIdsShape[2];
+  outputProbs.assign(outputIdProbs,
+                     outputIdProbs +
+                         (numWindows * numOutputChars * numOutputProbs));
+  PIPERPHONEMIZE_STAGE_ADD(modelTimer, bytesOut,
+                           outputProbs.size() * sizeof(float));
+
+  // Clean up
+  for (std::size_t i = 0; i < outputTensors.size(); i++) {
+    Ort::detail::OrtRelease(outputTensors[i].release());
+  }
+
+  for (std::size_t i = 0; i < inputTensors.size(); i++) {
+    Ort::detail::OrtRelease(inputTensors[i].release());
+  }
+}
+
+// Runs the model on a batch of windows (each padded to MAX_INPUT_CHARS).
+// The predicted output ids are stored in each window's prepared text and in
+// the prediction cache (while holding cacheMutex, if set).
+static void predictBatch(const WindowRef *refs, std::size_t numRefs,
+                         State &state, std::mutex *cacheMutex) {
+  // Model has a fixed input size
+  std::vector<float> inputIds(numRefs * MAX_INPUT_CHARS, PAD_ID);
+  for (std::size_t b = 0; b < numRefs; b++) {
+    auto &windowIds = refs[b].prepared->windows[refs[b].window].inputIds;
+    std::copy(windowIds.begin(), windowIds.end(),
+              inputIds.begin() + (b * MAX_INPUT_CHARS));
+  }
+
+  std::vector<float> outputIdProbs;
+  std::size_t numOutputChars = 0;
+  std::size_t numOutputProbs = 0;
+  runModel(inputIds, numRefs, state, outputIdProbs, numOutputChars,
+           numOutputProbs);
+
+  std::string outputIds;
+  for (std::size_t b = 0; b < numRefs; b++) {
+    auto &window = refs[b].prepared->windows[refs[b].window];
+    const float *windowProbs =
+        outputIdProbs.data() + (b * numOutputChars * numOutputProbs);
+
+    outputIds.clear();
+    for (std::size_t i = 0; (i < numOutputChars) && (i < window.chars.size());
+         i++) {
+      std::size_t maxId =
+          argmaxProb(windowProbs + (i * numOutputProbs), numOutputProbs);
+      outputIds.push_back(
+          (char)std::min<std::size_t>(maxId, MAX_CACHED_OUTPUT_ID));
+    }
+
+    applyWindowOutput(refs[b], (const uint8_t *)outputIds.data(),
+                      outputIds.size());
+
+    if (state.cache.maxBytes > 0) {
+      // Model output only depends on the input ids
+      std::string cacheKey(window.inputIds.begin(), window.inputIds.end());
+      std::unique_lock<std::mutex> cacheLock;
+      if (cacheMutex) {
+        cacheLock = std::unique_lock<std::mutex>(*cacheMutex);
       }
 
-      if ((INVALID_HARAKA_IDS.count(maxId) < 1) &&
-          (outputVocab.count(maxId) > 0)) {
-        // Add predicted haraka
-        for (auto haraka : outputVocab[maxId]) {
-          processedText += haraka;
-        }
+      state.cache.put(cacheKey, outputIds);
+    }
+  }
+}
+
+// Applies cached output ids to windows. Windows that are not in the cache
+// are added to uncachedRefs.
+static void applyCached(const std::vector<WindowRef> &refs, State &state,
+                        std::vector<WindowRef> &uncachedRefs) {
+  std::string cacheKey;
+  std::string cacheValue;
+
+  for (auto &ref : refs) {
+    if (state.cache.maxBytes > 0) {
+      auto &window = ref.prepared->windows[ref.window];
+      cacheKey.assign(window.inputIds.begin(), window.inputIds.end());
+
+      if (state.cache.get(cacheKey, cacheValue)) {
+        applyWindowOutput(ref, (const uint8_t *)cacheValue.data(),
+                          cacheValue.size());
+        continue;
       }
     }
 
-    // Next output char
-    i++;
+    uncachedRefs.push_back(ref);
   }
 
-  // Clean up
-  for (std::size_t i = 0; i < outputTensors.size(); i++) {
-    Ort::detail::OrtRelease(outputTensors[i].release());
+  if (state.cache.maxBytes > 0) {
+    PIPERPHONEMIZE_STAGE_CACHE(piper::STAGE_TASHKEEL,
+                               refs.size() - uncachedRefs.size(),
+                               uncachedRefs.size());
   }
+}
 
-  for (std::size_t i = 0; i < inputTensors.size(); i++) {
-    Ort::detail::OrtRelease(inputTensors[i].release());
+// Runs the model on windows in batches of at most maxBatchSize windows
+static void predictUncached(const std::vector<WindowRef> &uncachedRefs,
+                            State &state, std::size_t maxBatchSize,
+                            std::mutex *cacheMutex) {
+  if ((state.maxBatchSize > 0) &&
+      ((maxBatchSize == 0) || (state.maxBatchSize < maxBatchSize))) {
+    // Model has a fixed batch size
+    maxBatchSize = state.maxBatchSize;
+  }
+
+  if (maxBatchSize == 0) {
+    maxBatchSize = uncachedRefs.size();
+  }
+
+  for (std::size_t b = 0; b < uncachedRefs.size(); b += maxBatchSize) {
+    predictBatch(uncachedRefs.data() + b,
+                 std::min(maxBatchSize, uncachedRefs.size() - b), state,
+                 cacheMutex);
+  }
+}
+
+// Predicts output ids for windows, using the cache when possible and running
+// the model in batches of at most maxBatchSize windows.
+static void predictWindows(const std::vector<WindowRef> &refs, State &state,
+                           std::size_t maxBatchSize) {
+  std::vector<WindowRef> uncachedRefs;
+  applyCached(refs, state, uncachedRefs);
+  predictUncached(uncachedRefs, state, maxBatchSize, nullptr);
+}
+
+// Splices diacritized runs back into the original text
+static std::string finishText(const PreparedText &prepared) {
+  const auto &tables = vocabTables();
+  auto &text = prepared.text;
+  auto &chars = prepared.chars;
+
+  if (prepared.runs.empty()) {
+    return text;
   }
 
+  std::string processedText;
+  processedText.reserve(text.size() + (2 * chars.size()));
+
+  std::size_t textOffset = 0;
+  for (auto &run : prepared.runs) {
+    std::size_t runOffset = chars[run.start].offset;
+    processedText.append(text, textOffset, runOffset - textOffset);
+
+    for (std::size_t i = run.start; i < run.end; i++) {
+      auto &textChar = chars[i];
+      if (textChar.inputId == HARAKA_INPUT) {
+        // Replaced by predicted haraka
+        continue;
+      }
+
+      processedText.append(text, textChar.offset, textChar.length);
+
+      std::size_t maxId = prepared.predictedIds[i];
+      if (maxId < MAX_OUTPUT_ID) {
+        // Add predicted haraka (if any)
+        auto &haraka = tables.haraka[maxId];
+        processedText.append(haraka.bytes, haraka.length);
+      }
+    }
+
+    auto &lastChar = chars[run.end - 1];
+    textOffset = lastChar.offset + lastChar.length;
+  }
+
+  processedText.append(text, textOffset, std::string::npos);
+
   // Result is UTF-8
-  return una::utf32to8(processedText);
+  return processedText;
+}
+
+PIPERPHONEMIZE_EXPORT std::string tashkeel_run(std::string text, State &state) {
+  PIPERPHONEMIZE_STAGE_TIMER(tashkeelTimer, piper::STAGE_TASHKEEL);
+  PIPERPHONEMIZE_STAGE_ADD(tashkeelTimer, bytesIn, text.size());
+  piper::TraceSpan tashkeelSpan("tashkeel");
+  tashkeelSpan.addArg("text_bytes", text.size());
+
+  PreparedText prepared;
+  prepareText(std::move(text), state.skipDiacritized, prepared);
+
+  std::vector<WindowRef> refs;
+  for (std::size_t i = 0; i < prepared.windows.size(); i++) {
+    refs.push_back({&prepared, i});
+  }
+
+  // All windows of the text are run as a single batch
+  predictWindows(refs, state, 0);
+
+  std::string processedText = finishText(prepared);
+  PIPERPHONEMIZE_STAGE_ADD(tashkeelTimer, bytesOut, processedText.size());
+
+  return processedText;
+}
+
+// ----------------------------------------------------------------------------
+
+// Upper bounds of queue wait histogram buckets (last bucket is unbounded)
+const std::array<std::chrono::microseconds, ServiceStats::NUM_WAIT_BUCKETS - 1>
+    WAIT_BUCKET_BOUNDS = {
+        std::chrono::microseconds(50),   std::chrono::microseconds(100),
+        std::chrono::microseconds(250),  std::chrono::microseconds(500),
+        std::chrono::microseconds(1000), std::chrono::microseconds(2000),
+        std::chrono::microseconds(5000), std::chrono::microseconds(10000),
+        std::chrono::microseconds(50000)};
+
+struct ServiceRequest {
+  PreparedText prepared;
+
+  // Windows that were not in the cache
+  std::vector<WindowRef> uncachedRefs;
+
+  std::promise<std::string> result;
+  std::chrono::steady_clock::time_point submitted;
+};
+
+PIPERPHONEMIZE_EXPORT Service::Service(State &state, ServiceConfig config)
+    : state(state), config(config) {
+  if (this->config.maxBatchSize < 1) {
+    this->config.maxBatchSize = 1;
+  }
+
+  stats.batchSizeCounts.assign(this->config.maxBatchSize + 1, 0);
+  for (std::size_t i = 0; i < WAIT_BUCKET_BOUNDS.size(); i++) {
+    stats.queueWaitBoundsMicros[i] = WAIT_BUCKET_BOUNDS[i].count();
+  }
+
+  dispatcher = std::thread(&Service::dispatch, this);
+}
+
+PIPERPHONEMIZE_EXPORT Service::~Service() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+
+  requestAdded.notify_one();
+  dispatcher.join();
+}
+
+PIPERPHONEMIZE_EXPORT std::future<std::string>
+Service::submit(std::string text) {
+  // Text is prepared on the caller's thread
+  auto request = std::make_unique<ServiceRequest>();
+  prepareText(std::move(text), state.skipDiacritized, request->prepared);
+
+  std::vector<WindowRef> refs;
+  for (std::size_t i = 0; i < request->prepared.windows.size(); i++) {
+    refs.push_back({&request->prepared, i});
+  }
+
+  if (state.cache.maxBytes > 0) {
+    // Cached windows don't wait for the model
+    std::lock_guard<std::mutex> cacheLock(cacheMutex);
+    applyCached(refs, state, request->uncachedRefs);
+  } else {
+    request->uncachedRefs = std::move(refs);
+  }
+
+  auto result = request->result.get_future();
+  if (request->uncachedRefs.empty()) {
+    // Nothing left to diacritize
+    request->result.set_value(finishText(request->prepared));
+    return result;
+  }
+
+  request->submitted = std::chrono::steady_clock::now();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) {
+      throw std::runtime_error("Tashkeel service is stopped");
+    }
+
+    queue.push_back(std::move(request));
+  }
+
+  requestAdded.notify_one();
+
+  return result;
+}
+
+PIPERPHONEMIZE_EXPORT ServiceStats Service::getStats() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
+
+void Service::dispatch() {
+  std::vector<std::unique_ptr<ServiceRequest>> batch;
+  std::vector<WindowRef> refs;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      requestAdded.wait(lock, [this] { return stopping || !queue.empty(); });
+
+      if (queue.empty()) {
+        // Stopping
+        break;
+      }
+
+      // No waiting: an idle service runs a request right away, and requests
+      // that arrive while a batch is running are batched together next.
+      // Take whole requests until the batch is full.
+      std::size_t batchWindows = 0;
+      auto now = std::chrono::steady_clock::now();
+
+      while (!queue.empty()) {
+        std::size_t numWindows = queue.front()->uncachedRefs.size();
+        if (!batch.empty() &&
+            ((batchWindows + numWindows) > config.maxBatchSize)) {
+          break;
+        }
+
+        // Record time spent waiting in the queue
+        auto waited = now - queue.front()->submitted;
+        std::size_t bucket = 0;
+        while ((bucket < WAIT_BUCKET_BOUNDS.size()) &&
+               (waited > WAIT_BUCKET_BOUNDS[bucket])) {
+          bucket++;
+        }
+
+        stats.queueWaitCounts[bucket]++;
+
+        batchWindows += numWindows;
+        batch.push_back(std::move(queue.front()));
+        queue.pop_front();
+      }
+
+      stats.requests += batch.size();
+      stats.batchSizeCounts[std::min(batchWindows, config.maxBatchSize)]++;
+    }
+
+    refs.clear();
+    for (auto &request : batch) {
+      refs.insert(refs.end(), request->uncachedRefs.begin(),
+                  request->uncachedRefs.end());
+    }
+
+    std::exception_ptr error;
+    try {
+      // Cache was checked in submit
+      predictUncached(refs, state, config.maxBatchSize, &cacheMutex);
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    // Fan results back out to callers
+    for (auto &request : batch) {
+      if (error) {
+        request->result.set_exception(error);
+        continue;
+      }
+
+      try {
+        request->result.set_value(finishText(request->prepared));
+      } catch (...) {
+        request->result.set_exception(std::current_exception());
+      }
+    }
+
+    batch.clear();
+  }
 }
 
 } // namespace tashkeel
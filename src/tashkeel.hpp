@@ -1,11 +1,20 @@
 #ifndef TASHKEEL_H_
 #define TASHKEEL_H_
 
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
-
-#include <onnxruntime_cxx_api.h>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "shared.hpp"
 
@@ -17,23 +26,132 @@ const int PAD_ID = 0;
 const int UNK_ID = 1;
 const std::size_t MAX_INPUT_CHARS = 315;
 
-extern std::set<char32_t> HARAKAT_CHARS;
-extern std::set<int> INVALID_HARAKA_IDS;
-extern std::map<char32_t, int> inputVocab;
-extern std::map<int, std::vector<char32_t>> outputVocab;
+// Bounded LRU cache of model predictions.
+// Keys are the (harakat-stripped) input ids of a model window, values are the
+// predicted output ids for each character.
+class PredictionCache {
+public:
+  // Maximum memory used by keys, values, and bookkeeping (0 = disabled).
+  // Use setMaxBytes to change it on a cache that has entries.
+  std::size_t maxBytes = 0;
+
+  std::size_t hits = 0;
+  std::size_t misses = 0;
+
+  PIPERPHONEMIZE_EXPORT bool get(const std::string &key,
+                                 std::string &outputIds);
+  PIPERPHONEMIZE_EXPORT void put(const std::string &key,
+                                 const std::string &outputIds);
+  PIPERPHONEMIZE_EXPORT void clear();
+
+  // Changes maxBytes, evicting least recently used entries to fit
+  PIPERPHONEMIZE_EXPORT void setMaxBytes(std::size_t newMaxBytes);
+
+  std::size_t size() const { return entries.size(); }
+  std::size_t bytes() const { return usedBytes; }
+
+private:
+  typedef std::list<std::pair<std::string, std::string>> EntryList;
+
+  // Most recently used first
+  EntryList entries;
+  std::unordered_map<std::string_view, EntryList::iterator> index;
+  std::size_t usedBytes = 0;
+
+  // Evicts least recently used entries until at most targetBytes are used
+  void evict(std::size_t targetBytes);
+};
+
+// onnxruntime session (defined in tashkeel.cpp so that onnxruntime headers
+// and symbols are not needed by users of this header)
+struct OnnxModel;
 
 struct State {
-  Ort::Session onnx;
-  Ort::AllocatorWithDefaultOptions allocator;
-  Ort::SessionOptions options;
-  Ort::Env env;
+  // Set when loaded from an onnx model
+  std::shared_ptr<OnnxModel> onnx;
+
+  // Leave runs of Arabic text that already have harakat unchanged
+  bool skipDiacritized = false;
+
+  // Optional cache of predictions (see PredictionCache::maxBytes)
+  PredictionCache cache;
 
-  State() : onnx(nullptr){};
+  // Largest batch the model accepts (0 = any size)
+  std::size_t maxBatchSize = 1;
 };
 
+// Loads an onnx model.
+//
+// When built with PIPER_PHONEMIZE_LAZY_ONNXRUNTIME, the onnxruntime library is
+// opened on the first call instead of at process startup. Set the
+// PIPER_PHONEMIZE_ONNXRUNTIME environment variable to override its path.
 PIPERPHONEMIZE_EXPORT void tashkeel_load(std::string modelPath, State &state);
 PIPERPHONEMIZE_EXPORT std::string tashkeel_run(std::string text, State &state);
 
+// ----------------------------------------------------------------------------
+
+struct ServiceConfig {
+  // Maximum number of model windows in one inference batch
+  std::size_t maxBatchSize = 16;
+};
+
+struct ServiceStats {
+  static constexpr std::size_t NUM_WAIT_BUCKETS = 10;
+
+  // Total number of requests that went through the model
+  std::size_t requests = 0;
+
+  // batchSizeCounts[n] = number of batches with n windows
+  std::vector<std::size_t> batchSizeCounts;
+
+  // queueWaitCounts[i] = number of requests that waited at most
+  // queueWaitBoundsMicros[i] (last bucket is unbounded)
+  std::array<std::size_t, NUM_WAIT_BUCKETS> queueWaitCounts = {};
+  std::array<std::size_t, NUM_WAIT_BUCKETS> queueWaitBoundsMicros = {};
+};
+
+struct ServiceRequest;
+
+// Collects tashkeel requests from many threads into batched inference.
+//
+// Requests never wait for a batch to fill up. When the model is idle, a
+// request is run right away. Requests that arrive while a batch is running
+// are run together in the next batch. Cached windows are looked up in
+// submit, so a fully cached request doesn't queue at all.
+//
+// A background thread takes ownership of state until the service is
+// destroyed, so state must not be used directly in the meantime.
+class Service {
+public:
+  PIPERPHONEMIZE_EXPORT Service(State &state, ServiceConfig config = {});
+  PIPERPHONEMIZE_EXPORT ~Service();
+
+  Service(const Service &) = delete;
+  Service &operator=(const Service &) = delete;
+
+  // Queues text to be diacritized. Safe to call from any thread.
+  PIPERPHONEMIZE_EXPORT std::future<std::string> submit(std::string text);
+
+  PIPERPHONEMIZE_EXPORT ServiceStats getStats();
+
+private:
+  void dispatch();
+
+  State &state;
+  ServiceConfig config;
+  ServiceStats stats;
+
+  std::mutex mutex;
+  std::condition_variable requestAdded;
+  std::deque<std::unique_ptr<ServiceRequest>> queue;
+
+  // Guards state.cache, which submit reads while the dispatcher runs
+  std::mutex cacheMutex;
+  bool stopping = false;
+
+  std::thread dispatcher;
+};
+
 } // namespace tashkeel
 
 #endif // TASHKEEL_H_
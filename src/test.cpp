@@ -1,3 +1,6 @@
+#include <filesystem>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <map>
 #include <sstream>
@@ -5,9 +8,16 @@
 
 #include <espeak-ng/speak_lib.h>
 
+#include "batch.hpp"
+#include "document.hpp"
+#include "phoneme_id_table.hpp"
 #include "phoneme_ids.hpp"
+#include "phoneme_inventory.hpp"
+#include "phoneme_rewriter.hpp"
 #include "phonemize.hpp"
+#include "stats.hpp"
 #include "tashkeel.hpp"
+#include "trace.hpp"
 #include "uni_algo.h"
 
 std::string idString(const std::vector<std::vector<piper::Phoneme>> &phonemes,
@@ -106,6 +116,54 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  // Only changed sentences of a document are phonemized again
+  piper::DocumentConfig documentConfig;
+  documentConfig.phonemeConfig = phonemeConfig;
+  piper::PhonemizedDocument document(documentConfig);
+  document.update("Test 1. Test 2. Test 4.");
+  auto documentChanges = document.update("Test 1. Test 3. Test 4.");
+
+  phonemes.clear();
+  piper::phonemize_eSpeak("Test 1. Test 3. Test 4.", phonemeConfig, phonemes);
+  std::vector<std::vector<piper::Phoneme>> documentPhonemes;
+  document.getPhonemes(documentPhonemes);
+
+  if ((documentChanges.size() != 1) || (documentChanges[0].begin != 1) ||
+      (documentChanges[0].end != 2) ||
+      (documentChanges[0].previousBegin != 1) ||
+      (documentChanges[0].previousEnd != 2) ||
+      (document.phonemizedCount() != 1) ||
+      (document.sentences()[2].previousIndex != 2) ||
+      (documentPhonemes != phonemes)) {
+    std::cerr << "document update: " << phonemeString(documentPhonemes)
+              << std::endl;
+    return 1;
+  }
+
+  // Long sentences are split at clauses and spaces
+  phonemes.clear();
+  phonemeConfig.maxSentencePhonemes = 20;
+  piper::phonemize_eSpeak("This is a test, with clauses; and a very long "
+                          "run on clause that never seems to end.",
+                          phonemeConfig, phonemes);
+  phonemeConfig.maxSentencePhonemes = 0;
+
+  for (auto &sentencePhonemes : phonemes) {
+    if ((sentencePhonemes.size() > 20) || sentencePhonemes.empty() ||
+        (sentencePhonemes.front() == U' ') ||
+        (sentencePhonemes.back() == U' ')) {
+      std::cerr << "max sentence phonemes: " << phonemeString(phonemes)
+                << std::endl;
+      return 1;
+    }
+  }
+
+  if ((phonemes.size() < 4) || (phonemes[0].back() != U',')) {
+    std::cerr << "max sentence phonemes: " << phonemeString(phonemes)
+              << std::endl;
+    return 1;
+  }
+
   // Check "ВЕСЕ́ЛКА" in Ukrainian
   piper::CodepointsPhonemeConfig codepointsConfig;
   phonemes.clear();
@@ -126,14 +184,73 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  idConfig.phonemeIdMap =
-      std::make_shared<piper::PhonemeIdMap>(piper::DEFAULT_ALPHABET["uk"]);
+  idConfig.phonemeIdMap = piper::get_codepoints_phoneme_id_map("uk");
   idStr = idString(phonemes, idConfig);
   if (idStr != "1 0 14 0 18 0 33 0 18 0 45 0 27 0 26 0 12 0 2 ") {
     std::cerr << "Весе́лка: " << idStr << std::endl;
     return 1;
   }
 
+  // Runs of ASCII (16 at a time) mixed with decomposed characters
+  phonemes.clear();
+  piper::phonemize_codepoints("A RAINBOW IS CAUSED BY LIGHT. ÇA VA",
+                              codepointsConfig, phonemes);
+  if (phonemeString(phonemes) !=
+      "a rainbow is caused by light. c\u0327a va\n") {
+    std::cerr << "Unexpected normalized phonemes: " << phonemeString(phonemes)
+              << std::endl;
+    return 1;
+  }
+
+  // Sentence splitting, on one thread and several
+  codepointsConfig.splitSentences = true;
+  for (std::size_t numThreads : {1, 4}) {
+    codepointsConfig.numThreads = numThreads;
+    phonemes.clear();
+    piper::phonemize_codepoints(" Pi is 3.14. \"Really?!\"  Yes…ok。Done ",
+                                codepointsConfig, phonemes);
+    if (phonemeString(phonemes) !=
+        "pi is 3.14.\n\"really?!\"\nyes…\nok。\ndone\n") {
+      std::cerr << "Unexpected sentence phonemes: " << phonemeString(phonemes)
+                << std::endl;
+      return 1;
+    }
+  }
+
+  codepointsConfig.splitSentences = false;
+  codepointsConfig.numThreads = 1;
+
+  // Batches give the same ids as separate calls
+  std::vector<std::string> batchTexts{"Весе́лка. Так!", "", "ВЕСЕ́ЛКА"};
+  piper::CodepointsBatchConfig batchConfig;
+  batchConfig.phonemeConfig.splitSentences = true;
+  batchConfig.idConfig = idConfig;
+  batchConfig.numThreads = 2;
+
+  piper::CodepointsBatchResult batchResult;
+  piper::phonemize_codepoints_batch(batchTexts, batchConfig, batchResult);
+
+  std::string expectedBatchIds;
+  for (auto &batchText : batchTexts) {
+    phonemes.clear();
+    piper::phonemize_codepoints(batchText, batchConfig.phonemeConfig,
+                                phonemes);
+    expectedBatchIds += idString(phonemes, idConfig);
+  }
+
+  std::stringstream batchIds;
+  for (auto id : batchResult.phonemeIds) {
+    batchIds << id << " ";
+  }
+
+  if ((batchIds.str() != expectedBatchIds) ||
+      (batchResult.textOffsets != std::vector<std::size_t>{0, 2, 2, 3}) ||
+      (batchResult.sentenceOffsets.size() != 4) ||
+      (batchResult.sentenceOffsets.back() != batchResult.phonemeIds.size())) {
+    std::cerr << "Unexpected batch ids: " << batchIds.str() << std::endl;
+    return 1;
+  }
+
   // --------------------------------------------------------------------------
 
   // Check missing phoneme
@@ -164,6 +281,223 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  // Sentences of similar length are batched together
+  std::vector<std::vector<piper::PhonemeId>> batchSentenceIds{
+      {1, 2, 3, 4, 5}, {1, 2, 3}, {1, 2, 3, 4, 5, 6, 7, 8, 9}, {4, 3, 2, 1},
+      {1, 2, 3, 4, 5, 6, 7, 8, 9, 10}};
+  piper::PhonemeIdBatchConfig batchIdConfig;
+  batchIdConfig.maxBatchSize = 2;
+
+  std::vector<piper::PhonemeIdBatch> idBatches;
+  piper::plan_phoneme_id_batches(batchSentenceIds, batchIdConfig, idBatches);
+
+  if ((idBatches.size() != 3) ||
+      (idBatches[0].sentenceIndexes != std::vector<std::size_t>{1, 3}) ||
+      (idBatches[0].lengths != std::vector<int64_t>{3, 4}) ||
+      (idBatches[0].maxLength != 4) ||
+      (idBatches[1].sentenceIndexes != std::vector<std::size_t>{0}) ||
+      (idBatches[2].sentenceIndexes != std::vector<std::size_t>{2, 4})) {
+    std::cerr << "Unexpected phoneme id batches" << std::endl;
+    return 1;
+  }
+
+  std::vector<piper::PhonemeId> packedIds(idBatches[0].size() *
+                                          idBatches[0].maxLength);
+  piper::pack_phoneme_id_batch(batchSentenceIds, idBatches[0], 0,
+                               packedIds.data());
+  if (packedIds != std::vector<piper::PhonemeId>{1, 2, 3, 0, 4, 3, 2, 1}) {
+    std::cerr << "Unexpected packed ids" << std::endl;
+    return 1;
+  }
+
+  // --------------------------------------------------------------------------
+
+  // Check sequence rewriting (longest match wins)
+  piper::PhonemeRewriter rewriter(std::vector<piper::PhonemeRewriteRule>{
+      {{U't', 0x0361, U'ʃ'}, {U'ʧ'}},
+      {{U'a', U'ː'}, {U'a', U'a'}},
+      {{U'a'}, {U'ɑ'}},
+      {{U'h'}, {}},
+  });
+
+  std::vector<piper::Phoneme> rewrittenPhonemes;
+  rewriter.rewrite({U't', 0x0361, U'ʃ', U'a', U'ː', U'h', U'a', U't'},
+                   rewrittenPhonemes);
+
+  if (rewrittenPhonemes !=
+      std::vector<piper::Phoneme>{U'ʧ', U'a', U'a', U'ɑ', U't'}) {
+    std::cerr << "Unexpected rewritten phonemes: "
+              << una::utf32to8(std::u32string(rewrittenPhonemes.begin(),
+                                              rewrittenPhonemes.end()))
+              << std::endl;
+    return 1;
+  }
+
+  // Single phoneme maps
+  codepointsConfig.phonemeRewriter = std::make_shared<piper::PhonemeRewriter>(
+      piper::PhonemeMap{{U'c', {U'k'}}});
+  phonemes.clear();
+  piper::phonemize_codepoints("Cacao", codepointsConfig, phonemes);
+  codepointsConfig.phonemeRewriter.reset();
+
+  if (phonemeString(phonemes) != "kakao\n") {
+    std::cerr << "Unexpected mapped phonemes: " << phonemeString(phonemes)
+              << std::endl;
+    return 1;
+  }
+
+  // Default maps are compiled once and shared
+  if (!piper::get_phoneme_rewriter("pt-br") ||
+      (piper::get_phoneme_rewriter("pt-br") !=
+       piper::get_phoneme_rewriter("pt-br")) ||
+      piper::get_phoneme_rewriter("en-us")) {
+    std::cerr << "Unexpected shared phoneme rewriter" << std::endl;
+    return 1;
+  }
+
+  if (!piper::get_codepoints_phoneme_id_map("uk") ||
+      (piper::get_codepoints_phoneme_id_map("uk") !=
+       piper::get_codepoints_phoneme_id_map("uk")) ||
+      piper::get_codepoints_phoneme_id_map("xx")) {
+    std::cerr << "Unexpected shared phoneme id map" << std::endl;
+    return 1;
+  }
+
+  // --------------------------------------------------------------------------
+
+  // Check interned phoneme symbols
+  piper::PhonemeInventory inventory;
+  std::vector<piper::PhonemeSymbol> symbols;
+  inventory.tokenize({U't', 0x0361, U'ʃ', U'ˈ', U'a', U'ː', U'c', 0x0327},
+                     symbols);
+
+  if ((symbols.size() != 4) || (inventory.token(symbols[0]) != U"t͡ʃ") ||
+      (inventory.token(symbols[2]) != U"aː") ||
+      (inventory.token(symbols[3]) != U"ç")) {
+    std::cerr << "Expected 4 phoneme symbols, got " << symbols.size()
+              << std::endl;
+    return 1;
+  }
+
+  // Same ids as phonemes_to_ids, with "ç" as one symbol
+  phonemeConfig.voice = "de";
+  std::vector<std::vector<piper::PhonemeSymbol>> sentenceSymbols;
+  piper::phonemize_eSpeak("licht!", phonemeConfig, inventory, sentenceSymbols);
+
+  piper::PhonemeSymbolIds symbolIds;
+  std::vector<piper::PhonemeId> symbolIdsVec;
+  piper::symbols_to_ids(sentenceSymbols[0], inventory, symbolIds, symbolIdsVec,
+                        missingPhonemes);
+
+  std::stringstream symbolIdStr;
+  for (auto id : symbolIdsVec) {
+    symbolIdStr << id << " ";
+  }
+
+  if ((sentenceSymbols[0].size() != 6) ||
+      (symbolIdStr.str() != "1 0 24 0 120 0 74 0 16 0 140 0 32 0 4 0 2 ")) {
+    std::cerr << "licht symbols: " << symbolIdStr.str() << std::endl;
+    return 1;
+  }
+
+  // --------------------------------------------------------------------------
+
+  // Check compiled phoneme id table (same ids as phonemes_to_ids)
+  auto tablePath =
+      std::filesystem::temp_directory_path() / "test_piper_phonemize.ppid";
+  auto tableBytes = piper::compile_phoneme_id_table(
+      *piper::get_espeak_phoneme_id_map(), piper::PhonemeIdConfig());
+  std::ofstream(tablePath, std::ios::binary)
+      .write(tableBytes.data(), tableBytes.size());
+
+  auto idTable = piper::load_phoneme_id_table(tablePath.string());
+  phonemes.clear();
+  piper::phonemize_eSpeak("licht!", phonemeConfig, phonemes);
+
+  std::vector<piper::PhonemeId> tableIds;
+  piper::phonemes_to_ids(phonemes[0], *idTable, tableIds, missingPhonemes);
+
+  std::stringstream tableIdStr;
+  for (auto id : tableIds) {
+    tableIdStr << id << " ";
+  }
+
+  if (tableIdStr.str() != "1 0 24 0 120 0 74 0 16 0 140 0 32 0 4 0 2 ") {
+    std::cerr << "licht table: " << tableIdStr.str() << std::endl;
+    return 1;
+  }
+
+  // Corrupt one id
+  tableBytes[tableBytes.size() - 1] ^= 1;
+  std::ofstream(tablePath, std::ios::binary)
+      .write(tableBytes.data(), tableBytes.size());
+
+  bool checksumFailed = false;
+  try {
+    piper::load_phoneme_id_table(tablePath.string());
+  } catch (const std::runtime_error &) {
+    checksumFailed = true;
+  }
+
+  std::filesystem::remove(tablePath);
+  if (!checksumFailed) {
+    std::cerr << "Expected phoneme id table checksum to fail" << std::endl;
+    return 1;
+  }
+
+  phonemeConfig.voice = "en-us";
+
+  // --------------------------------------------------------------------------
+
+  // Check trace has a span per clause
+  piper::start_trace();
+  phonemes.clear();
+  piper::phonemize_eSpeak("this, is: a; test.", phonemeConfig, phonemes);
+  piper::stop_trace();
+
+  std::stringstream traceStr;
+  piper::write_trace(traceStr);
+
+  std::size_t numClauseSpans = 0;
+  for (std::size_t pos = traceStr.str().find("\"clause\"");
+       pos != std::string::npos;
+       pos = traceStr.str().find("\"clause\"", pos + 1)) {
+    numClauseSpans++;
+  }
+
+  if (numClauseSpans != 4) {
+    std::cerr << "Expected 4 clause spans: " << traceStr.str() << std::endl;
+    return 1;
+  }
+
+#ifdef PIPERPHONEMIZE_STATS
+  // Check per-stage stats
+  piper::reset_stats();
+  phonemeConfig.voice = "en-us";
+  phonemes.clear();
+  piper::phonemize_eSpeak("this, is: a; test.", phonemeConfig, phonemes);
+  idString(phonemes, idConfig);
+
+  auto stats = piper::get_stats();
+  if (!stats.enabled ||
+      (stats.stages[piper::STAGE_PHONEMIZE_ESPEAK].calls != 1) ||
+      (stats.stages[piper::STAGE_ESPEAK].calls != 4) ||
+      (stats.stages[piper::STAGE_PHONEME_IDS].calls != phonemes.size()) ||
+      (stats.stages[piper::STAGE_PHONEMIZE_ESPEAK].phonemes !=
+       phonemes[0].size())) {
+    std::cerr << "Unexpected stats: espeak calls="
+              << stats.stages[piper::STAGE_ESPEAK].calls << std::endl;
+    return 1;
+  }
+
+  piper::reset_stats();
+  stats = piper::get_stats();
+  if (stats.stages[piper::STAGE_ESPEAK].calls != 0) {
+    std::cerr << "Stats were not reset" << std::endl;
+    return 1;
+  }
+#endif
+
   // --------------------------------------------------------------------------
 
   // Test Arabic with libtashkeel (https://github.com/mush42/libtashkeel)
@@ -178,6 +512,46 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  // Text without Arabic letters is not sent to the model
+  expectedText = "Hello, world!";
+  actualText = tashkeel::tashkeel_run(expectedText, tashkeelState);
+  if (expectedText != actualText) {
+    std::cerr << "Expected '" << expectedText << "', got '" << actualText << "'"
+              << std::endl;
+    return 1;
+  }
+
+  // Already diacritized text is left alone
+  tashkeelState.skipDiacritized = true;
+  expectedText = "مَرْحَبًا";
+  actualText = tashkeel::tashkeel_run(expectedText, tashkeelState);
+  if (expectedText != actualText) {
+    std::cerr << "Expected '" << expectedText << "', got '" << actualText << "'"
+              << std::endl;
+    return 1;
+  }
+
+  tashkeelState.skipDiacritized = false;
+
+  {
+    // Requests from many threads are batched together
+    tashkeel::Service tashkeelService(tashkeelState);
+    std::vector<std::future<std::string>> results;
+    for (int i = 0; i < 4; i++) {
+      results.push_back(tashkeelService.submit("مرحبا"));
+    }
+
+    expectedText = "مَرْحَبًا";
+    for (auto &result : results) {
+      actualText = result.get();
+      if (expectedText != actualText) {
+        std::cerr << "Expected '" << expectedText << "', got '" << actualText
+                  << "'" << std::endl;
+        return 1;
+      }
+    }
+  }
+
   // --------------------------------------------------------------------------
 
   std::cout << "OK" << std::endl;
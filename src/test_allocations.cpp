@@ -0,0 +1,226 @@
+// Counts heap allocations made by hot-path functions after warming up.
+//
+// malloc (glibc) or operator new (elsewhere) is replaced in this executable,
+// so allocations inside libpiper_phonemize and its dependencies are counted
+// too. Each function is called in a loop and fails if it makes more
+// allocations per call than its budget in ALLOCATION_BUDGETS.
+//
+// Lower a budget when a change removes allocations, so that they don't come
+// back unnoticed.
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <espeak-ng/speak_lib.h>
+
+#include "phoneme_ids.hpp"
+#include "phonemize.hpp"
+#include "tashkeel.hpp"
+
+// Only counted while checkAllocations is in its counted loop
+static std::atomic<bool> countingAllocations{false};
+static std::atomic<std::size_t> numAllocations{0};
+static std::atomic<std::size_t> numAllocatedBytes{0};
+
+static inline void countAllocation(std::size_t size) {
+  if (countingAllocations.load(std::memory_order_relaxed)) {
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    numAllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+  }
+}
+
+#ifdef __GLIBC__
+
+// Also counts allocations from C code (eSpeak, onnxruntime)
+extern "C" {
+void *__libc_malloc(std::size_t size);
+void *__libc_calloc(std::size_t count, std::size_t size);
+void *__libc_realloc(void *ptr, std::size_t size);
+
+void *malloc(std::size_t size) noexcept {
+  countAllocation(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(std::size_t count, std::size_t size) noexcept {
+  countAllocation(count * size);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, std::size_t size) noexcept {
+  countAllocation(size);
+  return __libc_realloc(ptr, size);
+}
+}
+
+#else
+
+void *operator new(std::size_t size) {
+  countAllocation(size);
+  if (void *ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+#endif // __GLIBC__
+
+// ----------------------------------------------------------------------------
+
+const std::size_t NO_BUDGET = std::numeric_limits<std::size_t>::max();
+
+// Maximum allocations per call (NO_BUDGET = only reported).
+// eSpeak and onnxruntime allocate internally, so their budgets depend on the
+// versions being linked.
+static std::map<std::string, std::size_t> ALLOCATION_BUDGETS = {
+    {"phonemize_eSpeak", NO_BUDGET},
+    {"phonemize_codepoints", 2},
+    {"phonemize_codepoints (custom map)", 2},
+    {"phonemes_to_ids", 0},
+    {"phonemes_to_ids (custom map)", 0},
+    {"tashkeel_run", NO_BUDGET},
+};
+
+const std::size_t WARMUP_CALLS = 10;
+const std::size_t COUNTED_CALLS = 100;
+
+// Returns false if over budget
+bool checkAllocations(const std::string &name, std::function<void()> func) {
+  for (std::size_t i = 0; i < WARMUP_CALLS; i++) {
+    func();
+  }
+
+  numAllocations = 0;
+  numAllocatedBytes = 0;
+  countingAllocations = true;
+
+  for (std::size_t i = 0; i < COUNTED_CALLS; i++) {
+    func();
+  }
+
+  countingAllocations = false;
+
+  auto allocationsPerCall = (double)numAllocations / COUNTED_CALLS;
+  auto bytesPerCall = (double)numAllocatedBytes / COUNTED_CALLS;
+  auto budget = ALLOCATION_BUDGETS.at(name);
+
+  std::cout << name << ": " << allocationsPerCall << " allocation(s), "
+            << bytesPerCall << " byte(s) per call";
+  if (budget != NO_BUDGET) {
+    std::cout << " (budget: " << budget << ")";
+  }
+
+  std::cout << std::endl;
+
+  if ((budget != NO_BUDGET) && (allocationsPerCall > budget)) {
+    std::cerr << name << " is over its allocation budget" << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "Need espeak-ng-data path" << std::endl;
+    return 1;
+  }
+
+  int result = espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS, 0, argv[1], 0);
+  if (result < 0) {
+    std::cerr << "Failed to initialize eSpeak" << std::endl;
+    return 1;
+  }
+
+  bool withinBudget = true;
+
+  // Output buffers are reused between calls, like a long-running server
+  std::string text = "A rainbow is a meteorological phenomenon that is caused "
+                     "by reflection, refraction and dispersion of light.";
+  std::vector<std::vector<piper::Phoneme>> phonemes;
+
+  piper::eSpeakPhonemeConfig eSpeakConfig;
+  withinBudget &= checkAllocations("phonemize_eSpeak", [&]() {
+    phonemes.clear();
+    piper::phonemize_eSpeak(text, eSpeakConfig, phonemes);
+  });
+
+  std::vector<piper::Phoneme> sentencePhonemes = phonemes.at(0);
+
+  piper::CodepointsPhonemeConfig codepointsConfig;
+  std::string ukText = "Веселка - це атмосферне оптичне явище.";
+  withinBudget &= checkAllocations("phonemize_codepoints", [&]() {
+    phonemes.clear();
+    piper::phonemize_codepoints(ukText, codepointsConfig, phonemes);
+  });
+
+  std::vector<piper::Phoneme> ukPhonemes = phonemes.at(0);
+
+  // Compiled map is cached between calls
+  piper::CodepointsPhonemeConfig customCodepointsConfig;
+  customCodepointsConfig.phonemeMap = std::make_shared<piper::PhonemeMap>(
+      piper::PhonemeMap{{U'в', {U'v'}}});
+  withinBudget &= checkAllocations("phonemize_codepoints (custom map)", [&]() {
+    phonemes.clear();
+    piper::phonemize_codepoints(ukText, customCodepointsConfig, phonemes);
+  });
+
+  piper::PhonemeIdConfig idConfig;
+  std::vector<piper::PhonemeId> phonemeIds;
+  std::map<piper::Phoneme, std::size_t> missingPhonemes;
+  withinBudget &= checkAllocations("phonemes_to_ids", [&]() {
+    phonemeIds.clear();
+    piper::phonemes_to_ids(sentencePhonemes, idConfig, phonemeIds,
+                           missingPhonemes);
+  });
+
+  // Codepoint phonemes are all in the map, so none are counted as missing
+  piper::PhonemeIdConfig customIdConfig;
+  customIdConfig.phonemeIdMap = piper::get_codepoints_phoneme_id_map("uk");
+  missingPhonemes.clear();
+  withinBudget &= checkAllocations("phonemes_to_ids (custom map)", [&]() {
+    phonemeIds.clear();
+    piper::phonemes_to_ids(ukPhonemes, customIdConfig, phonemeIds,
+                           missingPhonemes);
+  });
+
+  if (!missingPhonemes.empty()) {
+    std::cerr << "phonemes_to_ids (custom map) has missing phonemes"
+              << std::endl;
+    withinBudget = false;
+  }
+
+  if (argc > 2) {
+    tashkeel::State tashkeelState;
+    tashkeel::tashkeel_load(argv[2], tashkeelState);
+
+    std::string arText = "ذهب الطالب إلى المدرسة مبكرا";
+    withinBudget &= checkAllocations("tashkeel_run", [&]() {
+      tashkeel::tashkeel_run(arText, tashkeelState);
+    });
+  }
+
+  espeak_Terminate();
+
+  if (!withinBudget) {
+    return 1;
+  }
+
+  std::cout << "OK" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "thread_pool.hpp"
+
+namespace piper {
+
+// Tasks of one slot.
+// The owner takes tasks from the front, other slots steal from the back.
+struct TaskQueue {
+  std::mutex mutex;
+  std::deque<std::size_t> tasks;
+};
+
+// One call to run_tasks
+struct PoolJob {
+  const std::function<void(std::size_t, std::size_t)> *runTask = nullptr;
+  std::vector<TaskQueue> queues;
+
+  // Guarded by the pool mutex
+  std::size_t nextSlot = 1;
+  std::size_t numRunning = 0;
+
+  std::mutex errorMutex;
+  std::exception_ptr error;
+
+  explicit PoolJob(std::size_t numSlots) : queues(numSlots) {}
+
+  // Next task for a slot, or false when every queue is empty
+  bool takeTask(std::size_t slot, std::size_t &task) {
+    {
+      auto &ownQueue = queues[slot];
+      std::lock_guard<std::mutex> lock(ownQueue.mutex);
+      if (!ownQueue.tasks.empty()) {
+        task = ownQueue.tasks.front();
+        ownQueue.tasks.pop_front();
+        return true;
+      }
+    }
+
+    for (std::size_t i = 1; i < queues.size(); i++) {
+      auto &otherQueue = queues[(slot + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(otherQueue.mutex);
+      if (!otherQueue.tasks.empty()) {
+        task = otherQueue.tasks.back();
+        otherQueue.tasks.pop_back();
+        return true;
+      }
+    }
+
+    // Tasks are never added, so this slot is done
+    return false;
+  }
+
+  void runSlot(std::size_t slot) {
+    try {
+      std::size_t task = 0;
+      while (takeTask(slot, task)) {
+        (*runTask)(task, slot);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(errorMutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+
+      // Stop the other slots
+      for (auto &queue : queues) {
+        std::lock_guard<std::mutex> queueLock(queue.mutex);
+        queue.tasks.clear();
+      }
+    }
+  }
+};
+
+// Workers that join jobs with unclaimed slots
+class ThreadPool {
+public:
+  explicit ThreadPool(std::size_t numWorkers) : numWorkers(numWorkers) {
+    for (std::size_t i = 0; i < numWorkers; i++) {
+      std::thread(&ThreadPool::work, this).detach();
+    }
+  }
+
+  std::size_t getNumWorkers() const { return numWorkers; }
+
+  // Runs slot 0 of a job here and the rest on idle workers
+  void run(PoolJob &job) {
+    if (job.queues.size() > 1) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(&job);
+      }
+
+      jobAdded.notify_all();
+    }
+
+    job.runSlot(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // Unclaimed slots have nothing left to steal
+    jobs.erase(std::remove(jobs.begin(), jobs.end(), &job), jobs.end());
+    slotFinished.wait(lock, [&job] { return job.numRunning == 0; });
+  }
+
+private:
+  std::size_t numWorkers = 0;
+
+  std::mutex mutex;
+  std::condition_variable jobAdded;
+  std::condition_variable slotFinished;
+  std::deque<PoolJob *> jobs;
+
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      jobAdded.wait(lock, [this] { return !jobs.empty(); });
+
+      PoolJob *job = jobs.front();
+      auto slot = job->nextSlot++;
+      job->numRunning++;
+      if (job->nextSlot >= job->queues.size()) {
+        jobs.pop_front();
+      }
+
+      lock.unlock();
+      job->runSlot(slot);
+      lock.lock();
+
+      job->numRunning--;
+      if (job->numRunning == 0) {
+        slotFinished.notify_all();
+      }
+    }
+  }
+};
+
+// Started on first use. Never destroyed, so exiting doesn't wait for the
+// workers (which are blocked until the next job).
+static ThreadPool &getThreadPool() {
+  static ThreadPool *pool = new ThreadPool(
+      std::max(1u, std::thread::hardware_concurrency()) - 1);
+
+  return *pool;
+}
+
+void run_tasks(const std::vector<std::size_t> &taskCosts,
+               std::size_t numThreads,
+               const std::function<void(std::size_t, std::size_t)> &runTask) {
+  numThreads = std::min(numThreads, taskCosts.size());
+  if (numThreads <= 1) {
+    // No queues or workers needed
+    for (std::size_t task = 0; task < taskCosts.size(); task++) {
+      runTask(task, 0);
+    }
+
+    return;
+  }
+
+  auto &pool = getThreadPool();
+  numThreads = std::min(numThreads, pool.getNumWorkers() + 1);
+
+  // Most expensive tasks first, each to the queue with the least work
+  std::vector<std::size_t> taskOrder(taskCosts.size());
+  for (std::size_t task = 0; task < taskOrder.size(); task++) {
+    taskOrder[task] = task;
+  }
+
+  std::stable_sort(taskOrder.begin(), taskOrder.end(),
+                   [&taskCosts](std::size_t a, std::size_t b) {
+                     return taskCosts[a] > taskCosts[b];
+                   });
+
+  PoolJob job(numThreads);
+  job.runTask = &runTask;
+
+  std::vector<std::size_t> queueCosts(numThreads, 0);
+  for (auto task : taskOrder) {
+    auto queue = std::min_element(queueCosts.begin(), queueCosts.end()) -
+                 queueCosts.begin();
+    job.queues[queue].tasks.push_back(task);
+    queueCosts[queue] += taskCosts[task];
+  }
+
+  pool.run(job);
+
+  if (job.error) {
+    std::rethrow_exception(job.error);
+  }
+}
+
+} // namespace piper
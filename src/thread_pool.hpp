@@ -0,0 +1,26 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace piper {
+
+// Runs runTask(task, slot) for every task on up to numThreads threads: this
+// one (slot 0) plus idle workers of a pool shared by the whole library, which
+// is started on first use with one worker per extra CPU. Each slot runs on
+// one thread at a time, so slot can index per-thread state.
+//
+// The most expensive tasks are handed out first, and idle threads steal tasks
+// from busy ones. Returns once every task has finished, and rethrows the
+// first exception after all threads have stopped. The calling thread runs
+// tasks too, so tasks may call run_tasks themselves.
+void run_tasks(const std::vector<std::size_t> &taskCosts,
+               std::size_t numThreads,
+               const std::function<void(std::size_t task, std::size_t slot)>
+                   &runTask);
+
+} // namespace piper
+
+#endif // THREAD_POOL_H_
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "trace.hpp"
+
+namespace piper {
+
+struct TraceEvent {
+  const char *name;
+  int64_t startNanos;
+  int64_t durationNanos;
+  std::array<TraceArg, MAX_TRACE_ARGS> args;
+  std::size_t numArgs;
+};
+
+// Events of one thread.
+// The mutex is only contended while the trace is being written or cleared.
+struct TraceBuffer {
+  std::mutex mutex;
+  uint32_t threadId = 0;
+  std::string threadName;
+  std::vector<TraceEvent> events;
+};
+
+struct TraceRegistry {
+  std::mutex mutex;
+  std::atomic<bool> tracing{false};
+
+  // steady_clock time of start_trace
+  std::atomic<int64_t> startNanos{0};
+
+  // Buffers are shared with their threads, and kept after a thread exits
+  // until the next start_trace.
+  std::vector<std::shared_ptr<TraceBuffer>> buffers;
+  uint32_t nextThreadId = 1;
+};
+
+static TraceRegistry &traceRegistry() {
+  // Never destroyed, so threads can exit during static destruction
+  static TraceRegistry *registry = new TraceRegistry();
+  return *registry;
+}
+
+static int64_t steadyNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static TraceBuffer &traceBuffer() {
+  thread_local std::shared_ptr<TraceBuffer> buffer;
+  if (!buffer) {
+    buffer = std::make_shared<TraceBuffer>();
+
+    auto &registry = traceRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    buffer->threadId = registry.nextThreadId++;
+    registry.buffers.push_back(buffer);
+  }
+
+  return *buffer;
+}
+
+// Escapes a thread name for JSON
+static std::string jsonString(const std::string &str) {
+  std::string escaped = "\"";
+  for (char c : str) {
+    if ((c == '"') || (c == '\\')) {
+      escaped += '\\';
+      escaped += c;
+    } else if ((unsigned char)c < 0x20) {
+      escaped += ' ';
+    } else {
+      escaped += c;
+    }
+  }
+
+  escaped += '"';
+
+  return escaped;
+}
+
+PIPERPHONEMIZE_EXPORT void start_trace() {
+  auto &registry = traceRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+
+  // Drop buffers of threads that have exited
+  registry.buffers.erase(
+      std::remove_if(registry.buffers.begin(), registry.buffers.end(),
+                     [](const std::shared_ptr<TraceBuffer> &buffer) {
+                       return buffer.use_count() == 1;
+                     }),
+      registry.buffers.end());
+
+  for (auto &buffer : registry.buffers) {
+    std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+    buffer->events.clear();
+  }
+
+  registry.startNanos = steadyNanos();
+  registry.tracing = true;
+}
+
+PIPERPHONEMIZE_EXPORT void stop_trace() { traceRegistry().tracing = false; }
+
+PIPERPHONEMIZE_EXPORT bool is_tracing() {
+  return traceRegistry().tracing.load(std::memory_order_relaxed);
+}
+
+PIPERPHONEMIZE_EXPORT void set_trace_thread_name(const std::string &name) {
+  auto &buffer = traceBuffer();
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+  buffer.threadName = name;
+}
+
+PIPERPHONEMIZE_EXPORT int64_t trace_now_nanos() {
+  return steadyNanos() -
+         traceRegistry().startNanos.load(std::memory_order_relaxed);
+}
+
+PIPERPHONEMIZE_EXPORT void record_trace_span(const char *name,
+                                             int64_t startNanos,
+                                             int64_t endNanos,
+                                             const TraceArg *args,
+                                             std::size_t numArgs) {
+  if (startNanos < 0) {
+    // Started before start_trace
+    return;
+  }
+
+  TraceEvent event;
+  event.name = name;
+  event.startNanos = startNanos;
+  event.durationNanos = endNanos - startNanos;
+  event.numArgs = std::min(numArgs, MAX_TRACE_ARGS);
+  std::copy(args, args + event.numArgs, event.args.begin());
+
+  auto &buffer = traceBuffer();
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+  buffer.events.push_back(event);
+}
+
+PIPERPHONEMIZE_EXPORT void write_trace(std::ostream &out) {
+  auto &registry = traceRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+  bool firstEvent = true;
+  auto startEvent = [&out, &firstEvent]() {
+    if (!firstEvent) {
+      out << ",\n";
+    }
+
+    firstEvent = false;
+  };
+
+  for (auto &buffer : registry.buffers) {
+    std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+
+    if (!buffer->threadName.empty()) {
+      startEvent();
+      out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+          << buffer->threadId << ",\"args\":{\"name\":"
+          << jsonString(buffer->threadName) << "}}";
+    }
+
+    for (auto &event : buffer->events) {
+      // Timestamps are in microseconds
+      startEvent();
+      out << "{\"name\":\"" << event.name
+          << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadId
+          << ",\"ts\":" << (event.startNanos / 1000) << "."
+          << ((event.startNanos % 1000) / 100)
+          << ",\"dur\":" << (event.durationNanos / 1000) << "."
+          << ((event.durationNanos % 1000) / 100);
+
+      if (event.numArgs > 0) {
+        out << ",\"args\":{";
+        for (std::size_t i = 0; i < event.numArgs; i++) {
+          if (i > 0) {
+            out << ",";
+          }
+
+          out << "\"" << event.args[i].key << "\":" << event.args[i].value;
+        }
+
+        out << "}";
+      }
+
+      out << "}";
+    }
+  }
+
+  out << "]}" << std::endl;
+}
+
+} // namespace piper
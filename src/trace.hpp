@@ -0,0 +1,87 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "shared.hpp"
+
+// Timeline of spans in Chrome trace event format.
+// Open the output in chrome://tracing or https://ui.perfetto.dev
+//
+// Each thread records into its own buffer, and nothing is recorded unless
+// start_trace has been called.
+namespace piper {
+
+const std::size_t MAX_TRACE_ARGS = 2;
+
+struct TraceArg {
+  const char *key = nullptr;
+  int64_t value = 0;
+};
+
+// Clears previous events and starts recording
+PIPERPHONEMIZE_EXPORT void start_trace();
+PIPERPHONEMIZE_EXPORT void stop_trace();
+PIPERPHONEMIZE_EXPORT bool is_tracing();
+
+// Shown instead of the thread id (e.g., "worker 2")
+PIPERPHONEMIZE_EXPORT void set_trace_thread_name(const std::string &name);
+
+// Writes {"traceEvents": [...]} with events from all threads
+PIPERPHONEMIZE_EXPORT void write_trace(std::ostream &out);
+
+PIPERPHONEMIZE_EXPORT int64_t trace_now_nanos();
+PIPERPHONEMIZE_EXPORT void record_trace_span(const char *name,
+                                             int64_t startNanos,
+                                             int64_t endNanos,
+                                             const TraceArg *args,
+                                             std::size_t numArgs);
+
+// Records a span from construction until it goes out of scope.
+// Spans on the same thread nest by time.
+class TraceSpan {
+public:
+  // name must be a string literal
+  explicit TraceSpan(const char *name) : name(name), active(is_tracing()) {
+    if (active) {
+      startNanos = trace_now_nanos();
+    }
+  }
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+  ~TraceSpan() { end(); }
+
+  // Records the span now instead of when it goes out of scope
+  void end() {
+    if (active) {
+      record_trace_span(name, startNanos, trace_now_nanos(), args.data(),
+                        numArgs);
+      active = false;
+    }
+  }
+
+  // key must be a string literal
+  void addArg(const char *key, int64_t value) {
+    if (active && (numArgs < MAX_TRACE_ARGS)) {
+      args[numArgs].key = key;
+      args[numArgs].value = value;
+      numArgs++;
+    }
+  }
+
+private:
+  const char *name;
+  bool active;
+  int64_t startNanos = 0;
+  std::array<TraceArg, MAX_TRACE_ARGS> args;
+  std::size_t numArgs = 0;
+};
+
+} // namespace piper
+
+#endif // TRACE_H_